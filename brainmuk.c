@@ -1,29 +1,56 @@
+/* For strdup() and REG_R13. */
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <ctype.h>
+#include <inttypes.h>
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <ucontext.h>
 #include <unistd.h>
 
 #include <bf_alloc.h>
 #include <bf_version.h>
 #include <bf_runtime.h>
 #include <bf_arguments.h>
+#include <bf_cache.h>
 #include <bf_compile.h>
+#include <bf_emit.h>
+#include <bf_ir.h>
+#include <bf_lanes.h>
+#include <bf_memo.h>
+#include <bf_output.h>
+#include <bf_pipe.h>
+#include <bf_profile.h>
 #include <bf_slurp.h>
+#include <bf_universe.h>
 
 #define REPL_LINE_LENGTH 1024
 
 static char* program_name = NULL;
 static void run_file(bf_options *options);
+static void run_pipeline(bf_options *options);
 static void repl(bf_options *options);
 
 int main(int argc, char *argv[]) {
     program_name = argv[0];
     bf_options options = parse_arguments(argc, argv);
 
+    /* Never have memory that is both writable and executable, if asked. */
+    if (options.dual_map) {
+        bf_code_arena_set_mapping(BF_CODE_MAPPING_DUAL);
+    }
+
     /* Check if a file has been provided. */
     if (options.filename == NULL) {
         repl(&options);
+    } else if (options.pipe) {
+        run_pipeline(&options);
     } else {
         run_file(&options);
     }
@@ -32,27 +59,373 @@ int main(int argc, char *argv[]) {
 }
 
 
-static uint8_t* create_universe(bf_options *options) {
-    uint8_t* universe =
-        calloc(options->minimum_universe_size, sizeof(uint8_t));
-    if (universe == NULL) {
+/*
+ * What is known about the running program, to report where it failed; each
+ * stage of a pipeline is one, in a thread of its own.
+ */
+static _Thread_local struct {
+    const char *filename;
+    const char *source;
+    const uint8_t *code;
+    size_t code_length;
+    const bf_source_map *map;
+    const uint8_t *origin;
+
+    /* Where its output is buffered, and how to write it. */
+    uint8_t *output_start;
+    uint8_t *output_end;
+    struct bf_output_space (*flush_output)(uint8_t *, uint8_t *);
+} running;
+
+static void report_cell(bool located, size_t offset, ptrdiff_t cell,
+        uint8_t *output_cursor) {
+    /* Whatever the program printed so far is still worth seeing. */
+    fflush(stdout);
+    if (output_cursor > running.output_start
+            && output_cursor <= running.output_end) {
+        running.flush_output(running.output_start, output_cursor);
+    }
+    bf_output_close();
+
+    if (located && running.source != NULL) {
+        unsigned long line = 1, column = 1;
+        for (size_t i = 0; i < offset; i++) {
+            if (running.source[i] == '\n') {
+                line++;
+                column = 1;
+            } else {
+                column++;
+            }
+        }
+
+        fprintf(stderr, "%s: %s:%lu:%lu: cell %td is out of bounds\n",
+                program_name, running.filename, line, column, cell);
+    } else {
+        fprintf(stderr, "%s: cell %td is out of bounds\n",
+                program_name, cell);
+    }
+
+    _exit(-1);
+}
+
+static void report_out_of_bounds(const void *pc, ptrdiff_t cell,
+        const void *registers) {
+    const uint8_t *instruction = pc;
+    size_t offset = 0;
+    bool in_program = instruction >= running.code
+            && instruction < running.code + running.code_length;
+    bool located = in_program && running.map != NULL
+            && bf_source_map_lookup(running.map, instruction - running.code,
+                &offset);
+
+    /* Compiled code keeps its output cursor in %r13. */
+    const ucontext_t *context = registers;
+    uint8_t *output_cursor = in_program
+        ? (uint8_t *) context->uc_mcontext.gregs[REG_R13]
+        : NULL;
+
+    report_cell(located, offset, cell, output_cursor);
+}
+
+/* Called by programs compiled with bounds checks. */
+static void report_checked_out_of_bounds(uint32_t source_offset,
+        uint8_t *cell, uint8_t *output_cursor) {
+    report_cell(true, source_offset, cell - running.origin, output_cursor);
+}
+
+/* Called when a lane of --lanes strays too far. */
+static void report_lane_out_of_bounds(size_t source_offset, ptrdiff_t cell) {
+    report_cell(true, source_offset, cell, NULL);
+}
+
+/*
+ * How many cells the universe starts with: exactly enough when the program
+ * can only ever touch a known range of cells (bounded, as found by
+ * bf_ir_pointer_range()), or as many as requested.
+ */
+static size_t universe_size(bool bounded, int64_t low, int64_t high,
+        const bf_options *options) {
+    if (!bounded || options->tape == BF_TAPE_WRAP) {
+        return options->minimum_universe_size;
+    }
+
+    /* p starts in the middle. */
+    return 2 * (size_t) (-low > high + 1 ? -low : high + 1);
+}
+
+static void create_universe(bf_universe *universe, size_t size,
+        bf_options *options) {
+    size_t maximum = size > BF_UNIVERSE_MAXIMUM ? size : BF_UNIVERSE_MAXIMUM;
+
+    /* A circular tape, or one whose bounds are checked, never grows. */
+    if (options->tape == BF_TAPE_WRAP || options->bounds_check) {
+        maximum = size;
+    }
+
+    /* The tape of an earlier run is as big as it was then. */
+    if (options->universe_file != NULL) {
+        if (!bf_universe_create_from_file(universe, options->universe_file,
+                    options->minimum_universe_size)) {
+            fprintf(stderr, "%s: could not map universe file '%s': ",
+                    program_name, options->universe_file);
+            perror(NULL);
+            exit(-1);
+        }
+    } else if (!bf_universe_create(universe, size, maximum)) {
         fprintf(stderr, "%s: could not create universe (%lu bytes): ",
-                program_name, options->minimum_universe_size);
+                program_name, size);
         perror(NULL);
         exit(-1);
     }
 
-    return universe;
+    bf_universe_watch(universe, report_out_of_bounds);
+}
+
+/* The mask for indices into a circular tape, or 0 if it isn't one. */
+static uint32_t wrap_mask(const bf_options *options) {
+    if (options->tape != BF_TAPE_WRAP) {
+        return 0;
+    }
+    return options->minimum_universe_size - 1;
+}
+
+/* Where p starts: the middle of a growable universe, or the first cell of a
+ * circular one. */
+static uint8_t *tape_start(bf_universe *universe, const bf_options *options) {
+    if (options->tape == BF_TAPE_WRAP) {
+        return universe->low;
+    }
+    return universe->origin;
 }
 
-static struct bf_runtime_context normal_context(uint8_t *universe) {
+static struct bf_runtime_context normal_context(bf_universe *universe,
+        const bf_options *options) {
+    running.origin = universe->origin;
+    running.output_start = bf_runtime_output_buffer;
+    running.output_end = bf_runtime_output_buffer
+        + BF_RUNTIME_OUTPUT_BUFFER_SIZE;
+    running.flush_output = bf_runtime_flush_output;
+
     return ((struct bf_runtime_context) {
-            .universe = universe,
+            .universe = tape_start(universe, options),
             .output_byte = bf_runtime_output_byte,
-            .input_byte = bf_runtime_input_byte
+            .input_byte = bf_runtime_input_byte,
+            .tape_start = universe->low,
+            .tape_end = universe->high,
+            .out_of_bounds = report_checked_out_of_bounds,
+            .output_start = running.output_start,
+            .output_end = running.output_end,
+            .flush_output = running.flush_output,
+            .input_start = bf_runtime_input_buffer,
+            .input_end = bf_runtime_input_buffer + BF_RUNTIME_INPUT_BUFFER_SIZE,
+            .fill_input = bf_runtime_fill_input,
+            .copy_input = bf_runtime_copy_input,
+            .write_output = bf_runtime_write_output,
     });
 }
 
+/* Makes the --input file standard input, once the program has been read. */
+static void redirect_input(const bf_options *options) {
+    if (options->input_filename == NULL) {
+        return;
+    }
+
+    int fd = open(options->input_filename, O_RDONLY);
+    if (fd < 0 || dup2(fd, STDIN_FILENO) < 0) {
+        fprintf(stderr, "%s: Could not open '%s': ",
+                program_name, options->input_filename);
+        perror(NULL);
+        exit(-1);
+    }
+    close(fd);
+}
+
+/* Opens the -o file, if any, to write the program's output to. */
+static int open_output_file(const bf_options *options) {
+    if (options->output_filename == NULL) {
+        return -1;
+    }
+
+    /* Mapping it needs it to be readable too. */
+    int fd = open(options->output_filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "%s: Could not open '%s': ",
+                program_name, options->output_filename);
+        perror(NULL);
+        exit(-1);
+    }
+    return fd;
+}
+
+/* Makes the -o file, if any, standard output. */
+static void redirect_output(int fd) {
+    if (fd >= 0) {
+        fflush(stdout);
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+    }
+}
+
+/*
+ * Output that never has to be copied: written straight into the -o file, or
+ * handed to a pipe page by page. Anything else is written as usual, unless
+ * --async-output has a thread write it. *direct is cleared if flushed output
+ * does not reach standard output there and then.
+ */
+static bool open_output_buffer(const bf_options *options,
+        bf_output_buffer *buffer, bool *direct) {
+    int fd = open_output_file(options);
+
+    if (options->async_output) {
+        redirect_output(fd);
+        *direct = false;
+        return bf_output_async(STDOUT_FILENO, buffer);
+    }
+
+    /* The file stays open for as long as it is mapped. */
+    if (fd >= 0 && bf_output_map(fd, buffer)) {
+        *direct = false;
+        return true;
+    }
+
+    redirect_output(fd);
+    return bf_output_splice(STDOUT_FILENO, buffer);
+}
+
+/*
+ * Input mapped by slurp_input() is all there from the start: the first fill
+ * hands over all of it, and every one after that, nothing.
+ */
+static uint8_t *fill_mapped_input(uint8_t *start, uint8_t *end) {
+    static bool filled = false;
+
+    if (filled) {
+        return start;
+    }
+
+    filled = true;
+    return end;
+}
+
+/*
+ * For --fork: the input files, and the output of the program before it first
+ * asks for input, which every copy of the program has to print.
+ */
+static struct {
+    char **inputs;
+    size_t count;
+    FILE *setup_output;
+    char *setup_data;
+    size_t setup_length;
+} snapshot;
+
+static struct bf_output_space snapshot_flush_output(uint8_t *start,
+        uint8_t *cursor) {
+    if (snapshot.setup_output == NULL) {
+        return bf_runtime_flush_output(start, cursor);
+    }
+
+    fwrite(start, 1, cursor - start, snapshot.setup_output);
+    return (struct bf_output_space) { start, running.output_end };
+}
+
+/* Stops collecting output; what has been collected is in setup_data. */
+static void finish_setup_output(void) {
+    if (snapshot.setup_output != NULL) {
+        fclose(snapshot.setup_output);
+        snapshot.setup_output = NULL;
+    }
+}
+
+/* Runs one copy of the program per input, each in a child of this process. */
+static int fork_per_input(void) {
+    int failures = 0;
+
+    /* Nothing buffered may be printed twice. */
+    fflush(stdout);
+
+    for (size_t i = 0; i < snapshot.count; i++) {
+        int fd = open(snapshot.inputs[i], O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "%s: Could not open '%s': ",
+                    program_name, snapshot.inputs[i]);
+            perror(NULL);
+            failures++;
+            continue;
+        }
+
+        pid_t child = fork();
+        if (child == 0) {
+            /* Continue where the parent left off, reading from the input. */
+            dup2(fd, STDIN_FILENO);
+            close(fd);
+            fwrite(snapshot.setup_data, 1, snapshot.setup_length, stdout);
+            return -1;
+        }
+        close(fd);
+
+        /* One at a time, so that the outputs are not interleaved. */
+        int status;
+        if (child < 0 || waitpid(child, &status, 0) < 0
+                || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failures++;
+        }
+    }
+
+    return failures;
+}
+
+/*
+ * The first input the program asks for is where it is snapshotted: the
+ * process forks, copy-on-write, once per input. The children carry on
+ * reading input; the parent waits for them, and never returns.
+ */
+static uint8_t *snapshot_fill_input(uint8_t *start, uint8_t *end) {
+    if (snapshot.inputs != NULL) {
+        finish_setup_output();
+
+        int failures = fork_per_input();
+        if (failures >= 0) {
+            exit(failures > 0 ? -1 : 0);
+        }
+
+        snapshot.inputs = NULL;
+    }
+
+    return bf_runtime_fill_input(start, end);
+}
+
+/* Like bf_compile(), but optimizes as requested by the options. */
+static bf_compile_result compile_line(const char *line, bf_options *options) {
+    bf_program_text text = (bf_program_text) {
+        .space = NULL,
+        .allocated_space = 0,
+        .should_resize = true,
+    };
+    bf_codegen_options codegen = {
+        .wrap_mask = wrap_mask(options),
+        .bounds_check = options->bounds_check,
+        /* Input is not buffered: what one line reads ahead, the next would
+         * not see. */
+        .buffer_output = true,
+    };
+    bf_compile_result result = { .status = BF_COMPILE_UNMATCHED_BRACKET };
+    bf_ir ir;
+
+    if (bf_ir_parse(line, &ir)) {
+        /* Each line carries on from the tape the last one left. */
+        ir.blank_tape = false;
+        bf_ir_run_passes(&ir, options->passes, NULL);
+        if (options->bounds_check) {
+            bf_ir_place_bounds_checks(&ir);
+        }
+        result = bf_compile_ir(&ir, &text, &codegen);
+    }
+
+    bf_ir_free(&ir);
+    return result;
+}
+
 static void prompt(const char *herp) {
     printf("%s ", herp);
     fflush(stdout);
@@ -72,10 +445,9 @@ static void repl(bf_options *options) {
     printf("brainmuk repl " BF_VERSION "\n"
            "Press ctrl+d to exit\n");
 
-    /* Prepare universe and executable space. */
-    const size_t exec_mem_size = sysconf(_SC_PAGESIZE);
-    uint8_t *universe = create_universe(options);
-    uint8_t *exec_mem = allocate_executable_space(exec_mem_size);
+    /* Prepare the universe; each line gets its own code from the arena. */
+    bf_universe universe;
+    create_universe(&universe, universe_size(false, 0, 0, options), options);
 
     do {
         prompt("#%@!>");
@@ -86,7 +458,7 @@ static void repl(bf_options *options) {
         }
 
         /* Eval. */
-        bf_compile_result result = bf_compile_no_alloc(line, exec_mem);
+        bf_compile_result result = compile_line(line, options);
 
         if (result.status != BF_COMPILE_SUCCESS) {
             fprintf(stderr, "compile error (check brackets?)\n");
@@ -94,51 +466,679 @@ static void repl(bf_options *options) {
         }
 
         /* Run! */
-        result.program(normal_context(universe));
+        result.program(normal_context(&universe, options));
+        free_executable_space((void *) result.program, result.program_size);
 
         /* (The program should print stuff itself... */
     } while (!feof(stdin));
 
-    free(universe);
+    bf_universe_destroy(&universe);
 }
 
-static void run_program(program_t program, bf_options *options) {
-    /* Allocate the ENTIRE UNIVERSE and run. */
-    uint8_t *universe = calloc(options->minimum_universe_size, sizeof(uint8_t));
+/* Runs the program on a universe of the given size; ir holds (at least) its
+ * memoized loops. */
+static void run_program(program_t program, const bf_ir *ir, size_t size,
+        bf_options *options, uint64_t *loop_counters) {
+    /* Reserve the ENTIRE UNIVERSE and run. */
+    bf_universe universe;
+    create_universe(&universe, size, options);
 
-    assert(universe != NULL);
+    struct bf_memo *memo = bf_memo_create(ir, bf_universe_start(&universe),
+            bf_universe_size(&universe));
 
-    program((struct bf_runtime_context) {
-            .universe = universe,
-            .output_byte = bf_runtime_output_byte,
-            .input_byte = bf_runtime_input_byte
-    });
+    struct bf_runtime_context context = normal_context(&universe, options);
+    context.loop_counters = loop_counters;
+    context.memo = memo;
+    context.memo_enter = bf_memo_enter;
+    context.memo_leave = bf_memo_leave;
+
+    /* A stage of a pipeline reads the one before it, and writes the next;
+     * output stuck in between is lost anyway, should it fail. */
+    enum bf_pipe_ends piped = bf_pipe_connect(&context);
+    if (!(piped & BF_PIPE_INPUT)) {
+        redirect_input(options);
+    }
+    if (piped & BF_PIPE_OUTPUT) {
+        running.output_start = NULL;
+        running.output_end = NULL;
+    }
 
-    free(universe);
+    if (options->fork) {
+        snapshot.inputs = options->inputs;
+        snapshot.count = options->input_count;
+        snapshot.setup_output = open_memstream(&snapshot.setup_data,
+                &snapshot.setup_length);
+        assert(snapshot.setup_output != NULL);
+
+        /* Programs empty their output buffer before they read input. */
+        running.flush_output = snapshot_flush_output;
+        context.flush_output = snapshot_flush_output;
+        context.fill_input = snapshot_fill_input;
+    }
+
+    /* A file need not be copied into the buffer: read it where it is. */
+    size_t input_length = 0;
+    const uint8_t *input = options->fork || (piped & BF_PIPE_INPUT)
+        ? NULL
+        : slurp_input(STDIN_FILENO, &input_length);
+    if (input != NULL) {
+        context.input_start = (uint8_t *) input;
+        context.input_end = (uint8_t *) input + input_length;
+        context.fill_input = fill_mapped_input;
+    }
+
+    bf_output_buffer output;
+    bool direct = !(piped & BF_PIPE_OUTPUT);
+    bool opened = !options->fork && !(piped & BF_PIPE_OUTPUT)
+        && open_output_buffer(options, &output, &direct);
+    if (opened) {
+        running.output_start = output.start;
+        running.output_end = output.end;
+        running.flush_output = bf_output_flush;
+        context.output_start = output.start;
+        context.output_end = output.limit;
+        context.flush_output = bf_output_flush;
+    }
+
+    /* A mapped file can be copied by the kernel, if output is not held. */
+    if (input != NULL && direct) {
+        bf_runtime_copy_in_kernel(input, STDIN_FILENO,
+                lseek(STDIN_FILENO, 0, SEEK_CUR), STDOUT_FILENO);
+    }
+
+    program(context);
+
+    if (opened && !bf_output_close()) {
+        fprintf(stderr, "%s: could not write output\n", program_name);
+        exit(-1);
+    }
+
+    if (input != NULL) {
+        bf_runtime_copy_in_kernel(NULL, -1, 0, -1);
+        unslurp_input(input, input_length);
+    }
+
+    /* A program that never reads input prints the same for every input. */
+    if (options->fork && snapshot.inputs != NULL) {
+        finish_setup_output();
+        for (size_t i = 0; i < snapshot.count; i++) {
+            fwrite(snapshot.setup_data, 1, snapshot.setup_length, stdout);
+        }
+    }
+    if (options->fork) {
+        free(snapshot.setup_data);
+    }
+
+    bf_memo_free(memo);
+    bf_universe_destroy(&universe);
 }
 
-static void run_file(bf_options *options) {
-    char *contents = slurp(options->filename);
+/*
+ * Names the cache file for the program, as compiled for running with these
+ * options; NULL if it should not be cached.
+ */
+static char *cache_filename(const char *source, const bf_options *options) {
+    char variant[128];
 
-    /* Try to open the file... */
-    if (contents == NULL) {
-        fprintf(stderr, "%s: Could not open '%s': ",
+    /* Profiles change the code without changing the source. */
+    if (!options->cache || options->emit != BF_EMIT_JIT || options->lanes > 0
+            || options->profile_generate != NULL
+            || options->profile_use != NULL || options->report_passes) {
+        return NULL;
+    }
+
+    /* The code itself is versioned by BF_CODE_ABI_VERSION. */
+    snprintf(variant, sizeof(variant), "passes=%" PRIx32 " wrap=%" PRIx32
+            " bounds-check=%d universe-file=%d",
+            options->passes, wrap_mask(options),
+            options->bounds_check, options->universe_file != NULL);
+    return bf_cache_filename(source, variant);
+}
+
+/* Runs a program loaded from the code cache. */
+static void run_cached(bf_cached_program *cached, const char *source,
+        bf_options *options) {
+    running.filename = options->filename;
+    running.source = source;
+    running.code = (const uint8_t *) cached->program;
+    running.code_length = cached->code_length;
+    running.map = &cached->map;
+
+    run_program(cached->program, &cached->memoized,
+            universe_size(cached->bounded, cached->low, cached->high, options),
+            options, NULL);
+    running.map = NULL;
+}
+
+/*
+ * Compiles the program to be run, storing the code in the cache, if any, and
+ * works out how big its universe should be.
+ */
+static bf_compile_result compile_jit(bf_ir *ir, const char *filename,
+        const char *cache, bf_source_map *map, const bf_options *options,
+        size_t *size) {
+    bf_program_text text = (bf_program_text) {
+        .space = NULL,
+        .allocated_space = 0,
+        .should_resize = true,
+    };
+    bf_codegen_options codegen = {
+        .count_loops = options->profile_generate != NULL,
+        .memoize = true,
+        .source_map = map,
+        .wrap_mask = wrap_mask(options),
+        .bounds_check = options->bounds_check,
+        .buffer_output = true,
+        .buffer_input = true,
+        .copy_loops = true,
+        .coalesce_output = true,
+        .blank_tape = ir->blank_tape,
+    };
+    int64_t low, high;
+    bool bounded = bf_ir_pointer_range(ir, &low, &high);
+
+    /* A program that fits its universe exactly needs no checks. */
+    if (options->bounds_check && !bounded) {
+        bf_ir_place_bounds_checks(ir);
+    }
+
+    bf_compile_result compilation = bf_compile_ir(ir, &text, &codegen);
+
+    if (compilation.status != BF_COMPILE_SUCCESS) {
+        fprintf(stderr, "%s: %s: compilation failed!\n",
+                program_name, filename);
+        exit(compilation.status);
+    }
+
+    /* Failing to cache only costs the next run time. */
+    if (cache != NULL) {
+        bf_cache_store(cache, ir, (const uint8_t *) compilation.program,
+                compilation.code_length, map);
+    }
+
+    *size = universe_size(bounded, low, high, options);
+    return compilation;
+}
+
+/* Compiles and runs the program, storing the code in the cache, if any. */
+static void run_jit(bf_ir *ir, const char *source, const char *cache,
+        bf_options *options) {
+    bf_source_map map = { 0 };
+    bool count_loops = options->profile_generate != NULL;
+    uint64_t *loop_counters = NULL;
+    size_t size;
+
+    bf_compile_result compilation = compile_jit(ir, options->filename, cache,
+            &map, options, &size);
+
+    if (count_loops) {
+        loop_counters = calloc(bf_profile_counter_count(ir) + 1,
+                sizeof(uint64_t));
+        assert(loop_counters != NULL);
+    }
+
+    running.filename = options->filename;
+    running.source = source;
+    running.code = (const uint8_t *) compilation.program;
+    running.code_length = compilation.code_length;
+    running.map = &map;
+
+    run_program(compilation.program, ir, size, options, loop_counters);
+    free_executable_space((void *) compilation.program, compilation.program_size);
+    running.map = NULL;
+    bf_source_map_free(&map);
+
+    if (count_loops) {
+        /* Make sure the output is out before complaining. */
+        fflush(stdout);
+        if (!bf_profile_write(options->profile_generate, ir, loop_counters)) {
+            fprintf(stderr, "%s: Could not write profile '%s': ",
+                    program_name, options->profile_generate);
+            perror(NULL);
+            exit(-1);
+        }
+        free(loop_counters);
+    }
+}
+
+/* Runs the program once per line of standard input, in lock-step. */
+static void run_lanes(const bf_ir *ir, const char *source,
+        bf_options *options) {
+    struct bf_lane_record *records = NULL;
+    size_t count = 0, capacity = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+
+    redirect_input(options);
+    redirect_output(open_output_file(options));
+    while ((length = getline(&line, &line_capacity, stdin)) >= 0) {
+        if (count == capacity) {
+            capacity = capacity == 0 ? 64 : 2 * capacity;
+            records = realloc(records, capacity * sizeof(*records));
+            if (records == NULL) {
+                abort();
+            }
+        }
+
+        records[count++] = (struct bf_lane_record) {
+            .data = (uint8_t *) line,
+            .length = length,
+        };
+        line = NULL;
+        line_capacity = 0;
+    }
+    free(line);
+
+    running.filename = options->filename;
+    running.source = source;
+    bool written = bf_lanes_run(ir, options->lanes,
+            options->minimum_universe_size, records, count, stdout,
+            report_lane_out_of_bounds);
+
+    for (size_t i = 0; i < count; i++) {
+        free((void *) records[i].data);
+    }
+    free(records);
+
+    if (!written) {
+        fprintf(stderr, "%s: could not write output\n", program_name);
+        exit(-1);
+    }
+}
+
+static void emit_c(const bf_ir *ir, bf_options *options) {
+    FILE *stream = stdout;
+
+    if (options->output_filename != NULL) {
+        stream = fopen(options->output_filename, "w");
+        if (stream == NULL) {
+            fprintf(stderr, "%s: Could not open '%s': ",
+                    program_name, options->output_filename);
+            perror(NULL);
+            exit(-1);
+        }
+    }
+
+    bool written = bf_emit_c(ir, options->minimum_universe_size, stream);
+    if (stream != stdout) {
+        written = (fclose(stream) == 0) && written;
+    }
+
+    if (!written) {
+        fprintf(stderr, "%s: could not write C source\n", program_name);
+        exit(-1);
+    }
+}
+
+static void emit_executable(const bf_ir *ir, bf_options *options) {
+    const char *output_filename = options->output_filename != NULL
+        ? options->output_filename
+        : "a.out";
+
+    if (!bf_emit_executable(ir, options->minimum_universe_size,
+                output_filename)) {
+        fprintf(stderr, "%s: %s: C compiler failed\n",
                 program_name, options->filename);
+        exit(-1);
+    }
+}
+
+/*
+ * Returns a malloc'd copy of the final path component of filename, with the
+ * extension (if any) replaced with the given one.
+ */
+static char *replace_extension(const char *filename, const char *extension) {
+    const char *base = strrchr(filename, '/');
+    base = base != NULL ? base + 1 : filename;
+
+    const char *dot = strrchr(base, '.');
+    size_t stem_length = dot != NULL && dot != base
+        ? (size_t) (dot - base)
+        : strlen(base);
+
+    char *result = malloc(stem_length + strlen(extension) + 1);
+    if (result == NULL) {
+        abort();
+    }
+
+    memcpy(result, base, stem_length);
+    strcpy(result + stem_length, extension);
+    return result;
+}
+
+/* Turns the stem of the filename into a valid C identifier. */
+static char *symbol_for(const char *filename) {
+    char *symbol = replace_extension(filename, "");
+
+    for (char *c = symbol; *c != '\0'; c++) {
+        if (!isalnum((unsigned char) *c)) {
+            *c = '_';
+        }
+    }
+
+    if (*symbol == '\0' || isdigit((unsigned char) *symbol)) {
+        char *prefixed = malloc(strlen(symbol) + 4);
+        if (prefixed == NULL) {
+            abort();
+        }
+        sprintf(prefixed, "bf_%s", symbol);
+        free(symbol);
+        symbol = prefixed;
+    }
+
+    return symbol;
+}
+
+static FILE *open_output(const char *filename) {
+    FILE *stream = fopen(filename, "wb");
+    if (stream == NULL) {
+        fprintf(stderr, "%s: Could not open '%s': ", program_name, filename);
         perror(NULL);
         exit(-1);
     }
+    return stream;
+}
 
-    /* Compile and forget the source. */
-    bf_compile_result compilation = bf_compile(contents);
-    unslurp(contents);
+static void emit_object(bf_ir *ir, bf_options *options) {
+    char *object_filename = options->output_filename != NULL
+        ? strdup(options->output_filename)
+        : replace_extension(options->filename, ".o");
+    char *header_filename = replace_extension(object_filename, ".h");
+    char *symbol = options->symbol != NULL
+        ? strdup(options->symbol)
+        : symbol_for(object_filename);
 
-    if (compilation.status == BF_COMPILE_SUCCESS) {
-        run_program(compilation.program, options);
-        free_executable_space((void *) compilation.program, compilation.program_size);
-    } else {
+    /* Keep the header next to the object. */
+    const char *slash = strrchr(object_filename, '/');
+    if (slash != NULL) {
+        size_t directory_length = slash - object_filename + 1;
+        char *path = malloc(directory_length + strlen(header_filename) + 1);
+        if (path == NULL) {
+            abort();
+        }
+        memcpy(path, object_filename, directory_length);
+        strcpy(path + directory_length, header_filename);
+        free(header_filename);
+        header_filename = path;
+    }
+
+    bf_program_text text = (bf_program_text) {
+        .space = NULL,
+        .allocated_space = 0,
+        .should_resize = true,
+    };
+    bf_codegen_options codegen = {
+        .bounds_check = options->bounds_check,
+        .track_dirty = options->track_dirty,
+    };
+
+    /* The caller's tape may be any size. */
+    if (options->bounds_check || options->track_dirty) {
+        bf_ir_place_bounds_checks(ir);
+    }
+
+    bf_compile_result compilation = bf_compile_ir(ir, &text, &codegen);
+    if (compilation.status != BF_COMPILE_SUCCESS) {
         fprintf(stderr, "%s: %s: compilation failed!\n",
                 program_name, options->filename);
+        exit(compilation.status);
+    }
+
+    FILE *object = open_output(object_filename);
+    bool written = bf_emit_object((uint8_t *) compilation.program,
+            compilation.code_length, symbol, object);
+    written = (fclose(object) == 0) && written;
+
+    FILE *header = open_output(header_filename);
+    written = bf_emit_header(symbol, header) && written;
+    written = (fclose(header) == 0) && written;
+
+    free_executable_space((void *) compilation.program, compilation.program_size);
+
+    if (!written) {
+        fprintf(stderr, "%s: could not write '%s' or '%s'\n",
+                program_name, object_filename, header_filename);
+        exit(-1);
     }
 
-    exit(compilation.status);
+    free(symbol);
+    free(header_filename);
+    free(object_filename);
+}
+
+static bool parse_chunk(const char *chunk, size_t length, void *parser) {
+    return bf_ir_parse_chunk(parser, chunk, length);
+}
+
+/* Parses the program as it is read, without ever keeping all of it. */
+static bool parse_stream(const char *filename, bf_ir *ir) {
+    bf_ir_parser parser;
+
+    bf_ir_parser_init(&parser);
+    if (!slurp_chunks(filename, parse_chunk, &parser)) {
+        fprintf(stderr, "%s: Could not open '%s': ", program_name, filename);
+        perror(NULL);
+        exit(-1);
+    }
+
+    return bf_ir_parse_finish(&parser, ir);
+}
+
+/*
+ * Reads the source of the program, if it is a file: pipes and such cannot be
+ * mapped, so their source is not kept, but parsed as it is read.
+ *
+ * @return the source, or NULL if it is not kept.
+ */
+static char *read_program(const char *filename) {
+    if (!slurpable(filename)) {
+        return NULL;
+    }
+
+    char *contents = slurp(filename);
+    if (contents == NULL) {
+        fprintf(stderr, "%s: Could not open '%s': ", program_name, filename);
+        perror(NULL);
+        exit(-1);
+    }
+    return contents;
+}
+
+/* Parses the program, from the source read_program() kept, if any. */
+static void parse_program(const char *filename, const char *contents,
+        bf_ir *ir, const bf_options *options) {
+    bool parsed = contents == NULL
+        ? parse_stream(filename, ir)
+        : bf_ir_parse(contents, ir);
+
+    if (!parsed) {
+        fprintf(stderr, "%s: %s:%lu:%lu: unmatched bracket\n",
+                program_name, filename, ir->err_line, ir->err_col);
+        bf_ir_free(ir);
+        exit(BF_COMPILE_UNMATCHED_BRACKET);
+    }
+
+    /* A tape kept in a file carries on from the last run. */
+    ir->blank_tape = options->universe_file == NULL;
+}
+
+static void run_file(bf_options *options) {
+    char *contents = read_program(options->filename);
+    bf_cached_program cached;
+    char *cache = NULL;
+    bf_ir ir;
+
+    /* A program compiled before need not be parsed, optimized or compiled. */
+    cache = contents == NULL ? NULL : cache_filename(contents, options);
+    if (cache != NULL && bf_cache_load(cache, &cached)) {
+        run_cached(&cached, contents, options);
+        bf_cache_release(&cached);
+        free(cache);
+        unslurp(contents);
+        exit(BF_COMPILE_SUCCESS);
+    }
+
+    /* Parse, but keep the source to locate errors at runtime. */
+    parse_program(options->filename, contents, &ir, options);
+
+    /* Passes may weigh loops by their profile. */
+    if (options->profile_use != NULL) {
+        bf_profile profile;
+
+        if (!bf_profile_read(options->profile_use, &profile)) {
+            fprintf(stderr, "%s: Could not read profile '%s'\n",
+                    program_name, options->profile_use);
+            exit(-1);
+        }
+
+        bf_profile_apply(&profile, &ir);
+        bf_profile_free(&profile);
+    }
+
+    if (options->report_passes) {
+        fprintf(stderr, "%s: %s: optimizing at -O%d\n",
+                program_name, options->filename, options->optimization_level);
+    }
+    bf_ir_run_passes(&ir, options->passes,
+            options->report_passes ? stderr : NULL);
+
+    switch (options->emit) {
+        case BF_EMIT_JIT:
+            if (options->lanes > 0) {
+                run_lanes(&ir, contents, options);
+            } else {
+                run_jit(&ir, contents, cache, options);
+            }
+            break;
+        case BF_EMIT_C:
+            emit_c(&ir, options);
+            break;
+        case BF_EMIT_EXE:
+            emit_executable(&ir, options);
+            break;
+        case BF_EMIT_OBJ:
+            emit_object(&ir, options);
+            break;
+    }
+
+    bf_ir_free(&ir);
+    free(cache);
+    if (contents != NULL) {
+        unslurp(contents);
+    }
+    exit(BF_COMPILE_SUCCESS);
+}
+
+/* For --pipe: a stage, compiled (or loaded from the cache) and ready to run. */
+struct stage {
+    const char *filename;
+    char *source;
+
+    bool cached;
+    bf_cached_program cache;
+    bf_ir ir;
+    bf_source_map map;
+    bf_compile_result compilation;
+
+    program_t program;
+    size_t code_length;
+    /* Its memoized loops, and where its code came from. */
+    const bf_ir *memoized;
+    const bf_source_map *located;
+    size_t universe_size;
+};
+
+struct pipeline {
+    struct stage *stages;
+    bf_options *options;
+};
+
+/* Reads, parses, optimizes and compiles a stage, as run_file() does a
+ * program, unless the cache has it. */
+static void compile_stage(struct stage *stage, bf_options *options) {
+    char *cache = NULL;
+
+    stage->source = read_program(stage->filename);
+    cache = stage->source == NULL
+        ? NULL
+        : cache_filename(stage->source, options);
+    stage->cached = cache != NULL && bf_cache_load(cache, &stage->cache);
+
+    if (stage->cached) {
+        stage->program = stage->cache.program;
+        stage->code_length = stage->cache.code_length;
+        stage->memoized = &stage->cache.memoized;
+        stage->located = &stage->cache.map;
+        stage->universe_size = universe_size(stage->cache.bounded,
+                stage->cache.low, stage->cache.high, options);
+        free(cache);
+        return;
+    }
+
+    parse_program(stage->filename, stage->source, &stage->ir, options);
+    if (options->report_passes) {
+        fprintf(stderr, "%s: %s: optimizing at -O%d\n",
+                program_name, stage->filename, options->optimization_level);
+    }
+    bf_ir_run_passes(&stage->ir, options->passes,
+            options->report_passes ? stderr : NULL);
+
+    stage->compilation = compile_jit(&stage->ir, stage->filename, cache,
+            &stage->map, options, &stage->universe_size);
+    stage->program = stage->compilation.program;
+    stage->code_length = stage->compilation.code_length;
+    stage->memoized = &stage->ir;
+    stage->located = &stage->map;
+    free(cache);
+}
+
+static void run_stage(size_t i, void *data) {
+    struct pipeline *pipeline = data;
+    struct stage *stage = &pipeline->stages[i];
+
+    running.filename = stage->filename;
+    running.source = stage->source;
+    running.code = (const uint8_t *) stage->program;
+    running.code_length = stage->code_length;
+    running.map = stage->located;
+
+    run_program(stage->program, stage->memoized, stage->universe_size,
+            pipeline->options, NULL);
+}
+
+/* Compiles every stage of the pipeline, then runs them all at once. */
+static void run_pipeline(bf_options *options) {
+    size_t count = options->stage_count;
+    struct stage *stages = calloc(count, sizeof(*stages));
+    if (stages == NULL) {
+        abort();
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        stages[i].filename = options->stages[i];
+        compile_stage(&stages[i], options);
+    }
+
+    struct pipeline pipeline = { stages, options };
+    if (!bf_pipe_run(count, run_stage, &pipeline)) {
+        fprintf(stderr, "%s: could not start the pipeline\n", program_name);
+        exit(-1);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (stages[i].cached) {
+            bf_cache_release(&stages[i].cache);
+        } else {
+            free_executable_space((void *) stages[i].program,
+                    stages[i].compilation.program_size);
+            bf_source_map_free(&stages[i].map);
+            bf_ir_free(&stages[i].ir);
+        }
+        if (stages[i].source != NULL) {
+            unslurp(stages[i].source);
+        }
+    }
+    free(stages);
+    exit(BF_COMPILE_SUCCESS);
 }
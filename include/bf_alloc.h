@@ -12,8 +12,8 @@
 typedef struct program_text_t {
     /**
      * Where the program text (i.e., machine code) can be dumped to.
-     * This is assumed to a contiguous span of pages with read, write, and
-     * execute permissions.
+     * This is assumed to a contiguous span of executable pages, which are
+     * written through bf_writable_code().
      */
     uint8_t *space;
 
@@ -32,6 +32,16 @@ typedef struct program_text_t {
  * Allocates space whose memory protection allows for execution. Use this
  * space to write machine code into the current address space.
  *
+ * Space comes from an arena: one large executable reservation carved into
+ * chunks of a page times a power of two, each aligned to its size (or to
+ * a huge page, for chunks that large, which are then backed by huge pages
+ * where the system allows). Freed chunks are recycled, so compiling many
+ * programs does not map and unmap memory over and over. The arena is not
+ * thread-safe.
+ *
+ * Write to the space through bf_writable_code(): it may not be writable
+ * itself (see bf_code_arena_set_mapping()).
+ *
  * @param   size    number of bytes to allocate
  * @return          a pointer to *at least* `size` bytes of executable space, or
  *                  NULL if allocation failed; errno might be informative.
@@ -46,4 +56,77 @@ uint8_t *allocate_executable_space(size_t size);
  */
 bool free_executable_space(uint8_t *space, size_t size);
 
+/**
+ * How the code arena maps its memory.
+ */
+enum bf_code_mapping {
+    /** Space is both writable and executable. */
+    BF_CODE_MAPPING_RWX = 0,
+    /**
+     * Space is executable, but never writable (W^X): the same memory is
+     * mapped a second time, writable but not executable, elsewhere.
+     */
+    BF_CODE_MAPPING_DUAL,
+};
+
+/**
+ * Chooses how the code arena maps its memory. Should that mapping be
+ * refused (as hardened kernels refuse writable, executable memory), the
+ * other is used instead.
+ *
+ * @return  false if the arena already uses a different mapping; it can
+ *          only be chosen before the first allocation.
+ */
+bool bf_code_arena_set_mapping(enum bf_code_mapping mapping);
+
+/**
+ * @return  how the code arena maps its memory.
+ */
+enum bf_code_mapping bf_code_arena_mapping(void);
+
+/**
+ * @return  where to write the code that will execute at the given address
+ *          of space from allocate_executable_space(). Patching compiled
+ *          code is a plain store through this alias.
+ */
+uint8_t *bf_writable_code(uint8_t *space);
+
+/**
+ * Maps size bytes of shared memory twice: once read-write, and once
+ * read-execute, starting on a huge page boundary.
+ *
+ * @return  true if successful; release both with bf_dual_unmap().
+ */
+bool bf_dual_map(size_t size, uint8_t **writable, uint8_t **executable);
+
+/**
+ * Unmaps both views made by bf_dual_map().
+ */
+bool bf_dual_unmap(uint8_t *writable, uint8_t *executable, size_t size);
+
+/**
+ * How the code arena is being used. Sizes are in bytes.
+ */
+typedef struct {
+    /** Address space reserved for the arena. */
+    size_t reserved;
+    /** How much of the reservation has been carved into chunks. */
+    size_t carved;
+    /** Size of the chunks currently allocated, and the most ever at once. */
+    size_t in_use;
+    size_t peak;
+    /** Chunks allocated, and how many of those were recycled. */
+    size_t allocations;
+    size_t recycled;
+    /** Chunks backed by huge pages. */
+    size_t huge_chunks;
+    /** Allocations too big for the arena, mapped on their own instead. */
+    size_t oversized;
+} bf_code_arena_stats;
+
+/**
+ * @return  usage statistics of the arena behind allocate_executable_space().
+ */
+bf_code_arena_stats bf_code_arena_statistics(void);
+
 #endif /* BF_ALLOC_H */
@@ -1,15 +1,151 @@
 #ifndef BF_ARGUMENTS_H
 #define BF_ARGUMENTS_H
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stddef.h>
 
+#include <bf_ir.h>
+
+/**
+ * What to produce from the program.
+ */
+enum bf_emit_target {
+    /** Compile to machine code in memory and run it right away. */
+    BF_EMIT_JIT = 0,
+    /** Write equivalent C source code. */
+    BF_EMIT_C,
+    /** Write C source code and compile it with the system C compiler. */
+    BF_EMIT_EXE,
+    /** Write a linkable object file and a header to call it from C. */
+    BF_EMIT_OBJ,
+};
+
+/**
+ * What happens at the ends of the tape.
+ */
+enum bf_tape_mode {
+    /** The tape grows as needed; going too far stops the program. */
+    BF_TAPE_GROW = 0,
+    /** The tape is circular; its size is a power of two. */
+    BF_TAPE_WRAP,
+};
+
 typedef struct {
     /**
      * Mimimum size of the universe in bytes.
      */
     size_t minimum_universe_size;
+    /**
+     * A file to keep the tape in, from one run to the next; NULL uses
+     * fresh memory.
+     */
+    char *universe_file;
     char *filename;
+    /**
+     * A file for the program to read its input from; NULL reads standard
+     * input.
+     */
+    char *input_filename;
+
+    /**
+     * What to do with the compiled program.
+     */
+    enum bf_emit_target emit;
+    /**
+     * Where to write emitted code; NULL uses the default for the target.
+     * When running the program, where to write its output; NULL writes to
+     * standard output.
+     */
+    char *output_filename;
+    /**
+     * When running the program, have a thread of its own write its output,
+     * so that it only waits for the output when far enough behind.
+     */
+    bool async_output;
+    /**
+     * Name of the function exported by --emit=obj; NULL derives it from the
+     * output filename.
+     */
+    char *symbol;
+
+    /**
+     * Where to record how often each loop runs; NULL disables profiling.
+     */
+    char *profile_generate;
+    /**
+     * A profile recorded with profile_generate to optimize with, or NULL.
+     */
+    char *profile_use;
+
+    /**
+     * Optimization level, from 0 to BF_MAX_OPTIMIZATION.
+     */
+    int optimization_level;
+    /**
+     * Optimization passes to run: those of the optimization level, as
+     * modified by --passes.
+     */
+    bf_pass_set passes;
+    /**
+     * Describe what each optimization pass changed on stderr.
+     */
+    bool report_passes;
+
+    /**
+     * Run the program once per line of input, this many lines at a time in
+     * lock-step; 0 runs it once over all of the input.
+     */
+    size_t lanes;
+
+    /**
+     * What happens at the ends of the tape.
+     */
+    enum bf_tape_mode tape;
+    /**
+     * Check that p stays on a fixed-size tape in the compiled code itself,
+     * rather than relying on the guard regions of the universe.
+     */
+    bool bounds_check;
+    /**
+     * Have the compiled code keep track of the range of cells it touches,
+     * so that the tape can be reset cheaply between runs.
+     */
+    bool track_dirty;
+
+    /**
+     * Run the program up to its first input, then fork a copy of it for
+     * each of the input files, so that whatever it does before reading
+     * input is only done once.
+     */
+    bool fork;
+    /**
+     * The input files for fork: the arguments after the filename.
+     */
+    char **inputs;
+    size_t input_count;
+
+    /**
+     * Run the filename and the arguments after it as the stages of a
+     * pipeline, each reading the output of the one before, all in this
+     * process.
+     */
+    bool pipe;
+    /**
+     * The files to run for pipe, in order, starting with the filename.
+     */
+    char **stages;
+    size_t stage_count;
+
+    /**
+     * Keep compiled programs in the code cache, and run them from there.
+     */
+    bool cache;
+    /**
+     * Map compiled code twice, so that it is never both writable and
+     * executable (see BF_CODE_MAPPING_DUAL).
+     */
+    bool dual_map;
 } bf_options;
 
 bf_options parse_arguments(int argc, char *argv[]);
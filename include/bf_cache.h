@@ -0,0 +1,85 @@
+/**
+ * This file is part of Brainmuk.
+ * 2015 (c) eddieantonio. See LICENSE for details.
+ */
+
+#ifndef BF_CACHE_H
+#define BF_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bf_compile.h>
+#include <bf_ir.h>
+
+/**
+ * A compiled program, loaded from the code cache: everything needed to run
+ * it without parsing, optimizing or compiling its source again. The machine
+ * code is mapped straight from the cache file, read-only and executable.
+ */
+typedef struct {
+    program_t program;
+    size_t code_length;
+
+    /** Maps the code back to its source; do not free it. */
+    bf_source_map map;
+
+    /**
+     * Just the memoized loops of the program, enough for bf_memo_create();
+     * do not free it.
+     */
+    bf_ir memoized;
+
+    /** The result of bf_ir_pointer_range() on the compiled program. */
+    bool bounded;
+    int64_t low;
+    int64_t high;
+
+    /* The mappings of the cache file. */
+    uint8_t *file;
+    size_t file_size;
+    uint8_t *code;
+    size_t code_size;
+} bf_cached_program;
+
+/**
+ * Names the cache file for the source, compiled as described by variant (a
+ * string that differs whenever the options given would change the compiled
+ * code). The name depends on the version of brainmuk and on
+ * BF_CODE_ABI_VERSION too. The cache lives in $BRAINMUK_CACHE, or
+ * else $XDG_CACHE_HOME/brainmuk or ~/.cache/brainmuk, which are created as
+ * needed.
+ *
+ * @return the name, which must be free()'d; or NULL if there is nowhere to
+ *         keep the cache.
+ */
+char *bf_cache_filename(const char *source, const char *variant);
+
+/**
+ * Loads a program stored by bf_cache_store().
+ *
+ * @return true if the file holds a program for BF_CODE_ABI_VERSION;
+ *         release it with bf_cache_release().
+ */
+bool bf_cache_load(const char *filename, bf_cached_program *cached);
+
+/**
+ * Stores a compiled program in the cache. The file is replaced atomically,
+ * so concurrent runs never see it half-written.
+ *
+ * @param ir    the IR the code was compiled from.
+ * @param code  the position-independent machine code from bf_compile_ir().
+ * @param map   the source map of the code.
+ *
+ * @return true if the file was written successfully.
+ */
+bool bf_cache_store(const char *filename, const bf_ir *ir,
+        const uint8_t *code, size_t code_length, const bf_source_map *map);
+
+/**
+ * Unmaps a program loaded by bf_cache_load().
+ */
+void bf_cache_release(bf_cached_program *cached);
+
+#endif /* BF_CACHE_H */
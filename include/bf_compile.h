@@ -6,9 +6,11 @@
 #ifndef BF_COMPILE_H
 #define BF_COMPILE_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include <bf_alloc.h>
+#include <bf_ir.h>
 
 enum bf_compile_status {
     /** Compilation was successful. */
@@ -23,17 +25,241 @@ enum bf_compile_status {
 /**
  * Stores all runtime context.
  *
+ * bf_emit_header() writes out the same fields as the definition below.
+ *
  * The context is:
  *
  *  - the "universe": all of the memory that could possibly be available.
  *  - output_byte: it should prints exactly one octet of output;
  *  - input_byte: it should return exactly one octet of input
+ *  - loop_counters: where programs compiled with count_loops tally loop
+ *    entries and iterations; unused otherwise.
+ *  - memo, memo_enter, memo_leave: the loop cache used by programs compiled
+ *    with memoize, and bf_memo_enter() and bf_memo_leave(); unused otherwise.
+ *  - tape_start, tape_end: the first cell of the tape, and one past its last,
+ *    for programs compiled with bounds_check; unused otherwise.
+ *  - out_of_bounds: called by programs compiled with bounds_check before they
+ *    would touch a cell outside of the tape, with the offset of the source
+ *    character responsible, the offending cell and, for programs compiled
+ *    with buffer_output, the output cursor. It must not return.
+ *  - dirty: for programs compiled with track_dirty, the range of cells
+ *    touched so far, which the program widens as it runs; unused otherwise.
+ *  - output_start, output_end, flush_output: the buffer that programs
+ *    compiled with buffer_output write their output to, as far as
+ *    output_end to start with, and the function they call with the buffer
+ *    and the cursor (one past the last byte written) to empty it, which
+ *    returns where to write next and how far; unused otherwise.
+ *  - input_start, input_end, fill_input: the buffer that programs compiled
+ *    with buffer_input read their input from, and the function they call
+ *    with it to read more, which returns one past the last byte read (start
+ *    itself at end-of-file); unused otherwise.
+ *  - copy_input: called by programs compiled with copy_loops to copy their
+ *    input to their output, through a table of what to output for each byte
+ *    (or as it is, if NULL), up to the byte that would end the loop; unused
+ *    otherwise.
+ *  - write_output: called by programs compiled with coalesce_output with
+ *    where they stand in the output buffer, to write a run of bytes (or the
+ *    first of them, over and over, if the flag is set) that does not fit
+ *    before the limit; unused otherwise.
+ */
+#ifndef BF_RUNTIME_CONTEXT
+#define BF_RUNTIME_CONTEXT
+/*
+ * The fields of each structure are listed once, here, so that
+ * bf_emit_header() writes out exactly what is compiled in.
+ */
+#define BF_DIRTY_RANGE_FIELDS \
+    uint8_t *low; \
+    uint8_t *high;
+
+#define BF_OUTPUT_SPACE_FIELDS \
+    uint8_t *cursor; \
+    uint8_t *limit;
+
+#define BF_BUFFERED_IO_FIELDS \
+    uint8_t *input_cursor; \
+    uint8_t *input_limit; \
+    uint8_t *output_cursor; \
+    uint8_t *output_limit;
+
+#define BF_RUNTIME_CONTEXT_FIELDS \
+    uint8_t *universe; \
+    void (*output_byte)(uint8_t); \
+    uint8_t (*input_byte)(); \
+    uint64_t *loop_counters; \
+    struct bf_memo *memo; \
+    uint8_t (*memo_enter)(struct bf_memo *, uint32_t, uint8_t *); \
+    void (*memo_leave)(struct bf_memo *, uint32_t, uint8_t *); \
+    uint8_t *tape_start; \
+    uint8_t *tape_end; \
+    void (*out_of_bounds)(uint32_t, uint8_t *, uint8_t *); \
+    struct bf_dirty_range *dirty; \
+    uint8_t *output_start; \
+    uint8_t *output_end; \
+    struct bf_output_space (*flush_output)(uint8_t *, uint8_t *); \
+    uint8_t *input_start; \
+    uint8_t *input_end; \
+    uint8_t *(*fill_input)(uint8_t *, uint8_t *); \
+    void (*copy_input)(struct bf_buffered_io *, uint8_t, const uint8_t *, \
+            const struct bf_runtime_context *); \
+    void (*write_output)(struct bf_output_space *, const uint8_t *, \
+            uint32_t, bool, const struct bf_runtime_context *);
+
+/**
+ * A range of cells, [low, high). It is empty when low is not below high;
+ * start with low = (uint8_t *) UINTPTR_MAX and high = NULL.
  */
+struct bf_dirty_range {
+    BF_DIRTY_RANGE_FIELDS
+};
+
+/**
+ * Where to write output next: from cursor up to, not including, limit.
+ */
+struct bf_output_space {
+    BF_OUTPUT_SPACE_FIELDS
+};
+
+/**
+ * The buffers of a program compiled with buffer_input and buffer_output,
+ * where they stand.
+ */
+struct bf_buffered_io {
+    BF_BUFFERED_IO_FIELDS
+};
+
 struct bf_runtime_context {
-    uint8_t *universe;
-    void (*output_byte)(uint8_t);
-    uint8_t (*input_byte)();
+    BF_RUNTIME_CONTEXT_FIELDS
 };
+#endif
+
+/**
+ * The version of the machine code that bf_compile_ir() emits, and of the
+ * struct bf_runtime_context it runs with. Bump it whenever either changes,
+ * even for the same options: code compiled for another version (as kept in
+ * the code cache) must never be run.
+ */
+#define BF_CODE_ABI_VERSION     1
+
+/**
+ * Maps machine code back to the source it came from: the code starting at
+ * code_offsets[i] (relative to the start of the program) was generated for
+ * the source character at source_offsets[i]. Code offsets only increase.
+ */
+typedef struct {
+    size_t *code_offsets;
+    size_t *source_offsets;
+    size_t length;
+    size_t capacity;
+} bf_source_map;
+
+/**
+ * Finds the source character that the code at the given offset was
+ * generated for.
+ *
+ * @return true if found; false if the code is not for any source character,
+ *         such as the function prologue.
+ */
+bool bf_source_map_lookup(const bf_source_map *map, size_t code_offset,
+        size_t *source_offset);
+
+/**
+ * Releases all memory held by the source map.
+ */
+void bf_source_map_free(bf_source_map *map);
+
+/**
+ * Options that change the machine code generated by bf_compile_ir().
+ */
+typedef struct {
+    /**
+     * Instrument every loop with two counters in context.loop_counters:
+     * the number of times it was entered, and the number of times its body
+     * ran. Loop n (in source order) uses counters 2n and 2n + 1.
+     */
+    bool count_loops;
+
+    /**
+     * Consult context.memo before running loops marked by the "memoize" pass,
+     * and record their results after. Memoized loop n (in source order) is
+     * cache n.
+     */
+    bool memoize;
+
+    /**
+     * If not NULL, an empty source map that is filled in for the compiled
+     * code.
+     */
+    bf_source_map *source_map;
+
+    /**
+     * If not 0, the tape is circular: context.universe is the first of
+     * wrap_mask + 1 cells (a power of two), p starts at that first cell, and
+     * moving past either end comes back around from the other.
+     */
+    uint32_t wrap_mask;
+
+    /**
+     * Check that p is within context.tape_start and context.tape_end where
+     * bf_ir_place_bounds_checks() says to, calling context.out_of_bounds()
+     * if it is not. The checks are conservative: they cover every cell that
+     * the code up to the next check may touch, even if it does not run.
+     */
+    bool bounds_check;
+
+    /**
+     * Widen context.dirty to cover the cells the code may touch, where
+     * bf_ir_place_bounds_checks() says to, so that the tape can be reset by
+     * zeroing just that range. Like bounds checks, this is conservative.
+     */
+    bool track_dirty;
+
+    /**
+     * Write output to context.output_start onwards, rather than calling
+     * context.output_byte() for every byte, and call context.flush_output()
+     * when the cursor reaches the limit (context.output_end, to start with),
+     * before reading input, and before returning. The cursor is kept in %r13.
+     */
+    bool buffer_output;
+
+    /**
+     * Read input from context.input_start onwards, rather than calling
+     * context.input_byte() for every byte, and call context.fill_input()
+     * only when all of it has been read; with buffer_output, output is
+     * flushed just before that. Input is 0xFF at end-of-file, as ever.
+     * The cursor and the limit are kept in %r14 and %r15.
+     */
+    bool buffer_input;
+
+    /**
+     * Have filter loops (see bf_ir_filter_loop()), which output a function
+     * of each byte they read, like ",[.,]" and tests/rot13.bf, call
+     * context.copy_input() to copy as much as they can at once, with the
+     * buffers, the byte that would end the loop and the table, if they do
+     * not just copy; the loop reads that byte itself. The copy is skipped
+     * unless the loop's scratch cells are clear; those are read as they are
+     * but for bounds checks, which skip it, too, if they are off the tape.
+     * Needs buffer_input and buffer_output.
+     */
+    bool copy_loops;
+
+    /**
+     * Write runs of output that are known in advance (see
+     * bf_ir_find_output_run()) all at once, calling context.write_output()
+     * when they do not fit. Needs buffer_output.
+     */
+    bool coalesce_output;
+
+    /**
+     * The tape is all 0s when the program starts: with coalesce_output, and
+     * without count_loops or bounds_check, run the program's opening at
+     * compile time (see bf_ir_run_opening()), and start it where that left
+     * off, with the cells set and the output written all at once. Only
+     * generating a profile turns this off; loop counts read from one (as
+     * with --profile-use) do not, and it may leave off in an unrolled loop.
+     */
+    bool blank_tape;
+} bf_codegen_options;
 
 /**
  * A brainmuk program pointer!
@@ -53,6 +279,8 @@ typedef struct {
         struct {
             program_t program;
             size_t program_size;
+            /** How many bytes of machine code were actually written. */
+            size_t code_length;
         };
 
         /** The location of an error. */
@@ -99,4 +327,21 @@ bf_compile_result bf_compile_no_alloc(const char *source, uint8_t *space);
  */
 bf_compile_result bf_compile_realloc(const char *source, bf_program_text * restrict text);
 
+/**
+ * Like bf_compile_realloc(), but compiles a program that has already been
+ * parsed (and possibly optimized) into IR.
+ *
+ * Loops whose profile shows they are hot are aligned for the benefit of
+ * the instruction fetcher.
+ *
+ * @param bf_ir              a successfully parsed program
+ * @param bf_program_text    program text that may be resized during compilation
+ * @param bf_codegen_options options for code generation, or NULL for defaults
+ *
+ * @return the compilation status.
+ */
+bf_compile_result bf_compile_ir(const bf_ir *ir,
+        bf_program_text * restrict text,
+        const bf_codegen_options *options);
+
 #endif /* BF_COMPILE_H */
@@ -0,0 +1,63 @@
+/**
+ * This file is part of Brainmuk.
+ * 2015 (c) eddieantonio. See LICENSE for details.
+ */
+
+#ifndef BF_EMIT_H
+#define BF_EMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <bf_ir.h>
+
+/**
+ * Writes the program as a stand-alone, human-readable C program: the tape is
+ * a uint8_t array, loops are while loops, and recognized idioms (clear and
+ * multiply loops) are direct expressions.
+ *
+ * @param ir             the (optimized) program to lower.
+ * @param universe_size  number of cells p may move in either direction from
+ *                       where it starts.
+ * @param stream         where to write the C source.
+ *
+ * @return true if the program was written successfully.
+ */
+bool bf_emit_c(const bf_ir *ir, size_t universe_size, FILE *stream);
+
+/**
+ * Lowers the program to C, then builds a native executable with the system
+ * C compiler (the one named by $CC, or cc) at -O2.
+ *
+ * @param output_filename  name of the executable to create.
+ *
+ * @return true if the C compiler succeeded.
+ */
+bool bf_emit_executable(const bf_ir *ir, size_t universe_size,
+        const char *output_filename);
+
+/**
+ * Writes compiled machine code as a relocatable x86-64 ELF object that
+ * exports a single function with the signature of program_t. The code must
+ * be position-independent, as bf_compile_ir() emits it.
+ *
+ * @param code    machine code from bf_compile_ir().
+ * @param length  number of bytes of machine code.
+ * @param symbol  name of the exported function; must be a C identifier.
+ *
+ * @return true if the object was written successfully.
+ */
+bool bf_emit_object(const uint8_t *code, size_t length, const char *symbol,
+        FILE *stream);
+
+/**
+ * Writes a C header declaring the function exported by bf_emit_object(),
+ * along with struct bf_runtime_context.
+ *
+ * @return true if the header was written successfully.
+ */
+bool bf_emit_header(const char *symbol, FILE *stream);
+
+#endif /* BF_EMIT_H */
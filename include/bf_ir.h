@@ -0,0 +1,346 @@
+/**
+ * This file is part of Brainmuk.
+ * 2015 (c) eddieantonio. See LICENSE for details.
+ */
+
+#ifndef BF_IR_H
+#define BF_IR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * The kinds of operation in brainmuk's intermediate representation.
+ *
+ * In the descriptions, p is the data pointer; all cell arithmetic is modulo
+ * 256.
+ */
+enum bf_ir_kind {
+    /** *(p + offset) += value */
+    BF_IR_ADD,
+    /** p += value */
+    BF_IR_MOVE,
+    /** *(p + offset) = value */
+    BF_IR_SET,
+    /** *(p + offset) += *p * value */
+    BF_IR_MUL,
+    /** output *(p + offset) */
+    BF_IR_OUTPUT,
+    /** *(p + offset) = input */
+    BF_IR_INPUT,
+    /** while (*p) { */
+    BF_IR_LOOP,
+    /** } */
+    BF_IR_END,
+};
+
+/**
+ * A single operation of the intermediate representation.
+ */
+struct bf_ir_op {
+    enum bf_ir_kind kind;
+    /** Cell offset relative to p, for operations that access memory. */
+    int32_t offset;
+    /** Amount, constant or factor (cell values are in 0..255). */
+    int32_t value;
+    /** For BF_IR_LOOP and BF_IR_END: index of the matching bracket. */
+    size_t match;
+    /** Byte offset of the source character that begat this operation. */
+    size_t source_offset;
+
+    /**
+     * For BF_IR_LOOP: how many times the loop was entered and how many
+     * times its body ran in the profile given to bf_profile_apply(), if any.
+     */
+    uint64_t entries;
+    uint64_t iterations;
+
+    /**
+     * For BF_IR_LOOP: whether the loop's effect is memoized at runtime, and
+     * the window of cells, relative to p, that it may touch.
+     */
+    bool memoize;
+    int32_t window_low;
+    int32_t window_high;
+
+    /**
+     * Whether code compiled with bounds checks checks, just before this
+     * operation, that the cells from p + check_low to p + check_high are all
+     * on the tape; see bf_ir_place_bounds_checks().
+     */
+    bool check;
+    int32_t check_low;
+    int32_t check_high;
+};
+
+/**
+ * A program in the intermediate representation: a flat list of operations
+ * whose brackets are always balanced.
+ */
+typedef struct {
+    struct bf_ir_op *ops;
+    size_t length;
+    size_t capacity;
+
+    /** Deepest loop nesting in the program. */
+    size_t max_depth;
+
+    /**
+     * Whether the program starts on a tape of 0s. Parsing sets it; clear it
+     * when the program carries on from the tape another one left behind
+     * (like a line of the REPL).
+     */
+    bool blank_tape;
+
+    /** Where parsing failed (1-based), if it did. */
+    unsigned long err_line;
+    unsigned long err_col;
+} bf_ir;
+
+/**
+ * Parses the null-terminated source text into IR. Runs of the same
+ * instruction are folded into a single operation.
+ *
+ * @return true on success; false when brackets are unmatched, in which case
+ *         ir->err_line and ir->err_col locate the offending bracket.
+ *         Either way, release the IR with bf_ir_free().
+ */
+bool bf_ir_parse(const char *source, bf_ir *ir);
+
+/**
+ * Parses source text that arrives a chunk at a time, such as from a pipe,
+ * without keeping the text itself: only the operations, the open brackets
+ * and the position of the next character are carried between chunks.
+ */
+typedef struct {
+    bf_ir ir;
+
+    /** Source offset, line and column of the next character. */
+    size_t offset;
+    unsigned long line;
+    unsigned long column;
+
+    /** Where each of the brackets that are still open is. */
+    struct bf_ir_position {
+        unsigned long line;
+        unsigned long column;
+    } *open;
+    size_t depth;
+    size_t capacity;
+
+    /** Whether a bracket was closed that was never opened. */
+    bool failed;
+} bf_ir_parser;
+
+/**
+ * Prepares to parse a program with bf_ir_parse_chunk().
+ */
+void bf_ir_parser_init(bf_ir_parser *parser);
+
+/**
+ * Parses the next chunk of source text; it need not end on any particular
+ * character.
+ *
+ * @return false once a bracket is closed that was never opened, after which
+ *         there is no point in parsing more.
+ */
+bool bf_ir_parse_chunk(bf_ir_parser *parser, const char *chunk, size_t length);
+
+/**
+ * Finishes parsing, handing over the IR; like bf_ir_parse(), it fails if
+ * brackets are unmatched. Either way, release the IR with bf_ir_free().
+ */
+bool bf_ir_parse_finish(bf_ir_parser *parser, bf_ir *ir);
+
+/**
+ * A set of optimization passes; see bf_ir_run_passes().
+ */
+typedef uint32_t bf_pass_set;
+
+/** Defer pointer movement, folding it into cell offsets. */
+#define BF_PASS_OFFSET      ((bf_pass_set) 1 << 0)
+/** Turn clear loops ("[-]") into assignments. */
+#define BF_PASS_CLEAR       ((bf_pass_set) 1 << 1)
+/** Turn multiply loops ("[->++<]") into multiplications. */
+#define BF_PASS_MULTIPLY    ((bf_pass_set) 1 << 2)
+/** Merge additions and assignments to the same cell. */
+#define BF_PASS_FOLD        ((bf_pass_set) 1 << 3)
+/** Remove loops that can never be entered. */
+#define BF_PASS_DEAD        ((bf_pass_set) 1 << 4)
+/** Memoize expensive loops that are pure functions of a few cells. */
+#define BF_PASS_MEMOIZE     ((bf_pass_set) 1 << 5)
+#define BF_PASS_ALL         (((bf_pass_set) 1 << 6) - 1)
+
+/** The optimization level used by bf_ir_optimize(). */
+#define BF_DEFAULT_OPTIMIZATION     2
+/** The highest optimization level. */
+#define BF_MAX_OPTIMIZATION         3
+
+/**
+ * @return  the passes run at the given optimization level (0 to 3).
+ */
+bf_pass_set bf_ir_passes_for_level(int level);
+
+/**
+ * Modifies the set of passes according to a comma-separated list of pass
+ * names. A name (optionally prefixed with +) enables the pass; a name
+ * prefixed with - disables it. "all" and "none" name every pass.
+ *
+ * @return false if the list names an unknown pass.
+ */
+bool bf_ir_parse_passes(const char *spec, bf_pass_set *set);
+
+/**
+ * Runs the given optimization passes over the IR, in their fixed order.
+ *
+ * @param report  if not NULL, one line per pass describing what it changed
+ *                is written here.
+ */
+void bf_ir_run_passes(bf_ir *ir, bf_pass_set set, FILE *report);
+
+/**
+ * Rewrites the IR into an equivalent, faster program using the passes of
+ * the default optimization level: clear and multiply loops become direct
+ * assignments, pointer movement is folded into cell offsets, and dead loops
+ * are removed.
+ */
+void bf_ir_optimize(bf_ir *ir);
+
+/**
+ * Finds the balanced loops: those whose body, including every loop within
+ * it, moves p by a net amount of zero. Every cell a balanced loop touches is
+ * at a fixed offset from where p was when the loop was entered.
+ *
+ * @return an array indexed like ir->ops that is true at the BF_IR_LOOP of
+ *         every balanced loop; free() it.
+ */
+bool *bf_ir_balanced_loops(const bf_ir *ir);
+
+/**
+ * Finds the cells, relative to where p starts, that the program may touch.
+ * The range is bounded only when every loop is balanced.
+ *
+ * @return true if the range is bounded, in which case it is stored in *low
+ *         and *high (inclusive).
+ */
+bool bf_ir_pointer_range(const bf_ir *ir, int64_t *low, int64_t *high);
+
+/**
+ * Decides where code compiled with bounds checks checks p (and where code
+ * that tracks the cells it touches takes note). The program is
+ * split into regions within which every cell touched is at a fixed offset
+ * from where p was at the start of the region, and the first operation of
+ * each region is marked to check the whole range at once. A balanced loop is a part of the region it is in, so it is checked
+ * once on entry; the body of an unbalanced loop is checked once per
+ * iteration. Run this after all optimization passes.
+ */
+void bf_ir_place_bounds_checks(bf_ir *ir);
+
+/**
+ * A loop that reads a byte and outputs a function of it, over and over,
+ * until it reads the byte that ends it; like ",[.,]" or tests/rot13.bf.
+ */
+typedef struct {
+    /** The loop's one input operation. */
+    size_t input;
+    /** The byte that ends the loop, when read. */
+    uint8_t until;
+    /** Whether every other byte is output just as it was read... */
+    bool identity;
+    /** ...or else, what is output for it (until is left as it is). */
+    uint8_t table[256];
+    /**
+     * The cells, relative to p at the input operation, that the loop uses
+     * for scratch: they must all be 0 there (but for the cell read into)
+     * for the table to hold. Empty when scratch_low > scratch_high.
+     */
+    int32_t scratch_low;
+    int32_t scratch_high;
+} bf_ir_filter;
+
+/**
+ * Finds out whether the loop at ir->ops[loop] is a filter: when
+ * its body starts with any value in the loop's cell and 0 in the cells
+ * around it, it outputs exactly one byte, leaves all of those cells 0 again
+ * but for the cell it then reads into (the loop's own), and only adjusts
+ * that cell after. Every byte read is then output through the table on the
+ * next iteration, until one leaves the cell 0.
+ *
+ * The body is run for every value of the cell, so only loops that do little
+ * work per byte are found.
+ *
+ * @return true if so, in which case the filter is stored in *filter.
+ */
+bool bf_ir_filter_loop(const bf_ir *ir, size_t loop, bf_ir_filter *filter);
+
+/**
+ * The most output bf_ir_find_output_run() merges into one run.
+ */
+#define BF_IR_MAX_OUTPUT_RUN    256
+
+/**
+ * Output that can be made all at once.
+ */
+typedef struct {
+    /** One past the last output operation of the run. */
+    size_t end;
+    /** How many bytes are output... */
+    size_t length;
+    /** ...all of them the cell of the first output operation, over and
+     * over, as its value is not known in advance... */
+    bool repeat;
+    /** ...or else, these. */
+    uint8_t bytes[BF_IR_MAX_OUTPUT_RUN];
+} bf_ir_output_run;
+
+/**
+ * Finds out whether the output operation at ir->ops[op] starts a run of
+ * output that can be made all at once: either it is repeated straight away
+ * (like "..."), or it and the output operations after it only output cells
+ * whose values are known in advance, as they were set since the last loop.
+ * A run never crosses a loop, an input operation, or an operation that
+ * bounds checks are placed before.
+ *
+ * @return true if the run outputs more than one byte, in which case it is
+ *         stored in *run.
+ */
+bool bf_ir_find_output_run(const bf_ir *ir, size_t op,
+        bf_ir_output_run *run);
+
+/**
+ * How many cells, and how much output, bf_ir_run_opening() keeps track of.
+ */
+#define BF_IR_OPENING_CELLS         512
+#define BF_IR_MAX_OPENING_OUTPUT    4096
+
+/**
+ * Where a program stands after its opening has been run.
+ */
+typedef struct {
+    /** The operation to carry on from: 0 if none were run, ir->length if
+     * all of them were. */
+    size_t resume;
+    /** Where p is, relative to where it started. */
+    int64_t p;
+    /** The cells, starting BF_IR_OPENING_CELLS / 2 before where p started. */
+    uint8_t cells[BF_IR_OPENING_CELLS];
+    /** What was output. */
+    size_t length;
+    uint8_t output[BF_IR_MAX_OPENING_OUTPUT];
+} bf_ir_opening;
+
+/**
+ * Runs the program from the start, on a tape of 0s, until it would read
+ * input, enter a memoized loop, stray too far, output too much or take too
+ * long: everything up to there is known in advance, whatever the input.
+ */
+void bf_ir_run_opening(const bf_ir *ir, bf_ir_opening *opening);
+
+/**
+ * Releases all memory held by the IR.
+ */
+void bf_ir_free(bf_ir *ir);
+
+#endif /* BF_IR_H */
@@ -0,0 +1,66 @@
+/**
+ * This file is part of Brainmuk.
+ * 2015 (c) eddieantonio. See LICENSE for details.
+ */
+
+#ifndef BF_LANES_H
+#define BF_LANES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <bf_ir.h>
+
+/**
+ * The most inputs that bf_lanes_run() executes at once. The number of lanes
+ * must be a multiple of BF_LANES_PER_VECTOR no greater than this.
+ */
+#define BF_MAX_LANES        32
+#define BF_LANES_PER_VECTOR 16
+
+/**
+ * One independent input to run the program over.
+ */
+struct bf_lane_record {
+    const uint8_t *data;
+    size_t length;
+};
+
+/**
+ * Called when a lane would touch a cell that its tape cannot grow to reach,
+ * with the offset of the source character responsible and the cell,
+ * relative to where p started. It should not return.
+ */
+typedef void (*bf_lanes_out_of_bounds)(size_t source_offset, ptrdiff_t cell);
+
+/**
+ * Runs the program once for every record, as if each run were a separate
+ * execution with the record as its entire input (input past its end reads
+ * as 0xFF).
+ *
+ * Records are run in lock-step, the given number of lanes at a time: each
+ * lane has its own tape, interleaved cell by cell with the others so that a
+ * cell of every lane can be updated with one vector operation. Loops run
+ * while any lane's *p is non-zero, masking off lanes that have left the
+ * loop. Loops that can leave lanes at different cells run in each lane by
+ * itself; if the lanes do not meet again afterward, the rest of the program
+ * runs in each lane by itself.
+ *
+ * Like the universe, each lane's tape has p start in the middle, and grows
+ * in both directions as needed, up to BF_UNIVERSE_MAXIMUM cells either way.
+ *
+ * @param lanes          how many records to run at once.
+ * @param universe_size  number of cells each lane's tape starts with.
+ * @param stream         where the output of each record is written, in
+ *                       the order of the records.
+ * @param out_of_bounds  called if a lane strays past the maximum.
+ *
+ * @return true if all output was written successfully.
+ */
+bool bf_lanes_run(const bf_ir *ir, size_t lanes, size_t universe_size,
+        const struct bf_lane_record *records, size_t count, FILE *stream,
+        bf_lanes_out_of_bounds out_of_bounds);
+
+#endif /* BF_LANES_H */
@@ -0,0 +1,52 @@
+/**
+ * This file is part of Brainmuk.
+ * 2015 (c) eddieantonio. See LICENSE for details.
+ */
+
+#ifndef BF_MEMO_H
+#define BF_MEMO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bf_ir.h>
+
+/**
+ * Remembers the effect of memoized loops: for each loop, a cache mapping the
+ * cells in the loop's window on entry to their contents on exit.
+ */
+struct bf_memo;
+
+/**
+ * Creates the caches for the loops marked by the "memoize" pass.
+ *
+ * @param universe       the tape; windows that fall outside of it are never
+ *                       cached.
+ * @param universe_size  size of the tape, in cells.
+ *
+ * @return the memo, or NULL if the IR has no memoized loops.
+ */
+struct bf_memo *bf_memo_create(const bf_ir *ir, uint8_t *universe,
+        size_t universe_size);
+
+/**
+ * Called by compiled code when memoized loop number n is entered (i.e., *p
+ * is not zero). On a hit, writes the loop's result into the tape.
+ *
+ * @return 1 if the loop should be skipped; 0 if it should run as usual, in
+ *         which case bf_memo_leave() must be called when it exits.
+ */
+uint8_t bf_memo_enter(struct bf_memo *memo, uint32_t n, uint8_t *p);
+
+/**
+ * Called by compiled code when memoized loop number n exits after it was run;
+ * caches its result.
+ */
+void bf_memo_leave(struct bf_memo *memo, uint32_t n, uint8_t *p);
+
+/**
+ * Releases the memo. Accepts NULL.
+ */
+void bf_memo_free(struct bf_memo *memo);
+
+#endif /* BF_MEMO_H */
@@ -0,0 +1,94 @@
+/**
+ * This file is part of Brainmuk.
+ * 2015 (c) eddieantonio. See LICENSE for details.
+ */
+
+#ifndef BF_OUTPUT_H
+#define BF_OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bf_compile.h>
+
+/**
+ * How much output is handed to a pipe at once: a huge page.
+ */
+#define BF_OUTPUT_SPLICE_SIZE   ((size_t) 2 * 1024 * 1024)
+
+/**
+ * How much of an output file is mapped at once.
+ */
+#define BF_OUTPUT_WINDOW_SIZE   ((size_t) 16 * 1024 * 1024)
+
+/**
+ * How much output a writer thread may fall behind by.
+ */
+#define BF_OUTPUT_RING_SIZE     ((size_t) 1024 * 1024)
+
+/**
+ * How much output is handed to a writer thread at once.
+ */
+#define BF_OUTPUT_CHUNK_SIZE    ((size_t) 64 * 1024)
+
+/**
+ * Output buffers that programs compiled with buffer_output write to: either
+ * pages that are handed to a pipe with vmsplice(2), or a window onto a file
+ * that moves along as it fills, neither of which is ever copied; or a ring
+ * that a thread of its own writes out while the program carries on.
+ *
+ * The buffer is [start, end), and the first flush is due at limit. Pass
+ * start, limit and bf_output_flush() as the output_start, output_end and
+ * flush_output of the runtime context; only one buffer may be open at a
+ * time.
+ */
+typedef struct {
+    uint8_t *start;
+    uint8_t *end;
+    uint8_t *limit;
+} bf_output_buffer;
+
+/**
+ * Opens a buffer that is spliced into fd, if it is a pipe. Pages handed to
+ * the pipe are never written to again.
+ *
+ * @return false if fd is not a pipe, or the buffer cannot be allocated.
+ */
+bool bf_output_splice(int fd, bf_output_buffer *buffer);
+
+/**
+ * Opens a buffer that is a window onto fd, which must be a regular file
+ * open for reading and writing. The file is truncated to the output when
+ * it is closed.
+ *
+ * @return false if the file cannot be mapped.
+ */
+bool bf_output_map(int fd, bf_output_buffer *buffer);
+
+/**
+ * Opens a ring that a writer thread writes to fd, so that the program only
+ * waits for it when the ring is full. If fd is the terminal that standard
+ * input reads from, the thread catches up before the program reads input,
+ * so that every prompt is seen.
+ *
+ * @return false if the ring cannot be allocated, or the thread started.
+ */
+bool bf_output_async(int fd, bf_output_buffer *buffer);
+
+/**
+ * Hands over the output written since the last flush, ending at cursor.
+ *
+ * @return where to write next, and how far.
+ */
+struct bf_output_space bf_output_flush(uint8_t *start, uint8_t *cursor);
+
+/**
+ * Releases the buffer, after the last flush, once a writer thread has
+ * written all of it. The file descriptor is left open.
+ *
+ * @return false if any output was lost.
+ */
+bool bf_output_close(void);
+
+#endif /* BF_OUTPUT_H */
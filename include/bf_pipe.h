@@ -0,0 +1,66 @@
+/**
+ * This file is part of Brainmuk.
+ * 2015 (c) eddieantonio. See LICENSE for details.
+ */
+
+#ifndef BF_PIPE_H
+#define BF_PIPE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <bf_compile.h>
+
+/**
+ * How much output a stage of a pipeline may get ahead of the next by.
+ */
+#define BF_PIPE_RING_SIZE       ((size_t) 1024 * 1024)
+
+/**
+ * How much output is handed to the next stage at once, and how much input
+ * a stage takes at once.
+ */
+#define BF_PIPE_CHUNK_SIZE      ((size_t) 64 * 1024)
+
+/**
+ * Which ends of a stage are connected to the stages next to it.
+ */
+enum bf_pipe_ends {
+    BF_PIPE_INPUT = 1 << 0,
+    BF_PIPE_OUTPUT = 1 << 1,
+};
+
+/**
+ * Runs stage i of a pipeline, in the thread bf_pipe_run() started for it.
+ */
+typedef void (*bf_pipe_stage)(size_t i, void *data);
+
+/**
+ * Runs count stages at once, each in a thread of its own, with the output
+ * of each going straight to the input of the next through a ring in memory;
+ * the first reads, and the last writes, wherever they like. The threads are
+ * pinned to a core each, if there are enough, and then only sleep after
+ * waiting on a ring for a while.
+ *
+ * A stage that finishes closes its ends: the next stage reads end-of-file
+ * once it has read everything before that, and the stage before is stopped
+ * the next time it flushes output (like a process writing to a pipe that is
+ * no longer read), without returning from run.
+ *
+ * @return false if the rings cannot be allocated or the threads started;
+ *         otherwise, once every stage has finished.
+ */
+bool bf_pipe_run(size_t count, bf_pipe_stage run, void *data);
+
+/**
+ * Connects the runtime context of a program compiled with buffer_input and
+ * buffer_output, for the stage that calls this, to the stages next to it:
+ * its input and output buffers and the functions to fill and flush them.
+ * The first stage keeps its input, the last its output, and a thread that
+ * is not a stage keeps both.
+ *
+ * @return the ends that were connected.
+ */
+enum bf_pipe_ends bf_pipe_connect(struct bf_runtime_context *context);
+
+#endif /* BF_PIPE_H */
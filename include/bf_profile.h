@@ -0,0 +1,68 @@
+/**
+ * This file is part of Brainmuk.
+ * 2015 (c) eddieantonio. See LICENSE for details.
+ */
+
+#ifndef BF_PROFILE_H
+#define BF_PROFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bf_ir.h>
+
+/**
+ * How one loop behaved during a training run.
+ */
+struct bf_loop_profile {
+    /** Offset of the loop's opening bracket in the source text. */
+    size_t source_offset;
+    /** How many times the loop was reached. */
+    uint64_t entries;
+    /** How many times the loop body ran. */
+    uint64_t iterations;
+};
+
+/**
+ * Loop counts recorded by a program compiled with count_loops.
+ */
+typedef struct {
+    struct bf_loop_profile *loops;
+    size_t length;
+} bf_profile;
+
+/**
+ * @return  how many counters a program compiled from this IR with
+ *          count_loops needs in its context.loop_counters.
+ */
+size_t bf_profile_counter_count(const bf_ir *ir);
+
+/**
+ * Writes the counters of a program compiled from this IR to the named
+ * file, keyed by the source offset of each loop.
+ *
+ * @return true if the file was written successfully.
+ */
+bool bf_profile_write(const char *filename, const bf_ir *ir,
+        const uint64_t *counters);
+
+/**
+ * Reads a profile written by bf_profile_write().
+ *
+ * @return true if successful; release the profile with bf_profile_free().
+ */
+bool bf_profile_read(const char *filename, bf_profile *profile);
+
+/**
+ * Annotates the loops of the IR with their counts in the profile. Loops that
+ * are not in the profile are left untouched.
+ */
+void bf_profile_apply(const bf_profile *profile, bf_ir *ir);
+
+/**
+ * Releases all memory held by the profile.
+ */
+void bf_profile_free(bf_profile *profile);
+
+#endif /* BF_PROFILE_H */
@@ -2,6 +2,20 @@
 #define BF_RUNTIME_H
 
 #include <stdint.h>
+#include <sys/types.h>
+
+#include <bf_compile.h>
+
+/**
+ * How much output programs compiled with buffer_output gather before
+ * writing it.
+ */
+#define BF_RUNTIME_OUTPUT_BUFFER_SIZE   ((size_t) 64 * 1024)
+
+/**
+ * How much input programs compiled with buffer_input read at once.
+ */
+#define BF_RUNTIME_INPUT_BUFFER_SIZE    ((size_t) 64 * 1024)
 
 /**
  * Functions bundled for use in the runtime.
@@ -20,4 +34,62 @@ void bf_runtime_output_byte(uint8_t byte);
  */
 uint8_t bf_runtime_input_byte();
 
+/**
+ * The output buffer for programs compiled with buffer_output.
+ */
+extern uint8_t bf_runtime_output_buffer[BF_RUNTIME_OUTPUT_BUFFER_SIZE];
+
+/**
+ * Writes the buffered output in [start, cursor) straight to standard output,
+ * after anything stdio has buffered for it.
+ *
+ * @return the whole buffer again, from start.
+ */
+struct bf_output_space bf_runtime_flush_output(uint8_t *start, uint8_t *cursor);
+
+/**
+ * The input buffer for programs compiled with buffer_input.
+ */
+extern uint8_t bf_runtime_input_buffer[BF_RUNTIME_INPUT_BUFFER_SIZE];
+
+/**
+ * Reads as much of standard input as is available, up to the end of the
+ * buffer, with a single read(2).
+ *
+ * @return one past the last byte read; start at end-of-file, or on error.
+ */
+uint8_t *bf_runtime_fill_input(uint8_t *start, uint8_t *end);
+
+/**
+ * Copies input to output, through the buffers of a program compiled with
+ * copy_loops, up to (but not including) the first byte that is until, or
+ * to end-of-file; each byte is output as table[byte], unless table is NULL.
+ * Like the program itself, it flushes the output before it fills the input,
+ * with the functions of the context.
+ */
+void bf_runtime_copy_input(struct bf_buffered_io *io, uint8_t until,
+        const uint8_t *table, const struct bf_runtime_context *context);
+
+/**
+ * Lets bf_runtime_copy_input() have the kernel copy input to out_fd, with
+ * splice(2) or copy_file_range(2), rather than through the output buffer:
+ * for programs whose input buffer is input, a mapping of in_fd whose first
+ * byte is at offset in the file. Only for output that reaches out_fd as soon
+ * as it is flushed, and only if out_fd is a pipe or a regular file; input
+ * that is not mapped must be read to find the byte that ends the copy. A
+ * NULL input leaves every copy to the buffers again.
+ */
+void bf_runtime_copy_in_kernel(const uint8_t *input, int in_fd, off_t offset,
+        int out_fd);
+
+/**
+ * Writes length bytes (or bytes[0], length times, if repeat is set) to the
+ * output buffer of a program compiled with coalesce_output, from where it
+ * stands in space, flushing it with the functions of the context as it
+ * fills.
+ */
+void bf_runtime_write_output(struct bf_output_space *space,
+        const uint8_t *bytes, uint32_t length, bool repeat,
+        const struct bf_runtime_context *context);
+
 #endif /* BF_RUNTIME_H */
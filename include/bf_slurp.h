@@ -2,6 +2,8 @@
 #define BF_SLURP_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /**
  * @return  The null-terminated contents of the named file. If this fails for
@@ -15,4 +17,37 @@ char *slurp(const char* filename);
  */
 bool unslurp(char *memory);
 
+/**
+ * @return  whether slurp() can read the named file: it must be a regular,
+ *          non-empty file. Anything else (e.g., a pipe) can only be read
+ *          with slurp_chunks().
+ */
+bool slurpable(const char *filename);
+
+/**
+ * Reads the named file, or standard input if it is "-", a chunk at a time.
+ * Each chunk is handed to consume() as it arrives, and is gone once it
+ * returns; it returns false to stop reading early.
+ *
+ * @return false if the file could not be opened or read.
+ */
+bool slurp_chunks(const char *filename,
+        bool (*consume)(const char *chunk, size_t length, void *data),
+        void *data);
+
+/**
+ * Maps the rest of an open file, from its current offset, read-only, so that
+ * it can be read without copying it.
+ *
+ * @return  the mapping, of *length bytes; or NULL if the file is not a
+ *          regular file, has nothing left to read, or cannot be mapped.
+ */
+const uint8_t *slurp_input(int fd, size_t *length);
+
+/**
+ * Unmaps input mapped by slurp_input().
+ * @return true when successful.
+ */
+bool unslurp_input(const uint8_t *input, size_t length);
+
 #endif /* BF_SLURP_H */
@@ -0,0 +1,109 @@
+/**
+ * This file is part of Brainmuk.
+ * 2015 (c) eddieantonio. See LICENSE for details.
+ */
+
+#ifndef BF_UNIVERSE_H
+#define BF_UNIVERSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * How far the tape may grow in either direction by default.
+ */
+#define BF_UNIVERSE_MAXIMUM     ((size_t) 32 * 1024 * 1024 * 1024)
+
+/**
+ * The tape: a large reservation of address space with p starting in the
+ * middle. Only part of it is accessible at first; the rest is committed
+ * when it is first touched (see bf_universe_watch()). Inaccessible guard
+ * regions surround the whole reservation.
+ *
+ *   reservation                origin                            reserved
+ *   | guard | ... |    accessible    | ...                   | guard |
+ *                 low          ^                high
+ */
+typedef struct {
+    uint8_t *reservation;
+    size_t reserved;
+    size_t guard;
+
+    /** The accessible cells are those in [low, high). */
+    uint8_t *low;
+    uint8_t *high;
+
+    /** The cell where p starts. */
+    uint8_t *origin;
+
+    /** The cells are those of a file, rather than anonymous memory. */
+    bool file_backed;
+} bf_universe;
+
+/**
+ * Called when code touches the guard regions of the watched universe; it
+ * should not return.
+ *
+ * @param pc         address of the faulting instruction.
+ * @param cell       index of the touched cell, relative to the origin.
+ * @param registers  the ucontext_t of the fault, for anything else the
+ *                   handler needs to know about the faulting code.
+ */
+typedef void (*bf_out_of_bounds_handler)(const void *pc, ptrdiff_t cell,
+        const void *registers);
+
+/**
+ * Reserves a universe where p may move up to maximum_size cells either way,
+ * with initial_size cells around the origin accessible right away.
+ *
+ * @return true if successful; release it with bf_universe_destroy().
+ */
+bool bf_universe_create(bf_universe *universe, size_t initial_size,
+        size_t maximum_size);
+
+/**
+ * Like bf_universe_create(), but the cells are those of the named file,
+ * mapped shared, so that they are loaded as they are touched and changes to
+ * them are written back to the file. p starts in the middle of the file.
+ * A new or empty file is first extended to size cells; otherwise, size is
+ * ignored, and the file must be a multiple of two pages long. The universe
+ * never grows.
+ *
+ * @return true if successful; otherwise, errno says why.
+ */
+bool bf_universe_create_from_file(bf_universe *universe, const char *filename,
+        size_t size);
+
+/**
+ * Installs a SIGSEGV handler that makes cells of the universe accessible as
+ * they are touched, and calls the handler when the guard regions are
+ * touched.
+ * Each thread watches one universe at a time: the one it last watched.
+ */
+void bf_universe_watch(bf_universe *universe, bf_out_of_bounds_handler handler);
+
+/**
+ * @return  the first cell that may ever be made accessible.
+ */
+uint8_t *bf_universe_start(const bf_universe *universe);
+
+/**
+ * @return  how many cells may ever be made accessible.
+ */
+size_t bf_universe_size(const bf_universe *universe);
+
+/**
+ * Zeroes the cells in [low, high) that are accessible, so the universe can
+ * be used for another run without clearing all of it; pass the range a
+ * program compiled with track_dirty has touched. Large ranges are given
+ * back to the system, to be zero-filled when next touched.
+ */
+void bf_universe_reset(bf_universe *universe, uint8_t *low, uint8_t *high);
+
+/**
+ * Releases the universe, and stops watching it.
+ */
+void bf_universe_destroy(bf_universe *universe);
+
+#endif /* BF_UNIVERSE_H */
@@ -1,20 +1,63 @@
-/* So that MAP_ANONYMOUS is available on glibc. */
-#define _BSD_SOURCE
+/* For MAP_ANONYMOUS and memfd_create(). */
+#define _GNU_SOURCE
 
+#include <unistd.h>
 #include <sys/mman.h>
 #ifndef MAP_ANONYMOUS
 #define MAP_ANONYMOUS MAP_ANON
 #endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
 
 #include <bf_alloc.h>
 
-uint8_t *allocate_executable_space(size_t size) {
+/**
+ * How much address space the arena reserves for code, the first time it
+ * is needed. Pages are only committed as they are written.
+ */
+#define ARENA_RESERVATION   ((size_t) 1 << 30)
+
+/**
+ * Size of a huge page. Chunks at least this large are aligned to it, and
+ * asked to be backed by huge pages, so that big programs take up fewer
+ * iTLB entries.
+ */
+#define HUGE_PAGE_SIZE      ((size_t) 2 * 1024 * 1024)
+
+/**
+ * Chunk sizes are a page times a power of two; this many of them.
+ */
+#define SIZE_CLASSES        32
+
+/*
+ * The arena: one large executable reservation, carved up from the start.
+ * Freed chunks are kept, on a free list per size class, to be handed out
+ * again; the link to the next free chunk is stored in the chunk itself.
+ *
+ * When dual-mapped, the executable reservation is a read-only view of a
+ * memfd that is also mapped, read-write, at base + writable_offset.
+ */
+static struct {
+    enum bf_code_mapping mapping;
+    uint8_t *base;
+    ptrdiff_t writable_offset;
+    size_t carved;
+    bool unavailable;
+
+    uint8_t *free_chunks[SIZE_CLASSES];
+    bf_code_arena_stats stats;
+} arena;
+
+/* Maps fresh executable memory outside of the arena. */
+static uint8_t *map_executable(size_t size, int flags) {
     uint8_t *memory = (uint8_t*) mmap(
             NULL,                       /* No existing address. */
             size,                       /* At LEAST this size. */
             PROT_EXEC|PROT_WRITE,       /* Writable and executable memory. */
-            MAP_PRIVATE|MAP_ANONYMOUS,  /* An anonymous mapping; using private
+            MAP_PRIVATE|MAP_ANONYMOUS   /* An anonymous mapping; using private
                                            mapping is most portable. */
+                | flags,
             -1,                         /* Using fd = -1 is most portable in
                                            conjunction with MAP_ANONYMOUS. */
             0                           /* Irrelevant for MAP_ANONYMOUS. */
@@ -27,9 +70,240 @@ uint8_t *allocate_executable_space(size_t size) {
     return memory;
 }
 
-bool free_executable_space(uint8_t *space, size_t size) {
-    if (munmap(space, size) == 0) {
+static size_t align_up(size_t offset, size_t alignment) {
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+/*
+ * Reserves inaccessible address space that starts on a huge page boundary,
+ * for mappings to be placed over with MAP_FIXED.
+ */
+static uint8_t *reserve_aligned(size_t size) {
+    uint8_t *reservation = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reservation == MAP_FAILED) {
+        return NULL;
+    }
+
+    /* Give back the ends that are not on the boundary. */
+    uint8_t *base = (uint8_t *) align_up((uintptr_t) reservation,
+            HUGE_PAGE_SIZE);
+    if (base > reservation) {
+        munmap(reservation, base - reservation);
+    }
+    munmap(base + size, reservation + HUGE_PAGE_SIZE - base);
+
+    return base;
+}
+
+bool bf_dual_map(size_t size, uint8_t **writable, uint8_t **executable) {
+    int fd = memfd_create("brainmuk-code", MFD_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    uint8_t *exec_view = reserve_aligned(size);
+    uint8_t *write_view = MAP_FAILED;
+
+    if (ftruncate(fd, size) == 0 && exec_view != NULL) {
+        write_view = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_NORESERVE, fd, 0);
+    }
+    if (write_view != MAP_FAILED
+            && mmap(exec_view, size, PROT_READ | PROT_EXEC,
+                MAP_SHARED | MAP_NORESERVE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+        /* The mappings keep the memory alive. */
+        close(fd);
+        *writable = write_view;
+        *executable = exec_view;
         return true;
     }
+
+    if (write_view != MAP_FAILED) {
+        munmap(write_view, size);
+    }
+    if (exec_view != NULL) {
+        munmap(exec_view, size);
+    }
+    close(fd);
     return false;
 }
+
+bool bf_dual_unmap(uint8_t *writable, uint8_t *executable, size_t size) {
+    bool unmapped = munmap(writable, size) == 0;
+    return munmap(executable, size) == 0 && unmapped;
+}
+
+/* Reserves a writable and executable arena. */
+static bool reserve_rwx(void) {
+    uint8_t *base = reserve_aligned(ARENA_RESERVATION);
+
+    if (base == NULL || mmap(base, ARENA_RESERVATION, PROT_EXEC | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                -1, 0) == MAP_FAILED) {
+        if (base != NULL) {
+            munmap(base, ARENA_RESERVATION);
+        }
+        return false;
+    }
+
+    arena.base = base;
+    arena.writable_offset = 0;
+    return true;
+}
+
+/* Reserves a dual-mapped arena. */
+static bool reserve_dual(void) {
+    uint8_t *writable, *executable;
+
+    if (!bf_dual_map(ARENA_RESERVATION, &writable, &executable)) {
+        return false;
+    }
+
+    arena.base = executable;
+    arena.writable_offset = writable - executable;
+    return true;
+}
+
+/* Reserves the arena as configured, or else as the system allows. */
+static bool reserve_arena(void) {
+    if (arena.base != NULL) {
+        return true;
+    }
+    if (arena.unavailable) {
+        return false;
+    }
+
+    bool reserved = arena.mapping == BF_CODE_MAPPING_DUAL
+        ? reserve_dual() || reserve_rwx()
+        /* Hardened kernels refuse writable, executable memory. */
+        : reserve_rwx() || reserve_dual();
+
+    if (!reserved) {
+        /* Fall back to a mapping per chunk. */
+        arena.unavailable = true;
+        return false;
+    }
+
+    arena.mapping = arena.writable_offset != 0
+        ? BF_CODE_MAPPING_DUAL
+        : BF_CODE_MAPPING_RWX;
+    arena.stats.reserved = ARENA_RESERVATION;
+    return true;
+}
+
+bool bf_code_arena_set_mapping(enum bf_code_mapping mapping) {
+    if (arena.base != NULL) {
+        return mapping == arena.mapping;
+    }
+
+    arena.mapping = mapping;
+    arena.unavailable = false;
+    return true;
+}
+
+enum bf_code_mapping bf_code_arena_mapping(void) {
+    reserve_arena();
+    return arena.mapping;
+}
+
+static bool in_arena(const uint8_t *space) {
+    return arena.base != NULL && space >= arena.base
+        && space < arena.base + ARENA_RESERVATION;
+}
+
+uint8_t *bf_writable_code(uint8_t *space) {
+    return in_arena(space) ? space + arena.writable_offset : space;
+}
+
+/* Finds the size class that fits size bytes, and the size of its chunks. */
+static size_t size_class(size_t size, size_t *chunk_size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t class = 0;
+
+    *chunk_size = page;
+    while (*chunk_size < size && class < SIZE_CLASSES - 1) {
+        *chunk_size *= 2;
+        class++;
+    }
+
+    return class;
+}
+
+/* Carves a new chunk out of the unused end of the arena. */
+static uint8_t *carve(size_t chunk_size) {
+    size_t alignment = chunk_size < HUGE_PAGE_SIZE ? chunk_size : HUGE_PAGE_SIZE;
+    size_t start = align_up(arena.carved, alignment);
+
+    if (start + chunk_size > ARENA_RESERVATION) {
+        return NULL;
+    }
+
+    arena.carved = start + chunk_size;
+    arena.stats.carved = arena.carved;
+
+#ifdef MADV_HUGEPAGE
+    if (chunk_size >= HUGE_PAGE_SIZE
+            && madvise(arena.base + start, chunk_size, MADV_HUGEPAGE) == 0) {
+        arena.stats.huge_chunks++;
+    }
+#endif
+
+    return arena.base + start;
+}
+
+uint8_t *allocate_executable_space(size_t size) {
+    size_t chunk_size;
+    size_t class = size_class(size, &chunk_size);
+    uint8_t *chunk = NULL;
+
+    if (chunk_size >= size && reserve_arena()) {
+        chunk = arena.free_chunks[class];
+        if (chunk != NULL) {
+            arena.free_chunks[class] = *(uint8_t **) bf_writable_code(chunk);
+            arena.stats.recycled++;
+        } else {
+            chunk = carve(chunk_size);
+        }
+    }
+
+    if (chunk == NULL) {
+        /* Too big for the arena: map it by itself. */
+        chunk = map_executable(size, 0);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        arena.stats.oversized++;
+        chunk_size = size;
+    }
+
+    arena.stats.allocations++;
+    arena.stats.in_use += chunk_size;
+    if (arena.stats.in_use > arena.stats.peak) {
+        arena.stats.peak = arena.stats.in_use;
+    }
+
+    return chunk;
+}
+
+bool free_executable_space(uint8_t *space, size_t size) {
+    size_t chunk_size;
+    size_t class = size_class(size, &chunk_size);
+
+    if (!in_arena(space)) {
+        if (munmap(space, size) != 0) {
+            return false;
+        }
+        arena.stats.in_use -= size;
+        return true;
+    }
+
+    *(uint8_t **) bf_writable_code(space) = arena.free_chunks[class];
+    arena.free_chunks[class] = space;
+    arena.stats.in_use -= chunk_size;
+    return true;
+}
+
+bf_code_arena_stats bf_code_arena_statistics(void) {
+    return arena.stats;
+}
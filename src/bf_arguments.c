@@ -1,11 +1,37 @@
 #include <stdio.h>
 #include <getopt.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <bf_arguments.h>
+#include <bf_lanes.h>
 #include <bf_version.h>
 
 #define INVALID_SIZE    0
+/* The largest circular tape: indices must fit in 31 bits. */
+#define MAX_WRAP_SIZE   ((size_t) 1 << 31)
+
+/* Values for options that only have a long form. */
+enum {
+    OPTION_EMIT = 0x100,
+    OPTION_SYMBOL,
+    OPTION_PROFILE_GENERATE,
+    OPTION_PROFILE_USE,
+    OPTION_PASSES,
+    OPTION_REPORT_PASSES,
+    OPTION_LANES,
+    OPTION_TAPE,
+    OPTION_BOUNDS_CHECK,
+    OPTION_TRACK_DIRTY,
+    OPTION_FORK,
+    OPTION_UNIVERSE_FILE,
+    OPTION_NO_CACHE,
+    OPTION_INPUT,
+    OPTION_ASYNC_OUTPUT,
+    OPTION_PIPE,
+    OPTION_DUAL_MAP,
+};
 
 static void usage(const char* program_name, FILE *stream);
 __attribute__((noreturn)) static void usage_error(const char *program_name);
@@ -62,20 +88,219 @@ static size_t parse_size(const char *str) {
     return factor * unit;
 }
 
+static int parse_level(const char *str) {
+    char *endptr;
+    long int level = strtol(str, &endptr, 10);
+
+    if (endptr == str || *endptr != '\0'
+            || level < 0 || level > BF_MAX_OPTIMIZATION) {
+        return -1;
+    }
+
+    return level;
+}
+
+/* Returns the number of lanes, or 0 if it is not a supported number. */
+static size_t parse_lanes(const char *str) {
+    char *endptr;
+    long int lanes = strtol(str, &endptr, 10);
+
+    if (endptr == str || *endptr != '\0' || lanes <= 0
+            || lanes > BF_MAX_LANES || lanes % BF_LANES_PER_VECTOR != 0) {
+        return 0;
+    }
+
+    return lanes;
+}
+
+static bool parse_tape_mode(const char *str, enum bf_tape_mode *mode) {
+    if (strcmp(str, "grow") == 0) {
+        *mode = BF_TAPE_GROW;
+    } else if (strcmp(str, "wrap") == 0) {
+        *mode = BF_TAPE_WRAP;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+/* Rounds up to the next power of two. */
+static size_t power_of_two(size_t size) {
+    size_t power = 1;
+    while (power < size) {
+        power <<= 1;
+    }
+    return power;
+}
+
+static bool parse_emit_target(const char *str, enum bf_emit_target *target) {
+    if (strcmp(str, "jit") == 0) {
+        *target = BF_EMIT_JIT;
+    } else if (strcmp(str, "c") == 0) {
+        *target = BF_EMIT_C;
+    } else if (strcmp(str, "exe") == 0) {
+        *target = BF_EMIT_EXE;
+    } else if (strcmp(str, "obj") == 0) {
+        *target = BF_EMIT_OBJ;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
 bf_options parse_arguments(int argc, char **argv) {
     int option = -1;
+    const char *pass_spec = NULL;
     bf_options parameters = {
         .minimum_universe_size = 640 * 1024, /* ought to be enough for anybody. */
-        .filename = NULL
+        .universe_file = NULL,
+        .filename = NULL,
+        .input_filename = NULL,
+        .emit = BF_EMIT_JIT,
+        .output_filename = NULL,
+        .async_output = false,
+        .symbol = NULL,
+        .profile_generate = NULL,
+        .profile_use = NULL,
+        .optimization_level = BF_DEFAULT_OPTIMIZATION,
+        .report_passes = false,
+        .lanes = 0,
+        .tape = BF_TAPE_GROW,
+        .bounds_check = false,
+        .track_dirty = false,
+        .fork = false,
+        .inputs = NULL,
+        .input_count = 0,
+        .pipe = false,
+        .stages = NULL,
+        .stage_count = 0,
+        .cache = true,
+        .dual_map = false,
     };
 
     static const struct option longopts[] = {
+        {
+            .name = "async-output",
+            .has_arg = no_argument,
+            .flag = NULL,
+            .val = OPTION_ASYNC_OUTPUT,
+        },
+        {
+            .name = "bounds-check",
+            .has_arg = no_argument,
+            .flag = NULL,
+            .val = OPTION_BOUNDS_CHECK,
+        },
+        {
+            .name = "dual-map",
+            .has_arg = no_argument,
+            .flag = NULL,
+            .val = OPTION_DUAL_MAP,
+        },
+        {
+            .name = "emit",
+            .has_arg = required_argument,
+            .flag = NULL,
+            .val = OPTION_EMIT,
+        },
+        {
+            .name = "fork",
+            .has_arg = no_argument,
+            .flag = NULL,
+            .val = OPTION_FORK,
+        },
         {
             .name = "help",
             .has_arg = no_argument,
             .flag = NULL,
             .val = 'h',
         },
+        {
+            .name = "input",
+            .has_arg = required_argument,
+            .flag = NULL,
+            .val = OPTION_INPUT,
+        },
+        {
+            .name = "lanes",
+            .has_arg = required_argument,
+            .flag = NULL,
+            .val = OPTION_LANES,
+        },
+        {
+            .name = "no-cache",
+            .has_arg = no_argument,
+            .flag = NULL,
+            .val = OPTION_NO_CACHE,
+        },
+        {
+            .name = "optimize",
+            .has_arg = required_argument,
+            .flag = NULL,
+            .val = 'O',
+        },
+        {
+            .name = "output",
+            .has_arg = required_argument,
+            .flag = NULL,
+            .val = 'o',
+        },
+        {
+            .name = "passes",
+            .has_arg = required_argument,
+            .flag = NULL,
+            .val = OPTION_PASSES,
+        },
+        {
+            .name = "pipe",
+            .has_arg = no_argument,
+            .flag = NULL,
+            .val = OPTION_PIPE,
+        },
+        {
+            .name = "profile-generate",
+            .has_arg = required_argument,
+            .flag = NULL,
+            .val = OPTION_PROFILE_GENERATE,
+        },
+        {
+            .name = "profile-use",
+            .has_arg = required_argument,
+            .flag = NULL,
+            .val = OPTION_PROFILE_USE,
+        },
+        {
+            .name = "report-passes",
+            .has_arg = no_argument,
+            .flag = NULL,
+            .val = OPTION_REPORT_PASSES,
+        },
+        {
+            .name = "symbol",
+            .has_arg = required_argument,
+            .flag = NULL,
+            .val = OPTION_SYMBOL,
+        },
+        {
+            .name = "tape",
+            .has_arg = required_argument,
+            .flag = NULL,
+            .val = OPTION_TAPE,
+        },
+        {
+            .name = "track-dirty",
+            .has_arg = no_argument,
+            .flag = NULL,
+            .val = OPTION_TRACK_DIRTY,
+        },
+        {
+            .name = "universe-file",
+            .has_arg = required_argument,
+            .flag = NULL,
+            .val = OPTION_UNIVERSE_FILE,
+        },
         {
             .name = "universe-size",
             .has_arg = required_argument,
@@ -91,7 +316,7 @@ bf_options parse_arguments(int argc, char **argv) {
         { NULL, 0, NULL, 0 }
     };
 
-    while ((option = getopt_long(argc, argv, "hm:v", longopts, NULL)) != -1) {
+    while ((option = getopt_long(argc, argv, "hm:o:O:v", longopts, NULL)) != -1) {
         switch (option) {
             case 'h': /* --help */
                 usage(argv[0], stdout);
@@ -108,6 +333,98 @@ bf_options parse_arguments(int argc, char **argv) {
 
                 break;
 
+            case OPTION_UNIVERSE_FILE: /* --universe-file */
+                parameters.universe_file = optarg;
+                break;
+
+            case 'o': /* --output */
+                parameters.output_filename = optarg;
+                break;
+
+            case OPTION_INPUT: /* --input */
+                parameters.input_filename = optarg;
+                break;
+
+            case OPTION_ASYNC_OUTPUT: /* --async-output */
+                parameters.async_output = true;
+                break;
+
+            case OPTION_EMIT: /* --emit */
+                if (!parse_emit_target(optarg, &parameters.emit)) {
+                    fprintf(stderr, "Invalid target: %s\n", optarg);
+                    usage_error(argv[0]);
+                }
+                break;
+
+            case 'O': /* --optimize */
+                parameters.optimization_level = parse_level(optarg);
+
+                if (parameters.optimization_level < 0) {
+                    fprintf(stderr, "Invalid optimization level: %s\n", optarg);
+                    usage_error(argv[0]);
+                }
+                break;
+
+            case OPTION_PASSES: /* --passes */
+                pass_spec = optarg;
+                break;
+
+            case OPTION_REPORT_PASSES: /* --report-passes */
+                parameters.report_passes = true;
+                break;
+
+            case OPTION_LANES: /* --lanes */
+                parameters.lanes = parse_lanes(optarg);
+
+                if (parameters.lanes == 0) {
+                    fprintf(stderr, "Invalid number of lanes: %s\n", optarg);
+                    usage_error(argv[0]);
+                }
+                break;
+
+            case OPTION_TAPE: /* --tape */
+                if (!parse_tape_mode(optarg, &parameters.tape)) {
+                    fprintf(stderr, "Invalid tape: %s\n", optarg);
+                    usage_error(argv[0]);
+                }
+                break;
+
+            case OPTION_BOUNDS_CHECK: /* --bounds-check */
+                parameters.bounds_check = true;
+                break;
+
+            case OPTION_TRACK_DIRTY: /* --track-dirty */
+                parameters.track_dirty = true;
+                break;
+
+            case OPTION_FORK: /* --fork */
+                parameters.fork = true;
+                break;
+
+            case OPTION_PIPE: /* --pipe */
+                parameters.pipe = true;
+                break;
+
+            case OPTION_NO_CACHE: /* --no-cache */
+                parameters.cache = false;
+                break;
+
+            case OPTION_DUAL_MAP: /* --dual-map */
+                parameters.dual_map = true;
+                break;
+
+            case OPTION_PROFILE_GENERATE: /* --profile-generate */
+                parameters.profile_generate = optarg;
+                break;
+
+            case OPTION_PROFILE_USE: /* --profile-use */
+                parameters.profile_use = optarg;
+                break;
+
+            case OPTION_SYMBOL: /* --symbol */
+                parameters.symbol = optarg;
+                break;
+
             case 'v': /* --version */
                 version(argv[0]);
                 exit(0);
@@ -119,11 +436,132 @@ bf_options parse_arguments(int argc, char **argv) {
         }
     }
 
+    /* --passes adjusts the passes of the level, wherever it appears. */
+    parameters.passes = bf_ir_passes_for_level(parameters.optimization_level);
+    if (pass_spec != NULL && !bf_ir_parse_passes(pass_spec, &parameters.passes)) {
+        fprintf(stderr, "Invalid pass list: %s\n", pass_spec);
+        usage_error(argv[0]);
+    }
+
+    /* A circular tape is indexed with a mask. */
+    if (parameters.tape == BF_TAPE_WRAP) {
+        parameters.minimum_universe_size =
+            power_of_two(parameters.minimum_universe_size);
+
+        if (parameters.minimum_universe_size > MAX_WRAP_SIZE) {
+            fprintf(stderr, "Circular tapes may be at most 2g\n");
+            usage_error(argv[0]);
+        }
+        if (parameters.emit != BF_EMIT_JIT || parameters.lanes > 0) {
+            fprintf(stderr, "--tape=wrap only works when running programs\n");
+            usage_error(argv[0]);
+        }
+
+        /*
+         * Cells at offsets that differ by a multiple of the tape size are
+         * the same cell, which the passes assume never happens. Without
+         * the offset pass, offsets stay much smaller than any tape.
+         */
+        parameters.passes &= ~BF_PASS_OFFSET;
+    }
+
+    /* Only machine code checks its bounds. */
+    if (parameters.bounds_check) {
+        if (parameters.tape == BF_TAPE_WRAP) {
+            fprintf(stderr, "A circular tape has no bounds to check\n");
+            usage_error(argv[0]);
+        }
+        if ((parameters.emit != BF_EMIT_JIT && parameters.emit != BF_EMIT_OBJ)
+                || parameters.lanes > 0) {
+            fprintf(stderr, "--bounds-check only works when running programs "
+                    "or with --emit=obj\n");
+            usage_error(argv[0]);
+        }
+    }
+
+    /* Only a caller that reuses the tape can make use of the range. */
+    if (parameters.track_dirty && parameters.emit != BF_EMIT_OBJ) {
+        fprintf(stderr, "--track-dirty only works with --emit=obj\n");
+        usage_error(argv[0]);
+    }
+
+    /* The file is one tape, that stays put. */
+    if (parameters.universe_file != NULL
+            && (parameters.emit != BF_EMIT_JIT || parameters.lanes > 0
+                || parameters.tape == BF_TAPE_WRAP)) {
+        fprintf(stderr, "--universe-file only works when running programs, "
+                "without --tape=wrap\n");
+        usage_error(argv[0]);
+    }
+
     /* If we have arguments left-over, let it be the filename. */
     if (optind < argc) {
         parameters.filename = argv[optind];
     }
 
+    /* ...or, with --pipe, the first stage; the rest follow it. */
+    if (parameters.pipe) {
+        if (optind + 1 >= argc) {
+            fprintf(stderr, "--pipe needs at least two files\n");
+            usage_error(argv[0]);
+        }
+        if (parameters.emit != BF_EMIT_JIT || parameters.lanes > 0
+                || parameters.fork || parameters.profile_generate != NULL
+                || parameters.profile_use != NULL
+                || parameters.universe_file != NULL) {
+            fprintf(stderr, "--pipe only works when running programs, "
+                    "without --fork, --lanes, profiles or --universe-file\n");
+            usage_error(argv[0]);
+        }
+
+        parameters.stages = &argv[optind];
+        parameters.stage_count = argc - optind;
+    }
+
+    /* The REPL's input is its programs; --fork has inputs of its own. */
+    if (parameters.input_filename != NULL
+            && (parameters.emit != BF_EMIT_JIT || parameters.filename == NULL
+                || parameters.fork)) {
+        fprintf(stderr, "--input only works when running a file, "
+                "without --fork\n");
+        usage_error(argv[0]);
+    }
+
+    /* Running, it is the program's output; every copy of it would share. */
+    if (parameters.output_filename != NULL && parameters.emit == BF_EMIT_JIT
+            && (parameters.filename == NULL || parameters.fork)) {
+        fprintf(stderr, "-o only works when running a file, "
+                "without --fork\n");
+        usage_error(argv[0]);
+    }
+
+    /* The copies of a forked program write their output themselves. */
+    if (parameters.async_output
+            && (parameters.emit != BF_EMIT_JIT || parameters.filename == NULL
+                || parameters.fork || parameters.lanes > 0)) {
+        fprintf(stderr, "--async-output only works when running a file, "
+                "without --fork or --lanes\n");
+        usage_error(argv[0]);
+    }
+
+    /* ...and the rest, the inputs to fork for. */
+    if (parameters.fork) {
+        if (optind + 1 >= argc) {
+            fprintf(stderr, "--fork needs a file and at least one input\n");
+            usage_error(argv[0]);
+        }
+        if (parameters.emit != BF_EMIT_JIT || parameters.lanes > 0
+                || parameters.profile_generate != NULL
+                || parameters.universe_file != NULL) {
+            fprintf(stderr, "--fork only works when running programs, "
+                    "without --profile-generate or --universe-file\n");
+            usage_error(argv[0]);
+        }
+
+        parameters.inputs = &argv[optind + 1];
+        parameters.input_count = argc - optind - 1;
+    }
+
     /* RESET GLOBAL STATE! Yeah, getopt_long() works with globals... */
     optind = 0;
 
@@ -132,9 +570,23 @@ bf_options parse_arguments(int argc, char **argv) {
 
 static void usage(const char* program_name, FILE *stream) {
     fprintf(stream,
-        "Usage:\t%s [-m SIZE] [file]\n"
+        "Usage:\t%s [-m SIZE] [--tape=grow|wrap|--bounds-check]\n"
+        "\t\t[--universe-file=FILE] [--input=FILE] [-o OUTPUT] [--async-output]\n"
+        "\t\t[--no-cache] [--dual-map] [-O0|-O1|-O2|-O3]\n"
+        "\t\t[--passes=[+|-]PASS,...] [--report-passes]\n"
+        "\t\t[--profile-generate=FILE|--profile-use=FILE] [file]\n"
+        "\t%s [-m SIZE] [-O0|-O1|-O2|-O3] --fork file input...\n"
+        "\t%s [-m SIZE] [--tape=grow|wrap|--bounds-check] [--input=FILE]\n"
+        "\t\t[-o OUTPUT] [--async-output] [--no-cache] [-O0|-O1|-O2|-O3]\n"
+        "\t\t--pipe file file...\n"
+        "\t%s [-m SIZE] [-O0|-O1|-O2|-O3] --lanes=16|32 [--input=FILE]\n"
+        "\t\t[-o OUTPUT] file\n"
+        "\t%s [-m SIZE] --emit=c|exe [-o OUTPUT] file\n"
+        "\t%s --emit=obj [-o OUTPUT] [--symbol=NAME] [--bounds-check]\n"
+        "\t\t[--track-dirty] file\n"
         "\t%s [--help|--version]\n",
-        program_name, program_name);
+        program_name, program_name, program_name, program_name,
+        program_name, program_name, program_name);
 }
 
 __attribute__((noreturn))
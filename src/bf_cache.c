@@ -0,0 +1,290 @@
+/* For mkdir() and getpid(). */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <bf_cache.h>
+#include <bf_version.h>
+
+#define CACHE_MAGIC "brainmuk-code"
+
+/*
+ * A cache file is this header, then the memoized loops (as IR operations),
+ * the code offsets and the source offsets of the source map, and finally,
+ * starting on a page boundary so that it can be mapped by itself, the
+ * machine code.
+ */
+struct cache_header {
+    char magic[16];
+    uint64_t abi_version;
+    uint64_t op_size;
+
+    uint64_t bounded;
+    int64_t low;
+    int64_t high;
+
+    uint64_t memoized;
+    uint64_t map_length;
+    uint64_t code_offset;
+    uint64_t code_length;
+};
+
+/* FNV-1a, from two different offset bases, for a 128-bit key. */
+#define FNV_PRIME   UINT64_C(0x100000001b3)
+
+static void hash(const void *data, size_t length, uint64_t key[2]) {
+    const uint8_t *bytes = data;
+
+    for (size_t i = 0; i < length; i++) {
+        key[0] = (key[0] ^ bytes[i]) * FNV_PRIME;
+        key[1] = (key[1] ^ bytes[i]) * FNV_PRIME;
+    }
+}
+
+/* Creates the directory, and any of its parents that are missing. */
+static bool make_directories(char *path) {
+    for (char *slash = strchr(path + 1, '/'); slash != NULL;
+            slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        bool made = mkdir(path, 0777) == 0 || errno == EEXIST;
+        *slash = '/';
+
+        if (!made) {
+            return false;
+        }
+    }
+
+    return mkdir(path, 0777) == 0 || errno == EEXIST;
+}
+
+/* Returns the cache directory, which must be free()'d, or NULL. */
+static char *cache_directory(void) {
+    const char *base = getenv("BRAINMUK_CACHE");
+    const char *suffix = "";
+
+    if (base == NULL || *base == '\0') {
+        base = getenv("XDG_CACHE_HOME");
+        suffix = "/brainmuk";
+    }
+    if (base == NULL || *base == '\0') {
+        base = getenv("HOME");
+        suffix = "/.cache/brainmuk";
+    }
+    if (base == NULL || *base == '\0') {
+        return NULL;
+    }
+
+    char *directory = malloc(strlen(base) + strlen(suffix) + 1);
+    if (directory == NULL) {
+        abort();
+    }
+    strcpy(directory, base);
+    strcat(directory, suffix);
+
+    if (!make_directories(directory)) {
+        free(directory);
+        return NULL;
+    }
+
+    return directory;
+}
+
+char *bf_cache_filename(const char *source, const char *variant) {
+    static const char version[] = "brainmuk " BF_VERSION;
+    uint64_t key[2] = {
+        UINT64_C(0xcbf29ce484222325), UINT64_C(0x84222325cbf29ce4)
+    };
+    uint64_t abi_version = BF_CODE_ABI_VERSION;
+    uint64_t op_size = sizeof(struct bf_ir_op);
+
+    char *directory = cache_directory();
+    if (directory == NULL) {
+        return NULL;
+    }
+
+    /* Anything that changes the file changes its name. */
+    hash(version, sizeof(version), key);
+    hash(&abi_version, sizeof(abi_version), key);
+    hash(&op_size, sizeof(op_size), key);
+    hash(variant, strlen(variant) + 1, key);
+    hash(source, strlen(source), key);
+
+    size_t length = strlen(directory)
+        + sizeof("/0123456789abcdef0123456789abcdef.code");
+    char *filename = malloc(length);
+    if (filename == NULL) {
+        abort();
+    }
+    snprintf(filename, length, "%s/%016" PRIx64 "%016" PRIx64 ".code",
+            directory, key[0], key[1]);
+
+    free(directory);
+    return filename;
+}
+
+/* Checks that the header describes a file of this size, that we wrote. */
+static bool valid_header(const struct cache_header *header, size_t file_size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+            || header->abi_version != BF_CODE_ABI_VERSION
+            || header->op_size != sizeof(struct bf_ir_op)) {
+        return false;
+    }
+
+    /* Each table fits in the file, so their sum cannot overflow. */
+    if (header->memoized > file_size / sizeof(struct bf_ir_op)
+            || header->map_length > file_size / (2 * sizeof(size_t))) {
+        return false;
+    }
+
+    size_t tables = sizeof(*header)
+        + header->memoized * sizeof(struct bf_ir_op)
+        + header->map_length * 2 * sizeof(size_t);
+
+    return header->code_offset >= tables
+        && header->code_offset % page == 0
+        && header->code_length > 0
+        && header->code_offset <= file_size
+        && header->code_length <= file_size - header->code_offset;
+}
+
+bool bf_cache_load(const char *filename, bf_cached_program *cached) {
+    struct stat status;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    if (fstat(fd, &status) != 0
+            || (size_t) status.st_size < sizeof(struct cache_header)) {
+        close(fd);
+        return false;
+    }
+
+    size_t file_size = status.st_size;
+    uint8_t *file = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    const struct cache_header *header = (const struct cache_header *) file;
+    if (!valid_header(header, file_size)) {
+        munmap(file, file_size);
+        close(fd);
+        return false;
+    }
+
+    /* Fails where files may not be executed (e.g., mounted noexec). */
+    uint8_t *code = mmap(NULL, header->code_length, PROT_READ | PROT_EXEC,
+            MAP_PRIVATE, fd, header->code_offset);
+    close(fd);
+    if (code == MAP_FAILED) {
+        munmap(file, file_size);
+        return false;
+    }
+
+    uint8_t *tables = file + sizeof(*header);
+    size_t *code_offsets = (size_t *) (tables
+            + header->memoized * sizeof(struct bf_ir_op));
+
+    *cached = (bf_cached_program) {
+        .program = (program_t) code,
+        .code_length = header->code_length,
+        .map = {
+            .code_offsets = code_offsets,
+            .source_offsets = code_offsets + header->map_length,
+            .length = header->map_length,
+            .capacity = header->map_length,
+        },
+        .memoized = {
+            .ops = (struct bf_ir_op *) tables,
+            .length = header->memoized,
+            .capacity = header->memoized,
+        },
+        .bounded = header->bounded,
+        .low = header->low,
+        .high = header->high,
+        .file = file,
+        .file_size = file_size,
+        .code = code,
+        .code_size = header->code_length,
+    };
+
+    return true;
+}
+
+bool bf_cache_store(const char *filename, const bf_ir *ir,
+        const uint8_t *code, size_t code_length, const bf_source_map *map) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    struct cache_header header = {
+        .magic = CACHE_MAGIC,
+        .abi_version = BF_CODE_ABI_VERSION,
+        .op_size = sizeof(struct bf_ir_op),
+        .map_length = map->length,
+        .code_length = code_length,
+    };
+
+    header.bounded = bf_ir_pointer_range(ir, &header.low, &header.high);
+    for (size_t i = 0; i < ir->length; i++) {
+        header.memoized += ir->ops[i].kind == BF_IR_LOOP && ir->ops[i].memoize;
+    }
+
+    size_t tables = sizeof(header)
+        + header.memoized * sizeof(struct bf_ir_op)
+        + header.map_length * 2 * sizeof(size_t);
+    header.code_offset = (tables + page - 1) / page * page;
+
+    /* Write it aside, then move it in place all at once. */
+    size_t length = strlen(filename) + sizeof(".4294967295.tmp");
+    char *temporary = malloc(length);
+    if (temporary == NULL) {
+        abort();
+    }
+    snprintf(temporary, length, "%s.%ld.tmp", filename, (long) getpid());
+
+    FILE *stream = fopen(temporary, "wb");
+    if (stream == NULL) {
+        free(temporary);
+        return false;
+    }
+
+    fwrite(&header, sizeof(header), 1, stream);
+    for (size_t i = 0; i < ir->length; i++) {
+        if (ir->ops[i].kind == BF_IR_LOOP && ir->ops[i].memoize) {
+            fwrite(&ir->ops[i], sizeof(struct bf_ir_op), 1, stream);
+        }
+    }
+    fwrite(map->code_offsets, sizeof(size_t), map->length, stream);
+    fwrite(map->source_offsets, sizeof(size_t), map->length, stream);
+
+    /* The gap before the code reads back as zeros. */
+    fseek(stream, header.code_offset, SEEK_SET);
+    fwrite(code, 1, code_length, stream);
+
+    bool failed = ferror(stream);
+    bool written = (fclose(stream) == 0) && !failed
+        && rename(temporary, filename) == 0;
+    if (!written) {
+        remove(temporary);
+    }
+
+    free(temporary);
+    return written;
+}
+
+void bf_cache_release(bf_cached_program *cached) {
+    munmap(cached->code, cached->code_size);
+    munmap(cached->file, cached->file_size);
+    *cached = (bf_cached_program) { 0 };
+}
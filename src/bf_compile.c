@@ -8,36 +8,87 @@
 #include <bf_compile.h>
 
 /**
- * Loops may only be nested upto this length.
+ * Placeholder for a 32-bit operand that is patched in after the snippet is
+ * appended.
  */
-#define MAX_NESTING_DEPTH   128
-/**
- * We're not in any loop!
- */
-#define NOT_IN_LOOP         -1
+#define PLACEHOLDER_32      0xff, 0xff, 0xff, 0xff
 
 /**
  * (for bf_program_text) the allocation is of an unknown size.
  */
 #define INDETERMINATE_SPACE 0
 
+/**
+ * Loops whose bodies ran at least this many times in the profile are hot.
+ */
+#define HOT_LOOP_ITERATIONS 4096
+/**
+ * Hot loop bodies start on a boundary of this many bytes.
+ */
+#define HOT_LOOP_ALIGNMENT  16
+/**
+ * Hot loops whose bodies ran at least this many times per entry in the
+ * profile, and are at most so many operations long, are unrolled this many
+ * times.
+ */
+#define UNROLL_TRIP_COUNT   8
+#define MAX_UNROLLED_BODY   16
+#define UNROLL_FACTOR       4
+
+/**
+ * How many cells filter loops may use for scratch, each of which is checked
+ * before every copy.
+ */
+#define MAX_FILTER_SCRATCH  32
+
 /* Context for outputing a loop. */
 struct loop_context {
     /* Offset of the loop set up. */
     size_t loop_top_offset;
     /* Offset of the instruction to overwrite. */
     size_t placeholder_address_offset;
-    /* Offset of the instruction to overwrite. */
+    /* Offset of the first instruction of the loop body. */
     size_t loop_body_offset;
+    /* Is p an index into a circular tape? */
+    bool wrapped;
+    /* For memoized loops: the loop's cache number, and the offset of the
+     * jump taken on a cache hit. */
+    bool memoized;
+    uint32_t memo_number;
+    size_t memo_hit_offset;
+    /* For unrolled loops: the BF_IR_LOOP, how many more copies of the body
+     * are to be written, and the offsets of the jumps out from between
+     * them. */
+    size_t loop_op;
+    unsigned copies;
+    size_t exits[UNROLL_FACTOR - 1];
+    size_t exit_count;
 };
 
-/* Conventions:
+/* Conventions (bump BF_CODE_ABI_VERSION when changing them, or any of
+ * the code below):
  *
  *  %rbx:
  *      contains uint8_t *p.
  *  0x10(%ebp):
  *      contains uint8_t *universe
- *  -0x10(%ebp):
+ *  0x28(%ebp):
+ *      contains uint64_t *loop_counters
+ *  0x30(%ebp) to 0x40(%ebp):
+ *      contain memo, memo_enter() and memo_leave()
+ *  0x48(%ebp) to 0x58(%ebp):
+ *      contain tape_start, tape_end and out_of_bounds()
+ *  0x60(%ebp):
+ *      contains struct bf_dirty_range *dirty
+ *  0x68(%ebp) to 0x78(%ebp):
+ *      contain output_start, output_end and flush_output()
+ *  0x80(%ebp) to 0x90(%ebp):
+ *      contain input_start, input_end and fill_input()
+ *  0x98(%ebp):
+ *      contains copy_input()
+ *  0xa0(%ebp):
+ *      contains write_output()
+ *  -0x8(%ebp):
  *      contains save space for %rbx
  */
 static const uint8_t function_prologue[] = {
@@ -76,20 +127,41 @@ static const uint8_t decrement_memory[] = {
     0xfe, 0x0b              // decb (%rbx)
 };
 
+static const uint8_t add_memory[] = {
+    /* *(p + offset) += value */
+    0x80, 0x83, PLACEHOLDER_32, 0xff,   // addb $value, offset(%rbx)
+};
+
+static const uint8_t set_memory[] = {
+    /* *(p + offset) = value */
+    0xc6, 0x83, PLACEHOLDER_32, 0xff,   // movb $value, offset(%rbx)
+};
+
+static const uint8_t multiply_memory[] = {
+    /* *(p + offset) += *p * value */
+    0x0f, 0xb6, 0x03,                   // movzbl   (%rbx), %eax
+    0x69, 0xc0, PLACEHOLDER_32,         // imull    $value, %eax, %eax
+    0x00, 0x83, PLACEHOLDER_32,         // addb     %al, offset(%rbx)
+};
+
 static const uint8_t increment_data_pointer[] = {
-    /* (*p)++ */
+    /* p++ */
     0x48, 0xff, 0xc3        // incq %rbx
 };
 
 static const uint8_t decrement_data_pointer[] = {
-    /* (*p)-- */
+    /* p-- */
     0x48, 0xff, 0xcb        // decq %rbx
 };
 
+static const uint8_t move_data_pointer[] = {
+    /* p += value */
+    0x48, 0x81, 0xc3, PLACEHOLDER_32,   // addq $value, %rbx
+};
+
 static const uint8_t output_byte[] = {
-    /* prepare first argument (%edi = *p). */
-    0x8a, 0x13,             // movb     (%rbx), %dl
-    0x0f, 0xbe, 0xfa,       // movsbl   %dl, %edi
+    /* prepare first argument (%edi = *(p + offset)). */
+    0x0f, 0xb6, 0xbb, PLACEHOLDER_32,   // movzbl   offset(%rbx), %edi
 
     /* do indirect call to output_byte(). */
     0x48, 0x8d, 0x45, 0x10, // leaq     0x10(%rbp), %rax
@@ -100,23 +172,432 @@ static const uint8_t output_byte[] = {
 static const uint8_t input_byte[] = {
     /* do indirect call to input_byte(). */
     0x48, 0x8d, 0x4d, 0x10, // leaq     0x10(%rbp), %rcx
-    0xff, 0x51, 0x10,       // callq    *0x10(%rax)
+    0xff, 0x51, 0x10,       // callq    *0x10(%rcx)
 
     /* Write the input back (returned by input_byte() in %al). */
-    0x88, 0x03,             // movb     %al, (%rbx)
+    0x88, 0x83, PLACEHOLDER_32,         // movb %al, offset(%rbx)
 };
 
 static const uint8_t loop_top[] = {
-    /* Compare *p against 0. */
-    0x8a, 0x0b,                         // movb (%rbx), %cl
-    0x80, 0xf9, 0x00,                   // cmpb $0x0, %cl
-    /* Skip if 0. */
-    0x0f, 0x84, 0xff, 0xff, 0xff, 0xff, // je   [PLACEHOLDER]
+    /* Skip the loop entirely if *p is 0. */
+    0x80, 0x3b, 0x00,                   // cmpb $0x0, (%rbx)
+    0x0f, 0x84, PLACEHOLDER_32,         // je   [PLACEHOLDER]
 };
 
 static const uint8_t loop_bottom[] = {
-    /* Unconditionally jump to loop start. */
-    0xe9, 0xff, 0xff, 0xff, 0xff,       // jmp  [PLACEHOLDER]
+    /* Go back to the start of the body while *p is not 0. */
+    0x80, 0x3b, 0x00,                   // cmpb $0x0, (%rbx)
+    0x0f, 0x85, PLACEHOLDER_32,         // jne  [PLACEHOLDER]
+};
+
+static const uint8_t count_loop[] = {
+    /* ++loop_counters[n] */
+    0x48, 0x8b, 0x45, 0x28,             // movq     0x28(%rbp), %rax
+    0x48, 0xff, 0x80, PLACEHOLDER_32,   // incq     8n(%rax)
+};
+
+static const uint8_t memo_enter[] = {
+    /* if (memo_enter(memo, n, p)) skip the loop. */
+    0x48, 0x8b, 0x7d, 0x30,             // movq     0x30(%rbp), %rdi
+    0xbe, PLACEHOLDER_32,               // movl     $n, %esi
+    0x48, 0x89, 0xda,                   // movq     %rbx, %rdx
+    0xff, 0x55, 0x38,                   // callq    *0x38(%rbp)
+    0x84, 0xc0,                         // testb    %al, %al
+    0x0f, 0x85, PLACEHOLDER_32,         // jne      [PLACEHOLDER]
+};
+
+static const uint8_t memo_leave[] = {
+    /* memo_leave(memo, n, p) */
+    0x48, 0x8b, 0x7d, 0x30,             // movq     0x30(%rbp), %rdi
+    0xbe, PLACEHOLDER_32,               // movl     $n, %esi
+    0x48, 0x89, 0xda,                   // movq     %rbx, %rdx
+    0xff, 0x55, 0x40,                   // callq    *0x40(%rbp)
+};
+
+static const uint8_t check_bounds[] = {
+    /* Is p + low before the start of the tape? */
+    0x48, 0x8d, 0x83, PLACEHOLDER_32,   // leaq     low(%rbx), %rax
+    0x48, 0x3b, 0x45, 0x48,             // cmpq     0x48(%rbp), %rax
+    0x72, 0x0d,                         // jb       out_of_bounds
+    /* Is p + high before the end of the tape? */
+    0x48, 0x8d, 0x83, PLACEHOLDER_32,   // leaq     high(%rbx), %rax
+    0x48, 0x3b, 0x45, 0x50,             // cmpq     0x50(%rbp), %rax
+    0x72, 0x0e,                         // jb       in_bounds
+    /* out_of_bounds: out_of_bounds(source_offset, p + low or p + high,
+     *                              output cursor) */
+    0x4c, 0x89, 0xea,                   // movq     %r13, %rdx
+    0xbf, PLACEHOLDER_32,               // movl     $source_offset, %edi
+    0x48, 0x89, 0xc6,                   // movq     %rax, %rsi
+    0xff, 0x55, 0x58,                   // callq    *0x58(%rbp)
+    /* in_bounds: */
+};
+
+static const uint8_t track_dirty[] = {
+    /* dirty->low = min(dirty->low, p + low) */
+    0x48, 0x8b, 0x4d, 0x60,             // movq     0x60(%rbp), %rcx
+    0x48, 0x8d, 0x83, PLACEHOLDER_32,   // leaq     low(%rbx), %rax
+    0x48, 0x3b, 0x01,                   // cmpq     (%rcx), %rax
+    0x73, 0x03,                         // jae      1f
+    0x48, 0x89, 0x01,                   // movq     %rax, (%rcx)
+    /* 1: dirty->high = max(dirty->high, p + high + 1) */
+    0x48, 0x8d, 0x83, PLACEHOLDER_32,   // leaq     high+1(%rbx), %rax
+    0x48, 0x3b, 0x41, 0x08,             // cmpq     0x8(%rcx), %rax
+    0x76, 0x04,                         // jbe      2f
+    0x48, 0x89, 0x41, 0x08,             // movq     %rax, 0x8(%rcx)
+    /* 2: */
+};
+
+/*
+ * With buffer_output, %r13 is the output cursor; its caller's value is
+ * saved at -0x18(%rbp). The limit of the space it may write to is kept at
+ * -0x20(%rbp).
+ */
+static const uint8_t buffered_prologue[] = {
+    /* Make room for them, keeping the stack aligned. */
+    0x48, 0x83, 0xec, 0x10,             // subq     $0x10, %rsp
+    0x4c, 0x89, 0x6d, 0xe8,             // movq     %r13, -0x18(%rbp)
+    0x4c, 0x8b, 0x6d, 0x68,             // movq     0x68(%rbp), %r13
+    0x48, 0x8b, 0x45, 0x70,             // movq     0x70(%rbp), %rax
+    0x48, 0x89, 0x45, 0xe0,             // movq     %rax, -0x20(%rbp)
+};
+
+static const uint8_t flush_output[] = {
+    /* (cursor, limit) = flush_output(output_start, cursor) */
+    0x48, 0x8b, 0x7d, 0x68,             // movq     0x68(%rbp), %rdi
+    0x4c, 0x89, 0xee,                   // movq     %r13, %rsi
+    0xff, 0x55, 0x78,                   // callq    *0x78(%rbp)
+    0x49, 0x89, 0xc5,                   // movq     %rax, %r13
+    0x48, 0x89, 0x55, 0xe0,             // movq     %rdx, -0x20(%rbp)
+};
+
+static const uint8_t buffered_epilogue[] = {
+    /* Restore %r13 (after flush_output). */
+    0x4c, 0x8b, 0x6d, 0xe8,             // movq     -0x18(%rbp), %r13
+    0x48, 0x83, 0xc4, 0x10,             // addq     $0x10, %rsp
+};
+
+static const uint8_t load_output[] = {
+    /* %eax = *(p + offset) */
+    0x0f, 0xb6, 0x83, PLACEHOLDER_32,   // movzbl   offset(%rbx), %eax
+};
+
+static const uint8_t buffer_output[] = {
+    /* *cursor++ = %al, then flush_output if it reached the limit. */
+    0x41, 0x88, 0x45, 0x00,             // movb     %al, 0x0(%r13)
+    0x49, 0xff, 0xc5,                   // incq     %r13
+    0x4c, 0x3b, 0x6d, 0xe0,             // cmpq     -0x20(%rbp), %r13
+    0x72, sizeof(flush_output),         // jb       1f
+    /* (flush_output follows) */
+};
+
+/*
+ * With buffer_input, %r14 is the input cursor and %r15 the limit of what has
+ * been read; their caller's values are saved at -0x28(%rbp) and -0x30(%rbp),
+ * past the slots used with buffer_output, which are reserved regardless.
+ */
+static const uint8_t input_prologue[] = {
+    0x48, 0x83, 0xec, 0x20,             // subq     $0x20, %rsp
+    0x4c, 0x89, 0x75, 0xd8,             // movq     %r14, -0x28(%rbp)
+    0x4c, 0x89, 0x7d, 0xd0,             // movq     %r15, -0x30(%rbp)
+    /* Start out with nothing read. */
+    0x4c, 0x8b, 0xb5, 0x80, 0x00, 0x00, 0x00,
+                                        // movq     0x80(%rbp), %r14
+    0x4d, 0x89, 0xf7,                   // movq     %r14, %r15
+};
+
+static const uint8_t input_epilogue[] = {
+    0x4c, 0x8b, 0x75, 0xd8,             // movq     -0x28(%rbp), %r14
+    0x4c, 0x8b, 0x7d, 0xd0,             // movq     -0x30(%rbp), %r15
+    0x48, 0x83, 0xc4, 0x20,             // addq     $0x20, %rsp
+};
+
+static const uint8_t input_available[] = {
+    /* Is there anything left to read? */
+    0x4d, 0x39, 0xfe,                   // cmpq     %r15, %r14
+    0x72, 0xff,                         // jb       read_input
+    /* (flush_output, with buffer_output, then fill_input follow) */
+};
+
+static const uint8_t read_input[] = {
+    /* read_input: %al = *cursor++ */
+    0x41, 0x8a, 0x06,                   // movb     (%r14), %al
+    0x49, 0xff, 0xc6,                   // incq     %r14
+    /* (the input is stored next) */
+};
+
+static const uint8_t fill_input[] = {
+    /* limit = fill_input(input_start, input_end); cursor = input_start */
+    0x48, 0x8b, 0xbd, 0x80, 0x00, 0x00, 0x00,
+                                        // movq     0x80(%rbp), %rdi
+    0x48, 0x8b, 0xb5, 0x88, 0x00, 0x00, 0x00,
+                                        // movq     0x88(%rbp), %rsi
+    0xff, 0x95, 0x90, 0x00, 0x00, 0x00, // callq    *0x90(%rbp)
+    0x49, 0x89, 0xc7,                   // movq     %rax, %r15
+    0x4c, 0x8b, 0xb5, 0x80, 0x00, 0x00, 0x00,
+                                        // movq     0x80(%rbp), %r14
+    /* Nothing was read at end-of-file: the input is 0xFF. */
+    0xb0, 0xff,                         // movb     $0xff, %al
+    0x4d, 0x39, 0xfe,                   // cmpq     %r15, %r14
+    0x73, sizeof(read_input),           // jae      (past read_input)
+    /* (read_input follows) */
+};
+
+/*
+ * Before the input of a filter loop: skip the copy unless the loop's scratch
+ * cells are all 0 (and, with bounds checks, on the tape), or else call
+ * copy_input() with a table that was jumped over.
+ */
+static const uint8_t scratch_in_bounds[] = {
+    0x48, 0x8d, 0x83, PLACEHOLDER_32,   // leaq     low(%rbx), %rax
+    0x48, 0x3b, 0x45, 0x48,             // cmpq     0x48(%rbp), %rax
+    0x0f, 0x82, PLACEHOLDER_32,         // jb       [skip]
+    0x48, 0x8d, 0x83, PLACEHOLDER_32,   // leaq     high(%rbx), %rax
+    0x48, 0x3b, 0x45, 0x50,             // cmpq     0x50(%rbp), %rax
+    0x0f, 0x83, PLACEHOLDER_32,         // jae      [skip]
+};
+
+static const uint8_t scratch_is_zero[] = {
+    0x80, 0xbb, PLACEHOLDER_32, 0x00,   // cmpb     $0x0, offset(%rbx)
+    0x0f, 0x85, PLACEHOLDER_32,         // jne      [skip]
+};
+
+static const uint8_t wrapped_scratch_is_zero[] = {
+    0x41, 0x80, 0x3c, 0x0c, 0x00,       // cmpb     $0x0, (%r12,%rcx)
+    0x0f, 0x85, PLACEHOLDER_32,         // jne      [skip]
+};
+
+static const uint8_t skip_table[] = {
+    0xe9, 0x00, 0x01, 0x00, 0x00,       // jmp      (past 256 bytes)
+};
+
+static const uint8_t copy_input[] = {
+    /* copy_input(&(struct bf_buffered_io) { cursors and limits }, until,
+     *            table, &context) */
+    0xff, 0x75, 0xe0,                   // pushq    -0x20(%rbp)
+    0x41, 0x55,                         // pushq    %r13
+    0x41, 0x57,                         // pushq    %r15
+    0x41, 0x56,                         // pushq    %r14
+    0x48, 0x89, 0xe7,                   // movq     %rsp, %rdi
+    0xbe, PLACEHOLDER_32,               // movl     $until, %esi
+    /* (the table follows) */
+};
+
+static const uint8_t copy_as_is[] = {
+    0x31, 0xd2,                         // xorl     %edx, %edx
+};
+
+static const uint8_t copy_through_table[] = {
+    0x48, 0x8d, 0x15, PLACEHOLDER_32,   // leaq     table(%rip), %rdx
+};
+
+static const uint8_t call_copy_input[] = {
+    0x48, 0x8d, 0x4d, 0x10,             // leaq     0x10(%rbp), %rcx
+    0xff, 0x95, 0x98, 0x00, 0x00, 0x00, // callq    *0x98(%rbp)
+    /* Carry on from wherever it left the buffers. */
+    0x41, 0x5e,                         // popq     %r14
+    0x41, 0x5f,                         // popq     %r15
+    0x41, 0x5d,                         // popq     %r13
+    0x8f, 0x45, 0xe0,                   // popq     -0x20(%rbp)
+};
+
+/*
+ * With coalesce_output, a run of output known in advance is stored straight
+ * to the buffer, a word at a time, if it fits before the limit, and written
+ * by write_output() if it does not.
+ */
+static const uint8_t output_fits[] = {
+    0x49, 0x8d, 0x95, PLACEHOLDER_32,   // leaq     length(%r13), %rdx
+    0x48, 0x3b, 0x55, 0xe0,             // cmpq     -0x20(%rbp), %rdx
+    0x0f, 0x83, PLACEHOLDER_32,         // jae      [write_output]
+};
+
+static const uint8_t repeat_byte[] = {
+    /* %rax = %al, in every byte */
+    0x48, 0xba, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+                                        // movabsq  $0x0101010101010101, %rdx
+    0x48, 0x0f, 0xaf, 0xc2,             // imulq    %rdx, %rax
+};
+
+static const uint8_t load_bytes_8[] = {
+    0x48, 0x8b, 0x05, PLACEHOLDER_32,   // movq     bytes(%rip), %rax
+};
+
+static const uint8_t load_bytes_4[] = {
+    0x8b, 0x05, PLACEHOLDER_32,         // movl     bytes(%rip), %eax
+};
+
+static const uint8_t load_bytes_2[] = {
+    0x0f, 0xb7, 0x05, PLACEHOLDER_32,   // movzwl   bytes(%rip), %eax
+};
+
+static const uint8_t store_output_8[] = {
+    0x49, 0x89, 0x85, PLACEHOLDER_32,   // movq     %rax, offset(%r13)
+};
+
+static const uint8_t store_output_4[] = {
+    0x41, 0x89, 0x85, PLACEHOLDER_32,   // movl     %eax, offset(%r13)
+};
+
+static const uint8_t store_output_2[] = {
+    0x66, 0x41, 0x89, 0x85, PLACEHOLDER_32,
+                                        // movw     %ax, offset(%r13)
+};
+
+static const uint8_t advance_output[] = {
+    0x49, 0x81, 0xc5, PLACEHOLDER_32,   // addq     $length, %r13
+    0xe9, PLACEHOLDER_32,               // jmp      [past write_output]
+};
+
+static const uint8_t write_output[] = {
+    /* write_output(&(struct bf_output_space) { cursor, limit }, bytes,
+     *              length, repeat, &context) */
+    0xff, 0x75, 0xe0,                   // pushq    -0x20(%rbp)
+    0x41, 0x55,                         // pushq    %r13
+    0x48, 0x89, 0xe7,                   // movq     %rsp, %rdi
+    /* (the bytes follow) */
+};
+
+static const uint8_t write_bytes[] = {
+    0x48, 0x8d, 0x35, PLACEHOLDER_32,   // leaq     bytes(%rip), %rsi
+    0x31, 0xc9,                         // xorl     %ecx, %ecx
+    /* (the call follows) */
+};
+
+static const uint8_t write_repeated_byte[] = {
+    /* The byte (in %al) is kept on the stack, which stays aligned. */
+    0x50,                               // pushq    %rax
+    0x50,                               // pushq    %rax
+    0x48, 0x89, 0xe6,                   // movq     %rsp, %rsi
+    0xb9, 0x01, 0x00, 0x00, 0x00,       // movl     $1, %ecx
+    /* (the call follows) */
+};
+
+static const uint8_t call_write_output[] = {
+    0xba, PLACEHOLDER_32,               // movl     $length, %edx
+    0x4c, 0x8d, 0x45, 0x10,             // leaq     0x10(%rbp), %r8
+    0xff, 0x95, 0xa0, 0x00, 0x00, 0x00, // callq    *0xa0(%rbp)
+    /* (the byte is popped off the stack next, if it was pushed) */
+};
+
+static const uint8_t drop_repeated_byte[] = {
+    0x48, 0x83, 0xc4, 0x10,             // addq     $0x10, %rsp
+};
+
+static const uint8_t wrote_output[] = {
+    /* Carry on from wherever it left the buffer. */
+    0x41, 0x5d,                         // popq     %r13
+    0x8f, 0x45, 0xe0,                   // popq     -0x20(%rbp)
+};
+
+static const uint8_t jump[] = {
+    0xe9, PLACEHOLDER_32,               // jmp      [PLACEHOLDER]
+};
+
+static const uint8_t store_input[] = {
+    /* *(p + offset) = %al */
+    0x88, 0x83, PLACEHOLDER_32,         // movb     %al, offset(%rbx)
+};
+
+/*
+ * On a circular tape (wrap_mask is not 0), p is instead an index, always
+ * less than the tape size, in %rbx, and the base of the tape is in %r12.
+ * An access at an offset from p first materializes its index in %rcx.
+ */
+static const uint8_t wrapped_prologue[] = {
+    /* Save %r12, then make it the base, starting at index 0. */
+    0x4c, 0x89, 0x65, 0xf0,             // movq     %r12, -0x10(%rbp)
+    0x49, 0x89, 0xdc,                   // movq     %rbx, %r12
+    0x31, 0xdb,                         // xorl     %ebx, %ebx
+};
+
+static const uint8_t wrapped_epilogue[] = {
+    /* Restore %r12. */
+    0x4c, 0x8b, 0x65, 0xf0,             // movq     -0x10(%rbp), %r12
+};
+
+static const uint8_t wrapped_index[] = {
+    /* %rcx = (p + offset) & mask */
+    0x8d, 0x8b, PLACEHOLDER_32,         // leal     offset(%rbx), %ecx
+    0x81, 0xe1, PLACEHOLDER_32,         // andl     $mask, %ecx
+};
+
+static const uint8_t wrapped_index_here[] = {
+    /* %rcx = p */
+    0x89, 0xd9,                         // movl     %ebx, %ecx
+};
+
+static const uint8_t wrapped_increment_memory[] = {
+    0x41, 0xfe, 0x04, 0x0c,             // incb     (%r12,%rcx)
+};
+
+static const uint8_t wrapped_decrement_memory[] = {
+    0x41, 0xfe, 0x0c, 0x0c,             // decb     (%r12,%rcx)
+};
+
+static const uint8_t wrapped_add_memory[] = {
+    0x41, 0x80, 0x04, 0x0c, 0xff,       // addb     $value, (%r12,%rcx)
+};
+
+static const uint8_t wrapped_set_memory[] = {
+    0x41, 0xc6, 0x04, 0x0c, 0xff,       // movb     $value, (%r12,%rcx)
+};
+
+static const uint8_t wrapped_multiply[] = {
+    /* %eax = *p * value */
+    0x41, 0x0f, 0xb6, 0x04, 0x1c,       // movzbl   (%r12,%rbx), %eax
+    0x69, 0xc0, PLACEHOLDER_32,         // imull    $value, %eax, %eax
+};
+
+static const uint8_t wrapped_add_product[] = {
+    0x41, 0x00, 0x04, 0x0c,             // addb     %al, (%r12,%rcx)
+};
+
+static const uint8_t wrapped_move_data_pointer[] = {
+    /* p = (p + value) & mask */
+    0x81, 0xc3, PLACEHOLDER_32,         // addl     $value, %ebx
+    0x81, 0xe3, PLACEHOLDER_32,         // andl     $mask, %ebx
+};
+
+static const uint8_t wrapped_output_byte[] = {
+    0x41, 0x0f, 0xb6, 0x3c, 0x0c,       // movzbl   (%r12,%rcx), %edi
+    0x48, 0x8d, 0x45, 0x10,             // leaq     0x10(%rbp), %rax
+    0x48, 0x8b, 0x40, 0x08,             // movq     0x8(%rax), %rax
+    0xff, 0xd0,                         // callq    *%rax
+};
+
+static const uint8_t wrapped_load_output[] = {
+    0x41, 0x0f, 0xb6, 0x04, 0x0c,       // movzbl   (%r12,%rcx), %eax
+};
+
+static const uint8_t wrapped_input_byte[] = {
+    0x48, 0x8d, 0x4d, 0x10,             // leaq     0x10(%rbp), %rcx
+    0xff, 0x51, 0x10,                   // callq    *0x10(%rcx)
+};
+
+static const uint8_t wrapped_store_input[] = {
+    0x41, 0x88, 0x04, 0x0c,             // movb     %al, (%r12,%rcx)
+};
+
+static const uint8_t wrapped_loop_top[] = {
+    0x41, 0x80, 0x3c, 0x1c, 0x00,       // cmpb     $0x0, (%r12,%rbx)
+    0x0f, 0x84, PLACEHOLDER_32,         // je       [PLACEHOLDER]
+};
+
+static const uint8_t wrapped_loop_bottom[] = {
+    0x41, 0x80, 0x3c, 0x1c, 0x00,       // cmpb     $0x0, (%r12,%rbx)
+    0x0f, 0x85, PLACEHOLDER_32,         // jne      [PLACEHOLDER]
+};
+
+/* Recommended multi-byte NOPs, indexed by length. */
+static const uint8_t nops[][HOT_LOOP_ALIGNMENT / 2] = {
+    [1] = { 0x90 },
+    [2] = { 0x66, 0x90 },
+    [3] = { 0x0f, 0x1f, 0x00 },
+    [4] = { 0x0f, 0x1f, 0x40, 0x00 },
+    [5] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+    [6] = { 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+    [7] = { 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 },
+    [8] = { 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
 };
 
 /**
@@ -129,18 +610,6 @@ static const uint8_t loop_bottom[] = {
         i += sizeof(snippet);                        \
     } while (0)
 
-static size_t start_loop(uint8_t *space, size_t i, struct loop_context *ctx) {
-    /* The instruction starts here.... */
-    ctx->loop_top_offset = i;
-    append_snippet(loop_top);
-
-    /* The address to overwrite is here... */
-    ctx->placeholder_address_offset = i - sizeof(int32_t);
-    ctx->loop_body_offset = i;
-
-    return i;
-}
-
 static void patch_with(uint8_t* location, int32_t amount) {
     /* Ensure that the patch location is filled with the placeholder. */
     for (size_t i = 0; i < sizeof(int32_t); i++) {
@@ -151,29 +620,632 @@ static void patch_with(uint8_t* location, int32_t amount) {
     memcpy(location, &amount, sizeof(int32_t));
 }
 
+static void patch_byte(uint8_t* location, uint8_t value) {
+    assert(*location == 0xFF);
+    *location = value;
+}
+
 /* This is wrapped as a function to do type casting... */
 static int32_t calc_offset(long from, long to) {
     return to - from;
 }
 
+static size_t start_loop(uint8_t *space, size_t i, struct loop_context *ctx) {
+    /* The instruction starts here.... */
+    ctx->loop_top_offset = i;
+    if (ctx->wrapped) {
+        append_snippet(wrapped_loop_top);
+    } else {
+        append_snippet(loop_top);
+    }
+
+    /* The address to overwrite is here... */
+    ctx->placeholder_address_offset = i - sizeof(int32_t);
+
+    /* Consult the cache once we know the loop will run. */
+    if (ctx->memoized) {
+        size_t at = i;
+        append_snippet(memo_enter);
+        patch_with(space + at + 5, ctx->memo_number);
+        ctx->memo_hit_offset = i - sizeof(int32_t);
+    }
+
+    ctx->loop_body_offset = i;
+
+    return i;
+}
+
 static size_t end_loop(uint8_t *space, size_t i, struct loop_context *ctx) {
     assert(i > ctx->loop_top_offset);
 
     /* Write snippet such that i is pointing to the NEXT instruction. */
-    append_snippet(loop_bottom);
-
-    /* Patch the top of the loop. */
-    patch_with(space + ctx->placeholder_address_offset,
-            calc_offset(ctx->loop_body_offset, i));
+    if (ctx->wrapped) {
+        append_snippet(wrapped_loop_bottom);
+    } else {
+        append_snippet(loop_bottom);
+    }
 
-    /* Patch the bottom of the loop. */
+    /* Patch the bottom of the loop to go back to the body. */
     uint8_t *loop_bottom_addr = space + (i - sizeof(int32_t));
     patch_with(loop_bottom_addr,
-            calc_offset(i, ctx->loop_top_offset));
+            calc_offset(i, ctx->loop_body_offset));
+
+    /* Record the result of a loop that actually ran. */
+    if (ctx->memoized) {
+        size_t at = i;
+        append_snippet(memo_leave);
+        patch_with(space + at + 5, ctx->memo_number);
+        patch_with(space + ctx->memo_hit_offset,
+                calc_offset(ctx->memo_hit_offset + sizeof(int32_t), i));
+    }
+
+    /* Patch the top of the loop to skip past the bottom. */
+    patch_with(space + ctx->placeholder_address_offset,
+            calc_offset(ctx->placeholder_address_offset + sizeof(int32_t), i));
+
+    /* As do the tests between copies of an unrolled body. */
+    for (size_t exit = 0; exit < ctx->exit_count; exit++) {
+        patch_with(space + ctx->exits[exit],
+                calc_offset(ctx->exits[exit] + sizeof(int32_t), i));
+    }
 
     return i;
 }
 
+/* Leaves the loop if *p is 0, before the next copy of an unrolled body. */
+static size_t next_copy(uint8_t *space, size_t i, struct loop_context *ctx) {
+    assert(ctx->exit_count < UNROLL_FACTOR - 1);
+
+    /* The test is the same as at the top of the loop. */
+    if (ctx->wrapped) {
+        append_snippet(wrapped_loop_top);
+    } else {
+        append_snippet(loop_top);
+    }
+    ctx->exits[ctx->exit_count++] = i - sizeof(int32_t);
+    ctx->copies--;
+
+    return i;
+}
+
+/* Writes the machine code for a single non-loop operation. */
+static size_t emit_op(uint8_t *space, size_t i, const struct bf_ir_op *op) {
+    size_t at;
+
+    switch (op->kind) {
+        case BF_IR_ADD:
+            if (op->offset == 0 && op->value == 0x01) {
+                append_snippet(increment_memory);
+            } else if (op->offset == 0 && op->value == 0xFF) {
+                append_snippet(decrement_memory);
+            } else {
+                at = i;
+                append_snippet(add_memory);
+                patch_with(space + at + 2, op->offset);
+                patch_byte(space + at + 6, op->value);
+            }
+            break;
+
+        case BF_IR_SET:
+            at = i;
+            append_snippet(set_memory);
+            patch_with(space + at + 2, op->offset);
+            patch_byte(space + at + 6, op->value);
+            break;
+
+        case BF_IR_MUL:
+            at = i;
+            append_snippet(multiply_memory);
+            patch_with(space + at + 5, op->value);
+            patch_with(space + at + 11, op->offset);
+            break;
+
+        case BF_IR_MOVE:
+            if (op->value == 1) {
+                append_snippet(increment_data_pointer);
+            } else if (op->value == -1) {
+                append_snippet(decrement_data_pointer);
+            } else {
+                at = i;
+                append_snippet(move_data_pointer);
+                patch_with(space + at + 3, op->value);
+            }
+            break;
+
+        case BF_IR_OUTPUT:
+            at = i;
+            append_snippet(output_byte);
+            patch_with(space + at + 3, op->offset);
+            break;
+
+        case BF_IR_INPUT:
+            at = i;
+            append_snippet(input_byte);
+            patch_with(space + at + 9, op->offset);
+            break;
+
+        default:
+            assert(0 && "loops are emitted by start_loop()/end_loop()");
+    }
+
+    return i;
+}
+
+/* Puts the index of the cell at the offset from p in %rcx. */
+static size_t emit_wrapped_index(uint8_t *space, size_t i, int32_t offset,
+        uint32_t mask) {
+    size_t at = i;
+
+    if (offset == 0) {
+        append_snippet(wrapped_index_here);
+    } else {
+        append_snippet(wrapped_index);
+        patch_with(space + at + 2, offset);
+        patch_with(space + at + 8, mask);
+    }
+
+    return i;
+}
+
+/* Like emit_op(), but for a circular tape. */
+static size_t emit_wrapped_op(uint8_t *space, size_t i,
+        const struct bf_ir_op *op, uint32_t mask) {
+    size_t at;
+
+    switch (op->kind) {
+        case BF_IR_ADD:
+            i = emit_wrapped_index(space, i, op->offset, mask);
+            if (op->value == 0x01) {
+                append_snippet(wrapped_increment_memory);
+            } else if (op->value == 0xFF) {
+                append_snippet(wrapped_decrement_memory);
+            } else {
+                at = i;
+                append_snippet(wrapped_add_memory);
+                patch_byte(space + at + 4, op->value);
+            }
+            break;
+
+        case BF_IR_SET:
+            i = emit_wrapped_index(space, i, op->offset, mask);
+            at = i;
+            append_snippet(wrapped_set_memory);
+            patch_byte(space + at + 4, op->value);
+            break;
+
+        case BF_IR_MUL:
+            at = i;
+            append_snippet(wrapped_multiply);
+            patch_with(space + at + 7, op->value);
+            i = emit_wrapped_index(space, i, op->offset, mask);
+            append_snippet(wrapped_add_product);
+            break;
+
+        case BF_IR_MOVE:
+            at = i;
+            append_snippet(wrapped_move_data_pointer);
+            patch_with(space + at + 2, op->value);
+            patch_with(space + at + 8, mask);
+            break;
+
+        case BF_IR_OUTPUT:
+            i = emit_wrapped_index(space, i, op->offset, mask);
+            append_snippet(wrapped_output_byte);
+            break;
+
+        case BF_IR_INPUT:
+            /* The call clobbers %rcx, so find the cell afterwards. */
+            append_snippet(wrapped_input_byte);
+            i = emit_wrapped_index(space, i, op->offset, mask);
+            append_snippet(wrapped_store_input);
+            break;
+
+        default:
+            assert(0 && "loops are emitted by start_loop()/end_loop()");
+    }
+
+    return i;
+}
+
+/* Reads a byte of input into %al from the buffer, filling it if need be. */
+static size_t emit_buffered_input(uint8_t *space, size_t i,
+        const struct bf_ir_op *op, const bf_codegen_options *options) {
+    size_t at = i;
+
+    append_snippet(input_available);
+    if (options->buffer_output) {
+        /* Whatever is asked for may depend on what was printed. */
+        append_snippet(flush_output);
+    }
+    append_snippet(fill_input);
+    patch_byte(space + at + 4, i - (at + sizeof(input_available)));
+    append_snippet(read_input);
+
+    if (options->wrap_mask != 0) {
+        i = emit_wrapped_index(space, i, op->offset, options->wrap_mask);
+        append_snippet(wrapped_store_input);
+    } else {
+        at = i;
+        append_snippet(store_input);
+        patch_with(space + at + 2, op->offset);
+    }
+
+    return i;
+}
+
+/* Loads the cell the output operation outputs into %eax. */
+static size_t emit_load_output(uint8_t *space, size_t i,
+        const struct bf_ir_op *op, uint32_t mask) {
+    size_t at = i;
+
+    if (mask != 0) {
+        i = emit_wrapped_index(space, i, op->offset, mask);
+        append_snippet(wrapped_load_output);
+    } else {
+        append_snippet(load_output);
+        patch_with(space + at + 3, op->offset);
+    }
+
+    return i;
+}
+
+/* Like emit_op() and emit_wrapped_op(), but for buffered output. */
+static size_t emit_buffered_io(uint8_t *space, size_t i,
+        const struct bf_ir_op *op, uint32_t mask) {
+    if (op->kind == BF_IR_OUTPUT) {
+        i = emit_load_output(space, i, op, mask);
+        append_snippet(buffer_output);
+        append_snippet(flush_output);
+        return i;
+    }
+
+    /* Whatever is asked for may depend on what was printed. */
+    append_snippet(flush_output);
+    if (mask != 0) {
+        return emit_wrapped_op(space, i, op, mask);
+    }
+    return emit_op(space, i, op);
+}
+
+/*
+ * Copies input to output all at once just before the input of a filter
+ * loop, if its scratch cells are clear; p is where it is for the input.
+ */
+static size_t emit_filter(uint8_t *space, size_t i,
+        const bf_ir_filter *filter, const struct bf_ir_op *input,
+        const bf_codegen_options *options) {
+    /* The jumps to past the copy, which skip it. */
+    size_t skips[MAX_FILTER_SCRATCH + 2];
+    size_t skip_count = 0, at = i, table = 0;
+
+    if (options->bounds_check && options->wrap_mask == 0) {
+        append_snippet(scratch_in_bounds);
+        patch_with(space + at + 3, filter->scratch_low);
+        patch_with(space + at + 20, filter->scratch_high);
+        skips[skip_count++] = at + 13;
+        skips[skip_count++] = at + 30;
+    }
+
+    for (int32_t cell = filter->scratch_low; cell <= filter->scratch_high;
+            cell++) {
+        if (cell == input->offset) {
+            continue;
+        }
+
+        if (options->wrap_mask != 0) {
+            i = emit_wrapped_index(space, i, cell, options->wrap_mask);
+            at = i;
+            append_snippet(wrapped_scratch_is_zero);
+            skips[skip_count++] = at + 7;
+        } else {
+            at = i;
+            append_snippet(scratch_is_zero);
+            patch_with(space + at + 2, cell);
+            skips[skip_count++] = at + 9;
+        }
+    }
+
+    if (!filter->identity) {
+        append_snippet(skip_table);
+        table = i;
+        memcpy(space + i, filter->table, sizeof(filter->table));
+        i += sizeof(filter->table);
+    }
+
+    at = i;
+    append_snippet(copy_input);
+    patch_with(space + at + 13, filter->until);
+
+    if (filter->identity) {
+        append_snippet(copy_as_is);
+    } else {
+        at = i;
+        append_snippet(copy_through_table);
+        patch_with(space + at + 3, calc_offset(i, table));
+    }
+    append_snippet(call_copy_input);
+
+    for (size_t skip = 0; skip < skip_count; skip++) {
+        patch_with(space + skips[skip],
+                calc_offset(skips[skip] + sizeof(int32_t), i));
+    }
+
+    return i;
+}
+
+/* Calls write_output() with the bytes, which are at the given offset. */
+static size_t emit_write_output(uint8_t *space, size_t i, size_t bytes,
+        uint32_t length, bool repeat) {
+    size_t at;
+
+    append_snippet(write_output);
+    if (repeat) {
+        append_snippet(write_repeated_byte);
+    } else {
+        at = i;
+        append_snippet(write_bytes);
+        patch_with(space + at + 3, calc_offset(at + 7, bytes));
+    }
+
+    at = i;
+    append_snippet(call_write_output);
+    patch_with(space + at + 1, length);
+    if (repeat) {
+        append_snippet(drop_repeated_byte);
+    }
+    append_snippet(wrote_output);
+    return i;
+}
+
+/*
+ * Writes a run of output all at once, starting at the output operation;
+ * bytes known in advance are kept in the code, past the stores.
+ */
+static size_t emit_output_run(uint8_t *space, size_t i,
+        const bf_ir_output_run *run, const struct bf_ir_op *op,
+        uint32_t mask) {
+    int32_t length = run->length;
+    int32_t width = length >= 8 ? 8 : length >= 4 ? 4 : 2;
+    /* The loads of the bytes, to be patched once they are placed. */
+    size_t loads[BF_IR_MAX_OUTPUT_RUN / 2 + 1];
+    int32_t loaded[BF_IR_MAX_OUTPUT_RUN / 2 + 1];
+    size_t words = 0, at, too_long, done, bytes;
+
+    if (run->repeat) {
+        i = emit_load_output(space, i, op, mask);
+    }
+
+    at = i;
+    append_snippet(output_fits);
+    patch_with(space + at + 3, length);
+    too_long = at + 13;
+
+    if (run->repeat) {
+        append_snippet(repeat_byte);
+    }
+
+    /* A word at a time; the last one overlaps the one before, if need be. */
+    for (int32_t offset = 0; offset < length; offset += width) {
+        if (offset + width > length) {
+            offset = length - width;
+        }
+
+        if (!run->repeat) {
+            if (width == 8) {
+                append_snippet(load_bytes_8);
+            } else if (width == 4) {
+                append_snippet(load_bytes_4);
+            } else {
+                append_snippet(load_bytes_2);
+            }
+            loads[words] = i - sizeof(int32_t);
+            loaded[words++] = offset;
+        }
+
+        if (width == 8) {
+            append_snippet(store_output_8);
+        } else if (width == 4) {
+            append_snippet(store_output_4);
+        } else {
+            append_snippet(store_output_2);
+        }
+        patch_with(space + i - sizeof(int32_t), offset);
+    }
+
+    at = i;
+    append_snippet(advance_output);
+    patch_with(space + at + 3, length);
+    done = at + 8;
+
+    bytes = i;
+    if (!run->repeat) {
+        memcpy(space + i, run->bytes, length);
+        i += length;
+        for (size_t word = 0; word < words; word++) {
+            patch_with(space + loads[word], calc_offset(
+                        loads[word] + sizeof(int32_t), bytes + loaded[word]));
+        }
+    }
+
+    patch_with(space + too_long,
+            calc_offset(too_long + sizeof(int32_t), i));
+    i = emit_write_output(space, i, bytes, length, run->repeat);
+    patch_with(space + done, calc_offset(done + sizeof(int32_t), i));
+    return i;
+}
+
+/*
+ * Starts the program where its opening, run at compile time, left off: the
+ * output is written, the cells are set and p is moved, and then it jumps to
+ * where it carries on, which is patched in at *resume_jump.
+ */
+static size_t emit_opening(uint8_t *space, size_t i,
+        const bf_ir_opening *opening, uint32_t mask, size_t *resume_jump) {
+    size_t at, bytes;
+
+    if (opening->length > 0) {
+        at = i;
+        append_snippet(jump);
+        bytes = i;
+        memcpy(space + i, opening->output, opening->length);
+        i += opening->length;
+        patch_with(space + at + 1, calc_offset(at + 5, i));
+
+        i = emit_write_output(space, i, bytes, opening->length, false);
+    }
+
+    for (int32_t cell = 0; cell < BF_IR_OPENING_CELLS; cell++) {
+        struct bf_ir_op set = {
+            .kind = BF_IR_SET,
+            .offset = cell - BF_IR_OPENING_CELLS / 2,
+            .value = opening->cells[cell],
+        };
+
+        if (set.value == 0) {
+            continue;
+        }
+        i = mask != 0 ? emit_wrapped_op(space, i, &set, mask)
+                      : emit_op(space, i, &set);
+    }
+
+    if (opening->p != 0) {
+        struct bf_ir_op move = { .kind = BF_IR_MOVE, .value = opening->p };
+        i = mask != 0 ? emit_wrapped_op(space, i, &move, mask)
+                      : emit_op(space, i, &move);
+    }
+
+    append_snippet(jump);
+    *resume_jump = i - sizeof(int32_t);
+    return i;
+}
+
+static size_t emit_bounds_check(uint8_t *space, size_t i,
+        const struct bf_ir_op *op) {
+    size_t at = i;
+    append_snippet(check_bounds);
+    patch_with(space + at + 3, op->check_low);
+    patch_with(space + at + 16, op->check_high);
+    patch_with(space + at + 30, op->source_offset);
+    return i;
+}
+
+static size_t emit_dirty_tracking(uint8_t *space, size_t i,
+        const struct bf_ir_op *op) {
+    size_t at = i;
+    append_snippet(track_dirty);
+    patch_with(space + at + 7, op->check_low);
+    patch_with(space + at + 22, op->check_high + 1);
+    return i;
+}
+
+static size_t emit_loop_counter(uint8_t *space, size_t i, size_t counter) {
+    size_t at = i;
+    append_snippet(count_loop);
+    patch_with(space + at + 7, counter * sizeof(uint64_t));
+    return i;
+}
+
+/*
+ * Pads with NOPs so that the body of the loop starting at i, after a header
+ * of the given size, is aligned.
+ */
+static size_t align_loop_body(uint8_t *space, size_t i, size_t header) {
+    size_t padding = (HOT_LOOP_ALIGNMENT
+            - (i + header) % HOT_LOOP_ALIGNMENT) % HOT_LOOP_ALIGNMENT;
+
+    while (padding > 0) {
+        size_t length = padding > 8 ? 8 : padding;
+        memcpy(space + i, nops[length], length);
+        i += length;
+        padding -= length;
+    }
+
+    return i;
+}
+
+static bool is_hot_loop(const struct bf_ir_op *op) {
+    return op->iterations >= HOT_LOOP_ITERATIONS;
+}
+
+/*
+ * Should the body of the loop starting at ir->ops[loop] be unrolled? Only
+ * hot loops that go around many times each time they are entered are worth
+ * the space, and only short bodies of arithmetic and moves, which are
+ * written the same way every time, are unrolled.
+ */
+static bool should_unroll(const bf_ir *ir, size_t loop,
+        const bf_codegen_options *options) {
+    const struct bf_ir_op *op = &ir->ops[loop];
+
+    /* Counts are kept at the top of the body, which the copies lack. */
+    if (options->count_loops || op->memoize || !is_hot_loop(op)
+            || op->entries == 0
+            || op->iterations / op->entries < UNROLL_TRIP_COUNT
+            || op->match - loop - 1 > MAX_UNROLLED_BODY) {
+        return false;
+    }
+
+    for (size_t i = loop + 1; i < op->match; i++) {
+        switch (ir->ops[i].kind) {
+            case BF_IR_ADD:
+            case BF_IR_MOVE:
+            case BF_IR_SET:
+            case BF_IR_MUL:
+                break;
+            default:
+                return false;
+        }
+    }
+
+    return true;
+}
+
+static void record_source(bf_source_map *map, size_t code_offset,
+        size_t source_offset) {
+    if (map->length == map->capacity) {
+        map->capacity = map->capacity == 0 ? 256 : 2 * map->capacity;
+        map->code_offsets = realloc(map->code_offsets,
+                map->capacity * sizeof(size_t));
+        map->source_offsets = realloc(map->source_offsets,
+                map->capacity * sizeof(size_t));
+        if (map->code_offsets == NULL || map->source_offsets == NULL) {
+            abort();
+        }
+    }
+
+    map->code_offsets[map->length] = code_offset;
+    map->source_offsets[map->length] = source_offset;
+    map->length++;
+}
+
+bool bf_source_map_lookup(const bf_source_map *map, size_t code_offset,
+        size_t *source_offset) {
+    size_t low = 0, high = map->length;
+
+    /* Find the last entry that starts at or before the code offset. */
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (map->code_offsets[middle] <= code_offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    if (low == 0) {
+        return false;
+    }
+
+    *source_offset = map->source_offsets[low - 1];
+    return true;
+}
+
+void bf_source_map_free(bf_source_map *map) {
+    free(map->code_offsets);
+    free(map->source_offsets);
+    *map = (bf_source_map) { 0 };
+}
+
 static bf_compile_result error_status(enum bf_compile_status status) {
     return (bf_compile_result) {
         .status = status,
@@ -195,98 +1267,274 @@ bf_compile_result bf_compile(const char *source) {
 }
 
 bf_compile_result bf_compile_realloc(const char *source, bf_program_text * restrict text) {
+    bf_ir ir;
+
+    if (!bf_ir_parse(source, &ir)) {
+        bf_compile_result result = error_status(BF_COMPILE_UNMATCHED_BRACKET);
+        result.err_line = ir.err_line;
+        result.err_col = ir.err_col;
+        bf_ir_free(&ir);
+        return result;
+    }
+
+    bf_ir_optimize(&ir);
+
+    bf_compile_result result = bf_compile_ir(&ir, text, NULL);
+    bf_ir_free(&ir);
+    return result;
+}
+
+/*
+ * Resizes if we're getting too big: moves the code to a space four times as
+ * big until at least half of it is left free after room more bytes.
+ *
+ * @return where code is written now.
+ */
+static uint8_t *make_room(bf_program_text *text, uint8_t *space, size_t i,
+        size_t room) {
+    while (text->should_resize && i + room >= text->allocated_space / 2) {
+        size_t new_capacity = 4 * text->allocated_space;
+        uint8_t *new_space = allocate_executable_space(new_capacity);
+        if (new_space == NULL) {
+            abort();
+        }
+
+        memcpy(bf_writable_code(new_space), space, i);
+        free_executable_space(text->space, text->allocated_space);
+
+        text->space = new_space;
+        space = bf_writable_code(new_space);
+        text->allocated_space = new_capacity;
+    }
+
+    return space;
+}
+
+bf_compile_result bf_compile_ir(const bf_ir *ir,
+        bf_program_text * restrict text,
+        const bf_codegen_options *options) {
+    static const bf_codegen_options default_options = { 0 };
     size_t i = 0;  // position in memory, relative to page start.
-    int current_loop = NOT_IN_LOOP;
-    struct loop_context contexts[MAX_NESTING_DEPTH];
-    const char *current_instruction = source;
-    uint8_t *space = text->space;
-    size_t half_capacity = text->allocated_space / 2;
+    size_t current_loop = 0;
+    size_t loop_number = 0;
+    /* The filter loop being compiled, if any, and where it reads input. */
+    bf_ir_filter filter;
+    size_t filter_input = SIZE_MAX;
+    /* The run of output made all at once, and where it ends. */
+    bf_ir_output_run run;
+    size_t output_end = 0;
+    /* Where the opening left off, and the jump there. */
+    size_t resume = 0, resume_jump = 0;
+    uint32_t memo_number = 0;
+    struct loop_context *contexts, *ctx;
+    /* Code is written here, to run at text->space. */
+    uint8_t *space = bf_writable_code(text->space);
 
     if (space == NULL) {
         size_t new_capacity = sysconf(_SC_PAGESIZE);
         uint8_t *new_space = allocate_executable_space(new_capacity);
-        space = text->space = new_space;
+        if (new_space == NULL) {
+            return error_status(BF_COMPILE_ERROR);
+        }
+
+        text->space = new_space;
+        space = bf_writable_code(new_space);
         text->allocated_space = new_capacity;
-        half_capacity = new_capacity / 2;
+    }
+
+    if (options == NULL) {
+        options = &default_options;
+    }
+
+    contexts = malloc((ir->max_depth + 1) * sizeof(struct loop_context));
+    if (contexts == NULL) {
+        return error_status(BF_COMPILE_ERROR);
     }
 
     append_snippet(function_prologue);
+    if (options->wrap_mask != 0) {
+        append_snippet(wrapped_prologue);
+    }
+    if (options->buffer_output) {
+        append_snippet(buffered_prologue);
+    }
+    if (options->buffer_input) {
+        append_snippet(input_prologue);
+    }
 
-    while (*current_instruction != '\0') {
+    /* Checks and counts cannot be jumped past; a tape too small to hold the
+     * opening would have it wrap around. */
+    if (options->blank_tape && options->coalesce_output
+            && options->buffer_output && !options->count_loops
+            && !options->bounds_check && (options->wrap_mask == 0
+                || options->wrap_mask >= BF_IR_OPENING_CELLS - 1)) {
+        bf_ir_opening opening;
 
-        /* Resize if we're getting too big. */
-        if (text->should_resize && i >= half_capacity) {
-            size_t new_capacity = 4 * text->allocated_space;
-            uint8_t *new_space = allocate_executable_space(new_capacity);
-            if (new_space == NULL) {
-                abort();
+        bf_ir_run_opening(ir, &opening);
+        if (opening.resume > 0) {
+            space = make_room(text, space, i, opening.length
+                    + BF_IR_OPENING_CELLS * (sizeof(wrapped_index)
+                        + sizeof(wrapped_set_memory)));
+            i = emit_opening(space, i, &opening, options->wrap_mask,
+                    &resume_jump);
+            resume = opening.resume;
+        }
+    }
+
+    for (size_t op = 0; op < ir->length; op++) {
+
+        space = make_room(text, space, i, 0);
+
+        /* Only into the first copy of an unrolled loop: the others reach
+         * the same op again. */
+        if (resume != 0 && op == resume) {
+            patch_with(space + resume_jump,
+                    calc_offset(resume_jump + sizeof(int32_t), i));
+            resume = 0;
+        }
+
+        if (options->source_map != NULL) {
+            record_source(options->source_map, i, ir->ops[op].source_offset);
+        }
+
+        /* A circular tape has no bounds, and p is not a pointer. */
+        if (options->wrap_mask == 0 && ir->ops[op].check) {
+            if (options->bounds_check) {
+                i = emit_bounds_check(space, i, &ir->ops[op]);
+            }
+            if (options->track_dirty) {
+                i = emit_dirty_tracking(space, i, &ir->ops[op]);
             }
+        }
 
-            memcpy(new_space, space, i);
-            free_executable_space(space, text->allocated_space);
+        /* Output is made all at once by the run it starts, if any; the
+         * opening never jumps into the middle of one. */
+        if (ir->ops[op].kind == BF_IR_OUTPUT && op < output_end) {
+            continue;
+        }
+        if (ir->ops[op].kind == BF_IR_OUTPUT && options->coalesce_output
+                && options->buffer_output
+                && bf_ir_find_output_run(ir, op, &run)
+                && !(op < resume && resume < run.end)) {
+            i = emit_output_run(space, i, &run, &ir->ops[op],
+                    options->wrap_mask);
+            output_end = run.end;
+            continue;
+        }
 
-            space = text->space = new_space;
-            text->allocated_space = new_capacity;
-            half_capacity = new_capacity / 2;
+        /* The first byte is filtered as usual, the rest all at once. */
+        if (op == filter_input) {
+            i = emit_filter(space, i, &filter, &ir->ops[op], options);
+            filter_input = SIZE_MAX;
         }
 
-        switch (*current_instruction) {
-            case '+':
-                append_snippet(increment_memory);
-                break;
-            case '-':
-                append_snippet(decrement_memory);
-                break;
-            case '<':
-                append_snippet(decrement_data_pointer);
-                break;
-            case '>':
-                append_snippet(increment_data_pointer);
-                break;
-            case '[':
-                current_loop++;
-                assert(current_loop >= 0);
+        switch (ir->ops[op].kind) {
+            case BF_IR_LOOP:
+                assert(current_loop < ir->max_depth);
+                ctx = &contexts[current_loop++];
+                ctx->wrapped = options->wrap_mask != 0;
+                /* Memoized windows could wrap around the tape. */
+                ctx->memoized = options->memoize && !ctx->wrapped
+                    && ir->ops[op].memoize;
+                if (ctx->memoized) {
+                    ctx->memo_number = memo_number++;
+                }
+                ctx->loop_op = op;
+                ctx->copies = should_unroll(ir, op, options)
+                    ? UNROLL_FACTOR - 1 : 0;
+                ctx->exit_count = 0;
 
-                /* Give up if the nesting depth is too deep. */
-                if (current_loop >= MAX_NESTING_DEPTH) {
-                    return error_status(BF_COMPILE_NESTING_TOO_DEEP);
+                if (options->count_loops) {
+                    i = emit_loop_counter(space, i, 2 * loop_number);
+                }
+                if (is_hot_loop(&ir->ops[op])) {
+                    i = align_loop_body(space, i,
+                            (ctx->wrapped ? sizeof(wrapped_loop_top)
+                                          : sizeof(loop_top))
+                            + (ctx->memoized ? sizeof(memo_enter) : 0));
                 }
 
-                i = start_loop(space, i, &contexts[current_loop]);
-                break;
+                i = start_loop(space, i, ctx);
 
-            case ']':
-                if (current_loop == NOT_IN_LOOP) {
-                    return error_status(BF_COMPILE_UNMATCHED_BRACKET);
+                if (options->count_loops) {
+                    i = emit_loop_counter(space, i, 2 * loop_number + 1);
                 }
+                loop_number++;
 
-                assert(current_loop >= 0 && current_loop < MAX_NESTING_DEPTH);
-                i = end_loop(space, i, &contexts[current_loop]);
-                current_loop--;
+                /* Profiles count every iteration, which the copy skips. */
+                if (options->copy_loops && !options->count_loops
+                        && options->buffer_input && options->buffer_output
+                        && bf_ir_filter_loop(ir, op, &filter)
+                        && filter.scratch_high - filter.scratch_low
+                            <= MAX_FILTER_SCRATCH) {
+                    filter_input = filter.input;
+                }
                 break;
 
-            case '.':
-                append_snippet(output_byte);
+            case BF_IR_END:
+                assert(current_loop > 0);
+                ctx = &contexts[current_loop - 1];
+
+                /* Write the body again, from the op after the loop's. */
+                if (ctx->copies > 0) {
+                    i = next_copy(space, i, ctx);
+                    op = ctx->loop_op;
+                    break;
+                }
+
+                i = end_loop(space, i, &contexts[--current_loop]);
                 break;
-            case ',':
-                append_snippet(input_byte);
+
+            case BF_IR_INPUT:
+                if (options->buffer_input) {
+                    i = emit_buffered_input(space, i, &ir->ops[op], options);
+                    break;
+                }
+                /* fallthrough */
+
+            case BF_IR_OUTPUT:
+                if (options->buffer_output) {
+                    i = emit_buffered_io(space, i, &ir->ops[op],
+                            options->wrap_mask);
+                    break;
+                }
+                /* fallthrough */
+
+            default:
+                if (options->wrap_mask != 0) {
+                    i = emit_wrapped_op(space, i, &ir->ops[op],
+                            options->wrap_mask);
+                } else {
+                    i = emit_op(space, i, &ir->ops[op]);
+                }
                 break;
         }
-
-        current_instruction++;
     }
 
-    append_snippet(function_epilogue);
+    /* The opening may have run the whole program. */
+    if (resume != 0 && resume == ir->length) {
+        patch_with(space + resume_jump,
+                calc_offset(resume_jump + sizeof(int32_t), i));
+    }
 
-    /* We have at least one dangling open bracket. */
-    if (current_loop != NOT_IN_LOOP) {
-        return error_status(BF_COMPILE_UNMATCHED_BRACKET);
+    if (options->buffer_input) {
+        append_snippet(input_epilogue);
     }
+    if (options->buffer_output) {
+        append_snippet(flush_output);
+        append_snippet(buffered_epilogue);
+    }
+    if (options->wrap_mask != 0) {
+        append_snippet(wrapped_epilogue);
+    }
+    append_snippet(function_epilogue);
+    free(contexts);
 
     return (bf_compile_result) {
         .status = BF_COMPILE_SUCCESS,
-        .program = (program_t) space,
-        .program_size = text->allocated_space
+        .program = (program_t) text->space,
+        .program_size = text->allocated_space,
+        .code_length = i
     };
 }
 
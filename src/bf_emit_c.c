@@ -0,0 +1,153 @@
+/* For fdopen(). */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <bf_emit.h>
+#include <bf_version.h>
+
+static const char c_prologue[] =
+    "/* Generated by brainmuk " BF_VERSION ". */\n"
+    "#include <stdint.h>\n"
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "\n"
+    "/* Returns the next byte of input; end-of-file is 0xFF. */\n"
+    "static uint8_t input(void) {\n"
+    "    int c = getchar();\n"
+    "    return c == EOF ? 0xFF : c;\n"
+    "}\n"
+    "\n"
+    "int main(void) {\n";
+
+static const char c_epilogue[] =
+    "    return 0;\n"
+    "}\n";
+
+static void indent(FILE *stream, size_t depth) {
+    for (size_t i = 0; i < depth; i++) {
+        fputs("    ", stream);
+    }
+}
+
+/* Prints "+= n" or "-= n", whichever is more natural for the cell value. */
+static void print_update(FILE *stream, int32_t value) {
+    if (value >= 0x80) {
+        fprintf(stream, "-= %d", 0x100 - value);
+    } else {
+        fprintf(stream, "+= %d", value);
+    }
+}
+
+bool bf_emit_c(const bf_ir *ir, size_t universe_size, FILE *stream) {
+    size_t depth = 1;
+
+    fputs(c_prologue, stream);
+    /* Like the JIT, start in the middle, so p may move either way. */
+    fprintf(stream,
+        "    uint8_t *universe = calloc(%zu, sizeof(uint8_t));\n"
+        "    if (universe == NULL) {\n"
+        "        perror(\"could not create universe\");\n"
+        "        return 1;\n"
+        "    }\n"
+        "    uint8_t *p = universe + %zu;\n"
+        "\n", 2 * universe_size, universe_size);
+
+    for (size_t i = 0; i < ir->length; i++) {
+        const struct bf_ir_op *op = &ir->ops[i];
+
+        if (op->kind == BF_IR_END) {
+            depth--;
+        }
+        indent(stream, depth);
+
+        switch (op->kind) {
+            case BF_IR_ADD:
+                fprintf(stream, "p[%d] ", op->offset);
+                print_update(stream, op->value);
+                fputs(";\n", stream);
+                break;
+            case BF_IR_SET:
+                fprintf(stream, "p[%d] = %d;\n", op->offset, op->value);
+                break;
+            case BF_IR_MUL:
+                fprintf(stream, "p[%d] %c= p[0] * %d;\n", op->offset,
+                        op->value >= 0x80 ? '-' : '+',
+                        op->value >= 0x80 ? 0x100 - op->value : op->value);
+                break;
+            case BF_IR_MOVE:
+                fprintf(stream, "p %c= %d;\n",
+                        op->value < 0 ? '-' : '+', abs(op->value));
+                break;
+            case BF_IR_OUTPUT:
+                fprintf(stream, "putchar(p[%d]);\n", op->offset);
+                break;
+            case BF_IR_INPUT:
+                fprintf(stream, "p[%d] = input();\n", op->offset);
+                break;
+            case BF_IR_LOOP:
+                fputs("while (p[0]) {\n", stream);
+                depth++;
+                break;
+            case BF_IR_END:
+                fputs("}\n", stream);
+                break;
+        }
+    }
+
+    fputs(c_epilogue, stream);
+
+    return !ferror(stream);
+}
+
+bool bf_emit_executable(const bf_ir *ir, size_t universe_size,
+        const char *output_filename) {
+    const char *cc = getenv("CC");
+    int source_pipe[2];
+    int status;
+
+    if (cc == NULL || *cc == '\0') {
+        cc = "cc";
+    }
+
+    if (pipe(source_pipe) < 0) {
+        return false;
+    }
+
+    pid_t child = fork();
+    if (child < 0) {
+        close(source_pipe[0]);
+        close(source_pipe[1]);
+        return false;
+    }
+
+    /* The child becomes the C compiler, reading source from the pipe. */
+    if (child == 0) {
+        dup2(source_pipe[0], STDIN_FILENO);
+        close(source_pipe[0]);
+        close(source_pipe[1]);
+        execlp(cc, cc, "-O2", "-x", "c", "-o", output_filename, "-",
+                (char *) NULL);
+        perror(cc);
+        _exit(127);
+    }
+
+    close(source_pipe[0]);
+    FILE *stream = fdopen(source_pipe[1], "w");
+    if (stream == NULL) {
+        close(source_pipe[1]);
+        waitpid(child, &status, 0);
+        return false;
+    }
+
+    bool written = bf_emit_c(ir, universe_size, stream);
+    written = (fclose(stream) == 0) && written;
+
+    if (waitpid(child, &status, 0) < 0) {
+        return false;
+    }
+
+    return written && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
@@ -0,0 +1,256 @@
+#include <ctype.h>
+#include <elf.h>
+#include <string.h>
+
+#include <bf_compile.h>
+#include <bf_emit.h>
+#include <bf_version.h>
+
+/* Section indices in the emitted object. */
+enum {
+    SECTION_NULL = 0,
+    SECTION_TEXT,
+    SECTION_SYMTAB,
+    SECTION_STRTAB,
+    SECTION_SHSTRTAB,
+    SECTION_NOTE_GNU_STACK,
+    SECTION_COUNT
+};
+
+/* Section names, concatenated. The offsets below index into this. */
+static const char section_names[] =
+    "\0.text\0.symtab\0.strtab\0.shstrtab\0.note.GNU-stack";
+#define NAME_TEXT               1
+#define NAME_SYMTAB             7
+#define NAME_STRTAB             15
+#define NAME_SHSTRTAB           23
+#define NAME_NOTE_GNU_STACK     33
+
+#define TEXT_ALIGNMENT          16
+
+static size_t align_to(size_t offset, size_t alignment) {
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+/* Writes zeros until the stream is at the given offset. */
+static void pad_to(FILE *stream, size_t *position, size_t offset) {
+    while (*position < offset) {
+        fputc(0, stream);
+        (*position)++;
+    }
+}
+
+static void write_at(FILE *stream, size_t *position, const void *data,
+        size_t size) {
+    fwrite(data, 1, size, stream);
+    *position += size;
+}
+
+/*
+ * Layout of the object:
+ *
+ *   ELF header
+ *   .text       the program; it is position-independent, so it needs no
+ *               relocations
+ *   .symtab     null symbol, .text section symbol, the global function
+ *   .strtab     the function's name
+ *   .shstrtab   section names
+ *   section headers
+ */
+bool bf_emit_object(const uint8_t *code, size_t length, const char *symbol,
+        FILE *stream) {
+    size_t symbol_length = strlen(symbol);
+    size_t position = 0;
+
+    size_t text_offset = align_to(sizeof(Elf64_Ehdr), TEXT_ALIGNMENT);
+    size_t symtab_offset = align_to(text_offset + length, 8);
+    size_t symtab_size = 3 * sizeof(Elf64_Sym);
+    size_t strtab_offset = symtab_offset + symtab_size;
+    size_t strtab_size = symbol_length + 2;
+    size_t shstrtab_offset = strtab_offset + strtab_size;
+    size_t section_headers_offset =
+        align_to(shstrtab_offset + sizeof(section_names), 8);
+
+    Elf64_Ehdr header = {
+        .e_ident = {
+            ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3,
+            ELFCLASS64, ELFDATA2LSB, EV_CURRENT, ELFOSABI_SYSV,
+        },
+        .e_type = ET_REL,
+        .e_machine = EM_X86_64,
+        .e_version = EV_CURRENT,
+        .e_shoff = section_headers_offset,
+        .e_ehsize = sizeof(Elf64_Ehdr),
+        .e_shentsize = sizeof(Elf64_Shdr),
+        .e_shnum = SECTION_COUNT,
+        .e_shstrndx = SECTION_SHSTRTAB,
+    };
+
+    Elf64_Sym symbols[3] = {
+        { 0 },
+        {
+            .st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION),
+            .st_shndx = SECTION_TEXT,
+        },
+        {
+            .st_name = 1,
+            .st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC),
+            .st_other = STV_DEFAULT,
+            .st_shndx = SECTION_TEXT,
+            .st_value = 0,
+            .st_size = length,
+        },
+    };
+
+    Elf64_Shdr sections[SECTION_COUNT] = {
+        [SECTION_TEXT] = {
+            .sh_name = NAME_TEXT,
+            .sh_type = SHT_PROGBITS,
+            .sh_flags = SHF_ALLOC | SHF_EXECINSTR,
+            .sh_offset = text_offset,
+            .sh_size = length,
+            .sh_addralign = TEXT_ALIGNMENT,
+        },
+        [SECTION_SYMTAB] = {
+            .sh_name = NAME_SYMTAB,
+            .sh_type = SHT_SYMTAB,
+            .sh_offset = symtab_offset,
+            .sh_size = symtab_size,
+            .sh_link = SECTION_STRTAB,
+            /* Index of the first global symbol. */
+            .sh_info = 2,
+            .sh_addralign = 8,
+            .sh_entsize = sizeof(Elf64_Sym),
+        },
+        [SECTION_STRTAB] = {
+            .sh_name = NAME_STRTAB,
+            .sh_type = SHT_STRTAB,
+            .sh_offset = strtab_offset,
+            .sh_size = strtab_size,
+            .sh_addralign = 1,
+        },
+        [SECTION_SHSTRTAB] = {
+            .sh_name = NAME_SHSTRTAB,
+            .sh_type = SHT_STRTAB,
+            .sh_offset = shstrtab_offset,
+            .sh_size = sizeof(section_names),
+            .sh_addralign = 1,
+        },
+        /* Tells the linker that the stack need not be executable. */
+        [SECTION_NOTE_GNU_STACK] = {
+            .sh_name = NAME_NOTE_GNU_STACK,
+            .sh_type = SHT_PROGBITS,
+            .sh_offset = section_headers_offset,
+            .sh_addralign = 1,
+        },
+    };
+
+    write_at(stream, &position, &header, sizeof(header));
+
+    pad_to(stream, &position, text_offset);
+    write_at(stream, &position, code, length);
+
+    pad_to(stream, &position, symtab_offset);
+    write_at(stream, &position, symbols, symtab_size);
+
+    write_at(stream, &position, "", 1);
+    write_at(stream, &position, symbol, symbol_length + 1);
+
+    write_at(stream, &position, section_names, sizeof(section_names));
+
+    pad_to(stream, &position, section_headers_offset);
+    write_at(stream, &position, sections, sizeof(sections));
+
+    return !ferror(stream);
+}
+
+#define STRINGIFY(...)          #__VA_ARGS__
+/* The fields of a structure in bf_compile.h, as text. */
+#define FIELDS(fields)          STRINGIFY(fields)
+
+/* Writes a structure, one field to a line. */
+static void write_struct(FILE *stream, const char *name, const char *fields) {
+    fprintf(stream, "struct %s {\n", name);
+
+    while (*fields != '\0') {
+        const char *end = strchr(fields, ';');
+        size_t length = end != NULL ? (size_t) (end - fields + 1)
+            : strlen(fields);
+
+        while (*fields == ' ') {
+            fields++;
+            length--;
+        }
+        if (length > 0) {
+            fprintf(stream, "    %.*s\n", (int) length, fields);
+        }
+        fields += length;
+    }
+
+    fprintf(stream, "};\n");
+}
+
+bool bf_emit_header(const char *symbol, FILE *stream) {
+    char guard[256];
+    size_t i;
+
+    for (i = 0; symbol[i] != '\0' && i < sizeof(guard) - 3; i++) {
+        guard[i] = toupper((unsigned char) symbol[i]);
+    }
+    strcpy(guard + i, "_H");
+
+    fprintf(stream,
+        "/* Generated by brainmuk " BF_VERSION ". */\n"
+        "#ifndef %s\n"
+        "#define %s\n"
+        "\n"
+        "#include <stdbool.h>\n"
+        "#include <stdint.h>\n"
+        "\n"
+        "#ifndef BF_RUNTIME_CONTEXT\n"
+        "#define BF_RUNTIME_CONTEXT\n"
+        "/**\n"
+        " * A range of cells, [low, high). It is empty when low is not below\n"
+        " * high; start with low = (uint8_t *) UINTPTR_MAX and high = NULL.\n"
+        " */\n",
+        guard, guard);
+    write_struct(stream, "bf_dirty_range", FIELDS(BF_DIRTY_RANGE_FIELDS));
+    fprintf(stream, "\n");
+    write_struct(stream, "bf_output_space", FIELDS(BF_OUTPUT_SPACE_FIELDS));
+    fprintf(stream, "\n");
+    write_struct(stream, "bf_buffered_io", FIELDS(BF_BUFFERED_IO_FIELDS));
+    fprintf(stream,
+        "\n"
+        "/**\n"
+        " * The tape and I/O callbacks for a compiled brainfuck program.\n"
+        " *\n"
+        " *  - universe: the tape, initially pointing at the first cell;\n"
+        " *  - output_byte: should output exactly one octet;\n"
+        " *  - input_byte: should return exactly one octet of input, or\n"
+        " *    0xFF on end-of-file;\n"
+        " *  - tape_start, tape_end: the first cell of the tape and one past\n"
+        " *    its last, if the program was compiled with --bounds-check;\n"
+        " *  - out_of_bounds: called, if the program was compiled with\n"
+        " *    --bounds-check, before it would touch a cell outside of the\n"
+        " *    tape, with the offset of the source character responsible and\n"
+        " *    the offending cell (the third argument is meaningless); it\n"
+        " *    must not return;\n"
+        " *  - dirty: if the program was compiled with --track-dirty, the\n"
+        " *    range of cells touched so far, which the program widens as\n"
+        " *    it runs; zero just those cells to reuse the tape;\n"
+        " *  - loop_counters, memo, memo_enter, memo_leave, output_start,\n"
+        " *    output_end, flush_output, input_start, input_end, fill_input,\n"
+        " *    copy_input, write_output: unused by this program.\n"
+        " */\n");
+    write_struct(stream, "bf_runtime_context",
+            FIELDS(BF_RUNTIME_CONTEXT_FIELDS));
+    fprintf(stream,
+        "#endif\n"
+        "\n"
+        "void %s(struct bf_runtime_context context);\n"
+        "\n"
+        "#endif\n",
+        symbol);
+
+    return !ferror(stream);
+}
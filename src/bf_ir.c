@@ -0,0 +1,1221 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <bf_ir.h>
+
+/**
+ * How far back fold_constants() will look for an operation to merge with.
+ */
+#define FOLD_WINDOW         64
+
+static void append(bf_ir *ir, struct bf_ir_op op) {
+    if (ir->length >= ir->capacity) {
+        size_t new_capacity = ir->capacity > 0 ? 2 * ir->capacity : 64;
+        struct bf_ir_op *ops = realloc(ir->ops, new_capacity * sizeof(*ops));
+        if (ops == NULL) {
+            abort();
+        }
+
+        ir->ops = ops;
+        ir->capacity = new_capacity;
+    }
+
+    ir->ops[ir->length++] = op;
+}
+
+static struct bf_ir_op *last_op(bf_ir *ir) {
+    return ir->length > 0 ? &ir->ops[ir->length - 1] : NULL;
+}
+
+/* Drops the last op if its run cancelled itself out (e.g., "+-"). */
+static void drop_if_nop(bf_ir *ir) {
+    struct bf_ir_op *op = last_op(ir);
+    if (op == NULL) {
+        return;
+    }
+
+    if ((op->kind == BF_IR_ADD && (op->value & 0xFF) == 0) ||
+            (op->kind == BF_IR_MOVE && op->value == 0)) {
+        ir->length--;
+    }
+}
+
+/*
+ * Recomputes the match of every bracket and the maximum nesting depth.
+ * Returns the index of the first unmatched bracket or ir->length if all
+ * brackets match.
+ */
+static size_t link_loops(bf_ir *ir) {
+    size_t *stack = malloc((ir->length + 1) * sizeof(size_t));
+    size_t depth = 0;
+
+    if (stack == NULL) {
+        abort();
+    }
+
+    ir->max_depth = 0;
+
+    for (size_t i = 0; i < ir->length; i++) {
+        struct bf_ir_op *op = &ir->ops[i];
+
+        if (op->kind == BF_IR_LOOP) {
+            stack[depth++] = i;
+            if (depth > ir->max_depth) {
+                ir->max_depth = depth;
+            }
+        } else if (op->kind == BF_IR_END) {
+            if (depth == 0) {
+                free(stack);
+                return i;
+            }
+
+            size_t top = stack[--depth];
+            ir->ops[top].match = i;
+            op->match = top;
+        }
+    }
+
+    size_t unmatched = depth > 0 ? stack[depth - 1] : ir->length;
+    free(stack);
+    return unmatched;
+}
+
+void bf_ir_parser_init(bf_ir_parser *parser) {
+    *parser = (bf_ir_parser) { .line = 1, .column = 1 };
+}
+
+/* Remembers where the bracket that was just opened is. */
+static void push_bracket(bf_ir_parser *parser, unsigned long line,
+        unsigned long column) {
+    if (parser->depth >= parser->capacity) {
+        size_t new_capacity = parser->capacity > 0 ? 2 * parser->capacity : 64;
+        struct bf_ir_position *open =
+            realloc(parser->open, new_capacity * sizeof(*open));
+        if (open == NULL) {
+            abort();
+        }
+
+        parser->open = open;
+        parser->capacity = new_capacity;
+    }
+
+    parser->open[parser->depth++] = (struct bf_ir_position) { line, column };
+}
+
+bool bf_ir_parse_chunk(bf_ir_parser *parser, const char *chunk, size_t length) {
+    bf_ir *ir = &parser->ir;
+
+    for (size_t i = 0; i < length && !parser->failed; i++) {
+        struct bf_ir_op *previous = last_op(ir);
+        size_t offset = parser->offset++;
+        unsigned long line = parser->line, column = parser->column;
+        enum bf_ir_kind kind;
+        int32_t amount = 0;
+
+        if (chunk[i] == '\n') {
+            parser->line++;
+            parser->column = 1;
+        } else {
+            parser->column++;
+        }
+
+        switch (chunk[i]) {
+            case '+': kind = BF_IR_ADD;    amount = 1;  break;
+            case '-': kind = BF_IR_ADD;    amount = -1; break;
+            case '>': kind = BF_IR_MOVE;   amount = 1;  break;
+            case '<': kind = BF_IR_MOVE;   amount = -1; break;
+            case '.': kind = BF_IR_OUTPUT; break;
+            case ',': kind = BF_IR_INPUT;  break;
+            case '[': kind = BF_IR_LOOP;   break;
+            case ']': kind = BF_IR_END;    break;
+            default:
+                /* Everything else is a comment. */
+                continue;
+        }
+
+        /* Keep track of brackets, so that errors can be located. */
+        if (kind == BF_IR_LOOP) {
+            push_bracket(parser, line, column);
+        } else if (kind == BF_IR_END) {
+            if (parser->depth == 0) {
+                parser->failed = true;
+                ir->err_line = line;
+                ir->err_col = column;
+                break;
+            }
+            parser->depth--;
+        }
+
+        /* Fold runs of arithmetic into the previous operation. */
+        if (amount != 0 && previous != NULL && previous->kind == kind) {
+            if (kind == BF_IR_ADD) {
+                previous->value = (previous->value + amount) & 0xFF;
+            } else {
+                previous->value += amount;
+            }
+            continue;
+        }
+
+        drop_if_nop(ir);
+        append(ir, (struct bf_ir_op) {
+            .kind = kind,
+            .value = kind == BF_IR_ADD ? amount & 0xFF : amount,
+            .source_offset = offset,
+        });
+    }
+
+    return !parser->failed;
+}
+
+bool bf_ir_parse_finish(bf_ir_parser *parser, bf_ir *ir) {
+    bool matched = !parser->failed && parser->depth == 0;
+
+    *ir = parser->ir;
+    ir->blank_tape = true;
+    drop_if_nop(ir);
+
+    /* The innermost bracket left open is the culprit. */
+    if (!parser->failed && parser->depth > 0) {
+        ir->err_line = parser->open[parser->depth - 1].line;
+        ir->err_col = parser->open[parser->depth - 1].column;
+    }
+
+    if (matched) {
+        link_loops(ir);
+    }
+
+    free(parser->open);
+    bf_ir_parser_init(parser);
+    return matched;
+}
+
+bool bf_ir_parse(const char *source, bf_ir *ir) {
+    bf_ir_parser parser;
+
+    bf_ir_parser_init(&parser);
+    bf_ir_parse_chunk(&parser, source, strlen(source));
+    return bf_ir_parse_finish(&parser, ir);
+}
+
+/* Replaces the ops of the IR with the ops of the rewritten program. */
+static void replace_ops(bf_ir *ir, bf_ir *rewritten) {
+    free(ir->ops);
+    ir->ops = rewritten->ops;
+    ir->length = rewritten->length;
+    ir->capacity = rewritten->capacity;
+    link_loops(ir);
+}
+
+/*
+ * Defers pointer movement until the next loop boundary, folding it into the
+ * offsets of the operations in between: ">+>+<" becomes two additions at
+ * offsets 1 and 2, followed by a single move.
+ */
+static void defer_movement(bf_ir *ir) {
+    bf_ir out = { 0 };
+    int32_t shift = 0;
+
+    for (size_t i = 0; i < ir->length; i++) {
+        struct bf_ir_op op = ir->ops[i];
+
+        switch (op.kind) {
+            case BF_IR_MOVE:
+                shift += op.value;
+                break;
+
+            case BF_IR_LOOP:
+            case BF_IR_END:
+                if (shift != 0) {
+                    append(&out, (struct bf_ir_op) {
+                        .kind = BF_IR_MOVE,
+                        .value = shift,
+                        .source_offset = op.source_offset,
+                    });
+                    shift = 0;
+                }
+                append(&out, op);
+                break;
+
+            default:
+                op.offset += shift;
+                append(&out, op);
+                break;
+        }
+    }
+
+    if (shift != 0) {
+        append(&out, (struct bf_ir_op) {
+            .kind = BF_IR_MOVE,
+            .value = shift,
+            .source_offset = ir->length > 0
+                ? ir->ops[ir->length - 1].source_offset : 0,
+        });
+    }
+
+    replace_ops(ir, &out);
+}
+
+/*
+ * If the loop starting at index i only does arithmetic and ends where it
+ * started, writes the net change of each cell into delta (indexed by
+ * offset + radius) and returns true.
+ */
+#define MUL_RADIUS  32
+static bool simple_loop_deltas(const bf_ir *ir, size_t i, int32_t *delta) {
+    int32_t position = 0;
+
+    memset(delta, 0, sizeof(int32_t) * (2 * MUL_RADIUS + 1));
+
+    for (size_t j = i + 1; j < ir->ops[i].match; j++) {
+        const struct bf_ir_op *op = &ir->ops[j];
+
+        if (op->kind == BF_IR_MOVE) {
+            position += op->value;
+            continue;
+        }
+
+        if (op->kind != BF_IR_ADD) {
+            return false;
+        }
+
+        int32_t cell = position + op->offset;
+        if (cell < -MUL_RADIUS || cell > MUL_RADIUS) {
+            return false;
+        }
+
+        delta[cell + MUL_RADIUS] += op->value;
+    }
+
+    return position == 0;
+}
+
+/* Does the loop change any cell besides its counter? */
+static bool changes_other_cells(const int32_t *delta) {
+    for (int32_t cell = -MUL_RADIUS; cell <= MUL_RADIUS; cell++) {
+        if (cell != 0 && (delta[cell + MUL_RADIUS] & 0xFF) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Turns clear loops ("[-]") and, if allowed, multiply loops ("[->++>+<<]")
+ * into direct assignments. Both are only rewritten when the loop is
+ * guaranteed to run *p times (i.e., the loop counter changes by one).
+ */
+static void lower_simple_loops(bf_ir *ir, bool multiply) {
+    bf_ir out = { 0 };
+    int32_t delta[2 * MUL_RADIUS + 1];
+
+    for (size_t i = 0; i < ir->length; i++) {
+        struct bf_ir_op op = ir->ops[i];
+
+        if (op.kind != BF_IR_LOOP || !simple_loop_deltas(ir, i, delta)) {
+            append(&out, op);
+            continue;
+        }
+
+        int32_t counter = delta[MUL_RADIUS] & 0xFF;
+        if ((counter != 0x01 && counter != 0xFF)
+                || (!multiply && changes_other_cells(delta))) {
+            append(&out, op);
+            continue;
+        }
+
+        /* When counting up, the loop runs (256 - *p) times. */
+        int32_t sign = counter == 0xFF ? 1 : -1;
+        for (int32_t cell = -MUL_RADIUS; cell <= MUL_RADIUS; cell++) {
+            int32_t factor = (sign * delta[cell + MUL_RADIUS]) & 0xFF;
+            if (cell == 0 || factor == 0) {
+                continue;
+            }
+
+            append(&out, (struct bf_ir_op) {
+                .kind = BF_IR_MUL,
+                .offset = cell,
+                .value = factor,
+                .source_offset = op.source_offset,
+            });
+        }
+
+        append(&out, (struct bf_ir_op) {
+            .kind = BF_IR_SET,
+            .offset = 0,
+            .value = 0,
+            .source_offset = op.source_offset,
+        });
+
+        i = op.match;
+    }
+
+    replace_ops(ir, &out);
+}
+
+static void lower_clear_loops(bf_ir *ir) {
+    lower_simple_loops(ir, false);
+}
+
+static void lower_multiply_loops(bf_ir *ir) {
+    lower_simple_loops(ir, true);
+}
+
+/* Does the op read or write the cell at offset? */
+static bool touches(const struct bf_ir_op *op, int32_t offset) {
+    if (op->kind == BF_IR_MUL && offset == 0) {
+        return true;
+    }
+    return op->offset == offset;
+}
+
+/*
+ * Merges additions and assignments to the same cell within a straight line
+ * of code: "[-]+++" becomes *p = 3.
+ */
+static void fold_constants(bf_ir *ir) {
+    bf_ir out = { 0 };
+
+    for (size_t i = 0; i < ir->length; i++) {
+        struct bf_ir_op op = ir->ops[i];
+        bool merged = false;
+
+        if (op.kind == BF_IR_ADD || op.kind == BF_IR_SET) {
+            for (size_t j = out.length; j > 0 && out.length - j < FOLD_WINDOW; j--) {
+                struct bf_ir_op *earlier = &out.ops[j - 1];
+
+                if (earlier->kind == BF_IR_LOOP || earlier->kind == BF_IR_END
+                        || earlier->kind == BF_IR_MOVE) {
+                    break;
+                }
+
+                if (!touches(earlier, op.offset)) {
+                    continue;
+                }
+
+                /* A MUL at offset 0 reads *p, so it cannot be merged. */
+                if (earlier->offset != op.offset) {
+                    break;
+                }
+
+                if (earlier->kind == BF_IR_ADD || earlier->kind == BF_IR_SET) {
+                    if (op.kind == BF_IR_SET) {
+                        earlier->kind = BF_IR_SET;
+                        earlier->value = op.value;
+                    } else {
+                        earlier->value = (earlier->value + op.value) & 0xFF;
+                    }
+
+                    /* Remove additions that cancelled out. */
+                    if (earlier->kind == BF_IR_ADD && earlier->value == 0) {
+                        memmove(earlier, earlier + 1,
+                                (out.length - j) * sizeof(*earlier));
+                        out.length--;
+                    }
+                    merged = true;
+                }
+                break;
+            }
+        }
+
+        if (!merged) {
+            append(&out, op);
+        }
+    }
+
+    replace_ops(ir, &out);
+}
+
+/*
+ * Removes loops that can never be entered: loops at the very beginning of
+ * a program that starts on a blank tape (often used as comments), and loops
+ * that immediately follow another loop or an assignment of zero to *p.
+ */
+static void remove_dead_loops(bf_ir *ir) {
+    bf_ir out = { 0 };
+    bool known_zero = ir->blank_tape;
+
+    for (size_t i = 0; i < ir->length; i++) {
+        struct bf_ir_op op = ir->ops[i];
+
+        switch (op.kind) {
+            case BF_IR_LOOP:
+                if (known_zero) {
+                    i = op.match;
+                    continue;
+                }
+                known_zero = false;
+                break;
+            case BF_IR_END:
+                /* A loop only ever exits when *p is zero. */
+                known_zero = true;
+                break;
+            case BF_IR_SET:
+                if (op.offset == 0) {
+                    known_zero = op.value == 0;
+                }
+                break;
+            case BF_IR_OUTPUT:
+                break;
+            case BF_IR_MOVE:
+                known_zero = false;
+                break;
+            default:
+                if (op.offset == 0) {
+                    known_zero = false;
+                }
+                break;
+        }
+
+        append(&out, op);
+    }
+
+    replace_ops(ir, &out);
+}
+
+/**
+ * Memoized loops may touch at most this many cells.
+ */
+#define MEMO_MAX_WINDOW     16
+/**
+ * Each level of loop nesting is assumed to multiply the cost of its body by
+ * this much, absent a profile.
+ */
+#define MEMO_LOOP_WEIGHT    16
+/**
+ * Loops that are estimated to run fewer operations than this per entry are
+ * cheaper to run than to look up.
+ */
+#define MEMO_MIN_COST       256
+
+/*
+ * Can the loop starting at ir->ops[start] be memoized? It can if it does no
+ * I/O and it, and every loop within it, leaves p where it found it: then,
+ * every cell it touches is at a fixed offset from p. If so, stores that
+ * window of cells in the loop and returns the estimated cost of one entry.
+ */
+static uint64_t memoizable_cost(bf_ir *ir, size_t start) {
+    struct bf_ir_op *loop = &ir->ops[start];
+    size_t end = loop->match;
+    int32_t *displacements;
+    size_t depth = 0;
+    int32_t displacement = 0, low = 0, high = 0;
+    uint64_t weight = 1, cost = 0;
+    bool pure = true;
+
+    displacements = malloc((ir->max_depth + 1) * sizeof(int32_t));
+    if (displacements == NULL) {
+        abort();
+    }
+
+    for (size_t i = start + 1; i < end && pure; i++) {
+        const struct bf_ir_op *op = &ir->ops[i];
+        int32_t cell = displacement + op->offset;
+
+        switch (op->kind) {
+            case BF_IR_OUTPUT:
+            case BF_IR_INPUT:
+                pure = false;
+                continue;
+            case BF_IR_MOVE:
+                displacement += op->value;
+                break;
+            case BF_IR_LOOP:
+                displacements[depth++] = displacement;
+                weight *= MEMO_LOOP_WEIGHT;
+                cell = displacement;
+                break;
+            case BF_IR_END:
+                pure = displacements[--depth] == displacement;
+                weight /= MEMO_LOOP_WEIGHT;
+                cell = displacement;
+                break;
+            case BF_IR_MUL:
+                low = displacement < low ? displacement : low;
+                high = displacement > high ? displacement : high;
+                break;
+            default:
+                break;
+        }
+
+        low = cell < low ? cell : low;
+        high = cell > high ? cell : high;
+        cost += weight;
+    }
+
+    free(displacements);
+
+    if (!pure || displacement != 0 || high - low >= MEMO_MAX_WINDOW) {
+        return 0;
+    }
+
+    loop->window_low = low;
+    loop->window_high = high;
+
+    /* A profile tells us how many times the body really runs. */
+    if (loop->entries > 0) {
+        return (end - start) * (loop->iterations / loop->entries);
+    }
+    return cost;
+}
+
+/**
+ * Marks loops that are worth memoizing: loops that touch a small window of
+ * cells around p, do no I/O, and are expensive enough (according to the
+ * profile, when there is one) that a lookup pays for itself. Only the
+ * outermost such loop of a nest is marked.
+ */
+static void mark_memoizable_loops(bf_ir *ir) {
+    for (size_t i = 0; i < ir->length; i++) {
+        struct bf_ir_op *op = &ir->ops[i];
+
+        if (op->kind != BF_IR_LOOP) {
+            continue;
+        }
+
+        op->memoize = memoizable_cost(ir, i) >= MEMO_MIN_COST;
+        if (op->memoize) {
+            i = op->match;
+        }
+    }
+}
+
+/**
+ * All optimization passes, in the order they run.
+ */
+static const struct bf_ir_pass {
+    bf_pass_set pass;
+    const char *name;
+    /** The lowest optimization level that runs this pass. */
+    int level;
+    void (*run)(bf_ir *ir);
+} passes[] = {
+    { BF_PASS_OFFSET,   "offset",   2, defer_movement },
+    { BF_PASS_CLEAR,    "clear",    1, lower_clear_loops },
+    { BF_PASS_MULTIPLY, "multiply", 2, lower_multiply_loops },
+    { BF_PASS_FOLD,     "fold",     1, fold_constants },
+    { BF_PASS_DEAD,     "dead",     1, remove_dead_loops },
+    { BF_PASS_MEMOIZE,  "memoize",  3, mark_memoizable_loops },
+};
+#define PASS_COUNT  (sizeof(passes) / sizeof(passes[0]))
+
+bf_pass_set bf_ir_passes_for_level(int level) {
+    bf_pass_set set = 0;
+
+    for (size_t i = 0; i < PASS_COUNT; i++) {
+        if (level >= passes[i].level) {
+            set |= passes[i].pass;
+        }
+    }
+
+    return set;
+}
+
+bool bf_ir_parse_passes(const char *spec, bf_pass_set *set) {
+    while (*spec != '\0') {
+        size_t length = strcspn(spec, ",");
+        bool enable = true;
+        bf_pass_set named = 0;
+        const char *name = spec;
+
+        if (*name == '+' || *name == '-') {
+            enable = *name == '+';
+            name++;
+            length--;
+        }
+
+        if (length == 3 && strncmp(name, "all", 3) == 0) {
+            named = BF_PASS_ALL;
+        } else if (length == 4 && strncmp(name, "none", 4) == 0) {
+            named = BF_PASS_ALL;
+            enable = false;
+        }
+
+        for (size_t i = 0; i < PASS_COUNT && named == 0; i++) {
+            if (strlen(passes[i].name) == length
+                    && strncmp(name, passes[i].name, length) == 0) {
+                named = passes[i].pass;
+            }
+        }
+
+        if (named == 0) {
+            return false;
+        }
+
+        *set = enable ? (*set | named) : (*set & ~named);
+
+        spec = name + length;
+        if (*spec == ',') {
+            spec++;
+        }
+    }
+
+    return true;
+}
+
+/* Number of loops in the IR. */
+static size_t count_loops(const bf_ir *ir) {
+    size_t loops = 0;
+    for (size_t i = 0; i < ir->length; i++) {
+        loops += ir->ops[i].kind == BF_IR_LOOP;
+    }
+    return loops;
+}
+
+/* Did the pass change anything observable about the IR? */
+static bool ops_differ(const struct bf_ir_op *before, size_t before_length,
+        const bf_ir *after) {
+    if (before_length != after->length) {
+        return true;
+    }
+
+    for (size_t i = 0; i < before_length; i++) {
+        const struct bf_ir_op *a = &before[i], *b = &after->ops[i];
+        if (a->kind != b->kind || a->offset != b->offset
+                || a->value != b->value || a->memoize != b->memoize) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void bf_ir_run_passes(bf_ir *ir, bf_pass_set set, FILE *report) {
+    for (size_t i = 0; i < PASS_COUNT; i++) {
+        struct bf_ir_op *before = NULL;
+        size_t before_length = ir->length;
+        size_t before_loops = 0;
+
+        if (!(set & passes[i].pass)) {
+            if (report != NULL) {
+                fprintf(report, "%-10s skipped\n", passes[i].name);
+            }
+            continue;
+        }
+
+        if (report != NULL) {
+            before = malloc((before_length + 1) * sizeof(*before));
+            if (before == NULL) {
+                abort();
+            }
+            memcpy(before, ir->ops, before_length * sizeof(*before));
+            before_loops = count_loops(ir);
+        }
+
+        passes[i].run(ir);
+
+        if (report != NULL) {
+            fprintf(report, "%-10s %s: %zu -> %zu ops, %zu -> %zu loops\n",
+                    passes[i].name,
+                    ops_differ(before, before_length, ir)
+                        ? "changed" : "unchanged",
+                    before_length, ir->length,
+                    before_loops, count_loops(ir));
+            free(before);
+        }
+    }
+}
+
+void bf_ir_optimize(bf_ir *ir) {
+    bf_ir_run_passes(ir, bf_ir_passes_for_level(BF_DEFAULT_OPTIMIZATION), NULL);
+}
+
+bool *bf_ir_balanced_loops(const bf_ir *ir) {
+    struct {
+        size_t start;
+        int64_t displacement;
+        bool nested_balanced;
+    } *stack = malloc((ir->max_depth + 1) * sizeof(*stack));
+    bool *balanced = calloc(ir->length + 1, sizeof(bool));
+    size_t depth = 0;
+
+    if (stack == NULL || balanced == NULL) {
+        abort();
+    }
+
+    for (size_t i = 0; i < ir->length; i++) {
+        const struct bf_ir_op *op = &ir->ops[i];
+
+        switch (op->kind) {
+            case BF_IR_LOOP:
+                stack[depth].start = i;
+                stack[depth].displacement = 0;
+                stack[depth].nested_balanced = true;
+                depth++;
+                break;
+            case BF_IR_END:
+                depth--;
+                balanced[stack[depth].start] = stack[depth].displacement == 0
+                    && stack[depth].nested_balanced;
+                if (depth > 0) {
+                    stack[depth - 1].nested_balanced &=
+                        balanced[stack[depth].start];
+                }
+                break;
+            case BF_IR_MOVE:
+                if (depth > 0) {
+                    stack[depth - 1].displacement += op->value;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    free(stack);
+    return balanced;
+}
+
+/* A stretch of code in which p is at a known offset from where it started. */
+struct region {
+    /* The first operation, or NO_REGION between regions. */
+    size_t start;
+    int64_t displacement;
+    /* The cells touched so far, if any. */
+    bool touches;
+    int64_t low, high;
+};
+
+#define NO_REGION   SIZE_MAX
+
+static void touch_cell(struct region *region, int64_t cell) {
+    if (!region->touches) {
+        region->low = region->high = cell;
+        region->touches = true;
+    }
+    region->low = cell < region->low ? cell : region->low;
+    region->high = cell > region->high ? cell : region->high;
+}
+
+/* Accounts for the cells the operation touches, and where it leaves p. */
+static void advance_region(struct region *region, const struct bf_ir_op *op) {
+    switch (op->kind) {
+        case BF_IR_MOVE:
+            region->displacement += op->value;
+            break;
+        case BF_IR_LOOP:
+        case BF_IR_END:
+            touch_cell(region, region->displacement);
+            break;
+        case BF_IR_MUL:
+            touch_cell(region, region->displacement);
+            touch_cell(region, region->displacement + op->offset);
+            break;
+        default:
+            touch_cell(region, region->displacement + op->offset);
+            break;
+    }
+}
+
+bool bf_ir_pointer_range(const bf_ir *ir, int64_t *low, int64_t *high) {
+    struct region program = { .start = 0 };
+    bool *balanced = bf_ir_balanced_loops(ir);
+    bool bounded = true;
+
+    /* Only balanced loops nest in balanced loops. */
+    for (size_t i = 0; i < ir->length && bounded; i++) {
+        bounded = ir->ops[i].kind != BF_IR_LOOP || balanced[i];
+        advance_region(&program, &ir->ops[i]);
+    }
+
+    free(balanced);
+
+    if (!bounded) {
+        return false;
+    }
+
+    /* p itself is always on the tape. */
+    touch_cell(&program, 0);
+    *low = program.low;
+    *high = program.high;
+    return true;
+}
+
+static void close_region(bf_ir *ir, struct region *region) {
+    if (region->start != NO_REGION && region->touches) {
+        struct bf_ir_op *op = &ir->ops[region->start];
+        op->check = true;
+        op->check_low = region->low;
+        op->check_high = region->high;
+    }
+
+    *region = (struct region) { .start = NO_REGION };
+}
+
+void bf_ir_place_bounds_checks(bf_ir *ir) {
+    struct region region = { .start = NO_REGION };
+    bool *balanced = bf_ir_balanced_loops(ir);
+
+    for (size_t i = 0; i < ir->length; i++) {
+        struct bf_ir_op *op = &ir->ops[i];
+
+        op->check = false;
+        if (region.start == NO_REGION) {
+            region.start = i;
+        }
+
+        advance_region(&region, op);
+
+        /*
+         * After entering the body of an unbalanced loop, or leaving it, p
+         * may be anywhere: a new region starts.
+         */
+        if ((op->kind == BF_IR_LOOP && !balanced[i])
+                || (op->kind == BF_IR_END && !balanced[op->match])) {
+            close_region(ir, &region);
+        }
+    }
+
+    close_region(ir, &region);
+    free(balanced);
+}
+
+/**
+ * How many cells a filter loop may use, and how many operations its body
+ * may run, all told, to work out its table.
+ */
+#define FILTER_CELLS        256
+#define FILTER_BUDGET       (1 << 22)
+
+/* The body of a filter loop, run for one value of its cell. */
+struct filter_run {
+    uint8_t tape[FILTER_CELLS];
+    int64_t p;
+    int64_t low, high;
+    unsigned outputs;
+    uint8_t output;
+    uint64_t budget;
+};
+
+/*
+ * Runs the operations from ir->ops[start] up to, not including,
+ * ir->ops[stop] (which must not be within a loop that starts earlier).
+ *
+ * @return false if it reads input, strays off the tape, or takes too long.
+ */
+static bool run_filter(const bf_ir *ir, size_t start, size_t stop,
+        struct filter_run *run) {
+    for (size_t i = start; i < stop; i++) {
+        const struct bf_ir_op *op = &ir->ops[i];
+
+        if (op->kind == BF_IR_MOVE) {
+            run->p += op->value;
+            continue;
+        }
+
+        int64_t cell = run->p;
+        if (op->kind != BF_IR_LOOP && op->kind != BF_IR_END) {
+            cell += op->offset;
+        }
+
+        if (run->budget-- == 0 || op->kind == BF_IR_INPUT
+                || run->p < 0 || run->p >= FILTER_CELLS
+                || cell < 0 || cell >= FILTER_CELLS) {
+            return false;
+        }
+        run->low = cell < run->low ? cell : run->low;
+        run->high = cell > run->high ? cell : run->high;
+
+        uint8_t *value = &run->tape[cell];
+        switch (op->kind) {
+            case BF_IR_ADD:
+                *value += op->value;
+                break;
+            case BF_IR_SET:
+                *value = op->value;
+                break;
+            case BF_IR_MUL:
+                *value += run->tape[run->p] * op->value;
+                break;
+            case BF_IR_OUTPUT:
+                run->output = *value;
+                run->outputs++;
+                break;
+            case BF_IR_LOOP:
+                i = *value == 0 ? op->match : i;
+                break;
+            case BF_IR_END:
+                i = *value != 0 ? op->match : i;
+                break;
+            default:
+                break;
+        }
+    }
+
+    return true;
+}
+
+bool bf_ir_filter_loop(const bf_ir *ir, size_t loop, bf_ir_filter *filter) {
+    size_t end = ir->ops[loop].match;
+    size_t input = end;
+    int64_t depth = 0, before, after = 0;
+    uint8_t adjust = 0;
+
+    /* One input, not within another loop... */
+    for (size_t i = loop + 1; i < end; i++) {
+        const struct bf_ir_op *op = &ir->ops[i];
+
+        depth += (op->kind == BF_IR_LOOP) - (op->kind == BF_IR_END);
+        if (op->kind == BF_IR_INPUT) {
+            if (input != end || depth != 0) {
+                return false;
+            }
+            input = i;
+        }
+    }
+    if (input == end) {
+        return false;
+    }
+
+    /* ...into the loop's cell, which is all that is adjusted after it. */
+    before = -ir->ops[input].offset;
+    for (size_t i = input + 1; i < end; i++) {
+        const struct bf_ir_op *op = &ir->ops[i];
+
+        if (op->kind == BF_IR_MOVE) {
+            after += op->value;
+        } else if (op->kind == BF_IR_ADD && before + after + op->offset == 0) {
+            adjust += op->value;
+        } else {
+            return false;
+        }
+    }
+    if (before + after != 0) {
+        return false;
+    }
+
+    /* Run the body up to the input for every value it could start with. */
+    int64_t origin = FILTER_CELLS / 2;
+    uint64_t budget = FILTER_BUDGET;
+    uint8_t outputs[256] = { 0 };
+    int64_t low = origin, high = origin;
+
+    for (unsigned start = 1; start < 256; start++) {
+        struct filter_run run = {
+            .p = origin, .low = origin, .high = origin, .budget = budget,
+        };
+        run.tape[origin] = start;
+
+        if (!run_filter(ir, loop + 1, input, &run)
+                || run.outputs != 1 || run.p != origin + before) {
+            return false;
+        }
+        for (int64_t cell = run.low; cell <= run.high; cell++) {
+            if (cell != origin && run.tape[cell] != 0) {
+                return false;
+            }
+        }
+
+        outputs[start] = run.output;
+        budget = run.budget;
+        low = run.low < low ? run.low : low;
+        high = run.high > high ? run.high : high;
+    }
+
+    /* The byte read, once adjusted, is what the next iteration starts with. */
+    filter->input = input;
+    filter->until = -adjust;
+    filter->identity = true;
+    for (unsigned byte = 0; byte < 256; byte++) {
+        filter->table[byte] = byte == filter->until
+            ? byte : outputs[(uint8_t) (byte + adjust)];
+        filter->identity &= filter->table[byte] == byte;
+    }
+    filter->scratch_low = low - (origin + before);
+    filter->scratch_high = high - (origin + before);
+    return true;
+}
+
+/**
+ * How far back, and to either side of p, bf_ir_find_output_run() keeps
+ * track of the values of cells.
+ */
+#define KNOWN_LOOKBACK      256
+#define KNOWN_CELLS         512
+
+/* What is known of the cells around where p started. */
+struct known_cells {
+    int64_t p;
+    bool known[KNOWN_CELLS];
+    uint8_t value[KNOWN_CELLS];
+};
+
+/* The index of the cell at the offset from p, or -1 if it is not kept. */
+static int64_t known_index(const struct known_cells *cells, int32_t offset) {
+    int64_t index = cells->p + offset + KNOWN_CELLS / 2;
+    return index >= 0 && index < KNOWN_CELLS ? index : -1;
+}
+
+static bool known_value(const struct known_cells *cells, int32_t offset,
+        uint8_t *value) {
+    int64_t index = known_index(cells, offset);
+
+    if (index < 0 || !cells->known[index]) {
+        return false;
+    }
+    *value = cells->value[index];
+    return true;
+}
+
+static void set_known(struct known_cells *cells, int32_t offset, bool known,
+        uint8_t value) {
+    int64_t index = known_index(cells, offset);
+
+    if (index >= 0) {
+        cells->known[index] = known;
+        cells->value[index] = value;
+    }
+}
+
+/* Accounts for an operation that is neither a loop nor output. */
+static void advance_known(struct known_cells *cells,
+        const struct bf_ir_op *op) {
+    uint8_t here, there;
+    bool known = known_value(cells, op->offset, &there);
+
+    switch (op->kind) {
+        case BF_IR_MOVE:
+            cells->p += op->value;
+            break;
+        case BF_IR_ADD:
+            set_known(cells, op->offset, known, there + op->value);
+            break;
+        case BF_IR_SET:
+            set_known(cells, op->offset, true, op->value);
+            break;
+        case BF_IR_MUL:
+            known = known && known_value(cells, 0, &here);
+            set_known(cells, op->offset, known, there + here * op->value);
+            break;
+        case BF_IR_INPUT:
+            set_known(cells, op->offset, false, 0);
+            break;
+        default:
+            break;
+    }
+}
+
+bool bf_ir_find_output_run(const bf_ir *ir, size_t op,
+        bf_ir_output_run *run) {
+    const struct bf_ir_op *first = &ir->ops[op];
+    struct known_cells cells = { 0 };
+    size_t start = op;
+    uint8_t value;
+
+    /* What is known comes from as far back as the last loop. */
+    while (start > 0 && op - start < KNOWN_LOOKBACK
+            && ir->ops[start - 1].kind != BF_IR_LOOP
+            && ir->ops[start - 1].kind != BF_IR_END) {
+        start--;
+    }
+    if (start > 0 && ir->ops[start - 1].kind == BF_IR_END) {
+        /* A loop is left with its cell 0. */
+        set_known(&cells, 0, true, 0);
+    }
+    for (size_t i = start; i < op; i++) {
+        advance_known(&cells, &ir->ops[i]);
+    }
+
+    if (!known_value(&cells, first->offset, &value)) {
+        size_t end = op + 1;
+        while (end < ir->length && end - op < BF_IR_MAX_OUTPUT_RUN
+                && ir->ops[end].kind == BF_IR_OUTPUT
+                && ir->ops[end].offset == first->offset
+                && !ir->ops[end].check) {
+            end++;
+        }
+
+        *run = (bf_ir_output_run) {
+            .end = end, .length = end - op, .repeat = true,
+        };
+        return run->length > 1;
+    }
+
+    run->end = op;
+    run->length = 0;
+    run->repeat = false;
+    for (size_t i = op; i < ir->length; i++) {
+        const struct bf_ir_op *next = &ir->ops[i];
+
+        if ((i > op && next->check) || next->kind == BF_IR_LOOP
+                || next->kind == BF_IR_END || next->kind == BF_IR_INPUT) {
+            break;
+        }
+
+        if (next->kind != BF_IR_OUTPUT) {
+            advance_known(&cells, next);
+            continue;
+        }
+
+        if (run->length == BF_IR_MAX_OUTPUT_RUN
+                || !known_value(&cells, next->offset, &value)) {
+            break;
+        }
+        run->bytes[run->length++] = value;
+        run->end = i + 1;
+    }
+
+    return run->length > 1;
+}
+
+/**
+ * How many operations bf_ir_run_opening() runs, at most.
+ */
+#define OPENING_BUDGET      (1 << 20)
+
+void bf_ir_run_opening(const bf_ir *ir, bf_ir_opening *opening) {
+    int64_t origin = BF_IR_OPENING_CELLS / 2, p = origin;
+    uint64_t budget = OPENING_BUDGET;
+    size_t i;
+
+    memset(opening, 0, sizeof(*opening));
+    for (i = 0; i < ir->length; i++) {
+        const struct bf_ir_op *op = &ir->ops[i];
+        int64_t cell = p + op->offset;
+
+        if (op->kind == BF_IR_MOVE) {
+            p += op->value;
+            continue;
+        }
+
+        if (budget-- == 0 || op->kind == BF_IR_INPUT
+                || (op->kind == BF_IR_LOOP && op->memoize)
+                || (op->kind == BF_IR_OUTPUT
+                    && opening->length == BF_IR_MAX_OPENING_OUTPUT)
+                || p < 0 || p >= BF_IR_OPENING_CELLS
+                || cell < 0 || cell >= BF_IR_OPENING_CELLS) {
+            break;
+        }
+
+        uint8_t *value = &opening->cells[cell];
+        switch (op->kind) {
+            case BF_IR_ADD:
+                *value += op->value;
+                break;
+            case BF_IR_SET:
+                *value = op->value;
+                break;
+            case BF_IR_MUL:
+                *value += opening->cells[p] * op->value;
+                break;
+            case BF_IR_OUTPUT:
+                opening->output[opening->length++] = *value;
+                break;
+            case BF_IR_LOOP:
+                i = *value == 0 ? op->match : i;
+                break;
+            case BF_IR_END:
+                i = *value != 0 ? op->match : i;
+                break;
+            default:
+                break;
+        }
+    }
+
+    opening->resume = i;
+    opening->p = p - origin;
+}
+
+void bf_ir_free(bf_ir *ir) {
+    free(ir->ops);
+    *ir = (bf_ir) { 0 };
+}
@@ -0,0 +1,422 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <bf_lanes.h>
+#include <bf_universe.h>
+
+#define MAX_VECTORS     (BF_MAX_LANES / BF_LANES_PER_VECTOR)
+
+/**
+ * One cell of BF_LANES_PER_VECTOR lanes; also used as a mask of lanes, where
+ * 0xFF means the lane is active.
+ */
+typedef uint8_t lane_vector
+    __attribute__((vector_size(BF_LANES_PER_VECTOR)));
+
+struct lane_output {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+};
+
+/* The state of up to BF_MAX_LANES records running together. */
+struct lane_group {
+    const bf_ir *ir;
+    /* For each BF_IR_LOOP: does every iteration leave p where it was? */
+    const bool *balanced;
+
+    size_t lanes;
+    size_t vectors;
+    size_t cells;
+    /* Cell c of lane l is byte c * lanes + l. */
+    lane_vector *tape;
+    /* The cell where p starts; pointers are relative to it. */
+    size_t origin;
+    /* The cells touched since the tape was last cleared: [low, high). */
+    ptrdiff_t dirty_low;
+    ptrdiff_t dirty_high;
+    bf_lanes_out_of_bounds out_of_bounds;
+
+    /* How many lanes are running a record, and which. */
+    size_t live;
+    const struct bf_lane_record *records;
+    size_t input_position[BF_MAX_LANES];
+    struct lane_output output[BF_MAX_LANES];
+};
+
+static uint8_t input_byte(struct lane_group *group, size_t lane) {
+    const struct bf_lane_record *record = &group->records[lane];
+
+    if (group->input_position[lane] >= record->length) {
+        return 0xFF;
+    }
+    return record->data[group->input_position[lane]++];
+}
+
+static void output_byte(struct lane_group *group, size_t lane, uint8_t byte) {
+    struct lane_output *output = &group->output[lane];
+
+    if (output->length == output->capacity) {
+        output->capacity = output->capacity == 0 ? 64 : 2 * output->capacity;
+        output->data = realloc(output->data, output->capacity);
+        if (output->data == NULL) {
+            abort();
+        }
+    }
+
+    output->data[output->length++] = byte;
+}
+
+static lane_vector *allocate_tape(size_t cells, size_t vectors) {
+    /* Each lane may move as far as the universe lets p move. */
+    if (cells / 2 > BF_UNIVERSE_MAXIMUM) {
+        return NULL;
+    }
+
+    lane_vector *tape = aligned_alloc(sizeof(lane_vector),
+            cells * vectors * sizeof(lane_vector));
+    if (tape != NULL) {
+        memset(tape, 0, cells * vectors * sizeof(lane_vector));
+    }
+    return tape;
+}
+
+/*
+ * Grows the tape, equally in both directions, until it has the cells from
+ * low to high (inclusive, relative to the origin). Pointers stay valid, as
+ * the origin moves along with the cells.
+ */
+static void grow(struct lane_group *group, const struct bf_ir_op *op,
+        ptrdiff_t low, ptrdiff_t high) {
+    size_t cells = group->cells, shift = 0;
+
+    do {
+        cells *= 2;
+        shift = (cells - group->cells) / 2;
+    } while ((ptrdiff_t) (group->origin + shift) + low < 0
+            || (ptrdiff_t) (group->origin + shift) + high >= (ptrdiff_t) cells);
+
+    lane_vector *tape = allocate_tape(cells, group->vectors);
+    if (tape == NULL) {
+        group->out_of_bounds(op->source_offset,
+                (ptrdiff_t) group->origin + low < 0 ? low : high);
+        abort();
+    }
+
+    memcpy(&tape[shift * group->vectors], group->tape,
+            group->cells * group->vectors * sizeof(lane_vector));
+    free(group->tape);
+
+    group->tape = tape;
+    group->cells = cells;
+    group->origin += shift;
+}
+
+/*
+ * Makes sure that the tape has the cells that the code from the marked
+ * operation to the next may touch, with the pointer at p, and widens the
+ * dirty range of the tape by them.
+ */
+static void reach(struct lane_group *group, const struct bf_ir_op *op,
+        ptrdiff_t p) {
+    ptrdiff_t low = p + op->check_low;
+    ptrdiff_t high = p + op->check_high + 1;
+
+    if ((ptrdiff_t) group->origin + low < 0
+            || (ptrdiff_t) group->origin + high > (ptrdiff_t) group->cells) {
+        grow(group, op, low, high - 1);
+    }
+
+    group->dirty_low = low < group->dirty_low ? low : group->dirty_low;
+    group->dirty_high = high > group->dirty_high ? high : group->dirty_high;
+}
+
+/* Zeros just the cells touched since the tape was last cleared. */
+static void clear_dirty(struct lane_group *group) {
+    if (group->dirty_low < group->dirty_high) {
+        memset(&group->tape[(group->origin + group->dirty_low)
+                    * group->vectors], 0,
+                (group->dirty_high - group->dirty_low) * group->vectors
+                * sizeof(lane_vector));
+    }
+
+    group->dirty_low = PTRDIFF_MAX;
+    group->dirty_high = PTRDIFF_MIN;
+}
+
+/*
+ * Runs ops[from] up to (but excluding) ops[to] in one lane by itself, with
+ * its pointer starting at cell p.
+ *
+ * @return the lane's pointer afterwards.
+ */
+static ptrdiff_t run_lane(struct lane_group *group, size_t lane,
+        size_t from, size_t to, ptrdiff_t p) {
+    const struct bf_ir_op *ops = group->ir->ops;
+    size_t lanes = group->lanes;
+
+    /* The tape may move as it grows. */
+#define CELL(offset) ((uint8_t *) group->tape)[(group->origin + p + (offset)) \
+        * lanes + lane]
+    for (size_t i = from; i < to; i++) {
+        const struct bf_ir_op *op = &ops[i];
+
+        if (op->check) {
+            reach(group, op, p);
+        }
+
+        switch (op->kind) {
+            case BF_IR_ADD:
+                CELL(op->offset) += op->value;
+                break;
+            case BF_IR_SET:
+                CELL(op->offset) = op->value;
+                break;
+            case BF_IR_MUL:
+                CELL(op->offset) += CELL(0) * op->value;
+                break;
+            case BF_IR_MOVE:
+                p += op->value;
+                break;
+            case BF_IR_OUTPUT:
+                output_byte(group, lane, CELL(op->offset));
+                break;
+            case BF_IR_INPUT:
+                CELL(op->offset) = input_byte(group, lane);
+                break;
+            case BF_IR_LOOP:
+                if (CELL(0) == 0) {
+                    i = op->match;
+                }
+                break;
+            case BF_IR_END:
+                if (CELL(0) != 0) {
+                    i = op->match;
+                }
+                break;
+        }
+    }
+#undef CELL
+
+    return p;
+}
+
+static bool any_active(const lane_vector *mask, size_t vectors) {
+    for (size_t k = 0; k < vectors; k++) {
+        uint64_t halves[2];
+        memcpy(halves, &mask[k], sizeof(halves));
+        if (halves[0] | halves[1]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_active(const lane_vector *mask, size_t lane) {
+    return mask[lane / BF_LANES_PER_VECTOR][lane % BF_LANES_PER_VECTOR];
+}
+
+/* Restricts the mask to lanes whose cell is non-zero. */
+static void mask_nonzero(lane_vector *mask, const lane_vector *cell,
+        size_t vectors) {
+    for (size_t k = 0; k < vectors; k++) {
+        mask[k] &= (lane_vector) (cell[k] != 0);
+    }
+}
+
+/*
+ * Runs a loop that may leave lanes at different cells in each lane by
+ * itself. If the lanes meet again, returns true and sets *p to their common
+ * pointer; otherwise, runs the rest of the program in each lane and returns
+ * false.
+ */
+static bool diverge(struct lane_group *group, size_t loop, ptrdiff_t *p) {
+    size_t end = group->ir->ops[loop].match + 1;
+    ptrdiff_t pointers[BF_MAX_LANES];
+    bool converged = true;
+
+    for (size_t lane = 0; lane < group->live; lane++) {
+        pointers[lane] = run_lane(group, lane, loop, end, *p);
+        converged = converged && pointers[lane] == pointers[0];
+    }
+
+    if (converged) {
+        *p = pointers[0];
+        return true;
+    }
+
+    for (size_t lane = 0; lane < group->live; lane++) {
+        run_lane(group, lane, end, group->ir->length, pointers[lane]);
+    }
+    return false;
+}
+
+/* Runs the whole program in every live lane of the group. */
+static void run_group(struct lane_group *group) {
+    const bf_ir *ir = group->ir;
+    size_t vectors = group->vectors;
+    lane_vector mask[MAX_VECTORS] = { { 0 } };
+    lane_vector (*saved_masks)[MAX_VECTORS];
+    size_t depth = 0;
+    ptrdiff_t p = 0;
+
+    saved_masks = malloc((ir->max_depth + 1) * sizeof(*saved_masks));
+    if (saved_masks == NULL) {
+        abort();
+    }
+
+    for (size_t lane = 0; lane < group->live; lane++) {
+        mask[lane / BF_LANES_PER_VECTOR][lane % BF_LANES_PER_VECTOR] = 0xFF;
+    }
+
+    for (size_t i = 0; i < ir->length; i++) {
+        const struct bf_ir_op *op = &ir->ops[i];
+        uint8_t value = op->value;
+
+        if (op->check) {
+            reach(group, op, p);
+        }
+
+        lane_vector *cell =
+            &group->tape[(group->origin + p + op->offset) * vectors];
+        lane_vector *here = &group->tape[(group->origin + p) * vectors];
+
+        switch (op->kind) {
+            case BF_IR_ADD:
+                for (size_t k = 0; k < vectors; k++) {
+                    cell[k] += mask[k] & value;
+                }
+                break;
+
+            case BF_IR_SET:
+                for (size_t k = 0; k < vectors; k++) {
+                    cell[k] = (cell[k] & ~mask[k]) | (mask[k] & value);
+                }
+                break;
+
+            case BF_IR_MUL:
+                for (size_t k = 0; k < vectors; k++) {
+                    cell[k] += (here[k] * value) & mask[k];
+                }
+                break;
+
+            case BF_IR_MOVE:
+                p += op->value;
+                break;
+
+            case BF_IR_OUTPUT:
+                for (size_t lane = 0; lane < group->live; lane++) {
+                    if (is_active(mask, lane)) {
+                        output_byte(group, lane,
+                                ((uint8_t *) cell)[lane]);
+                    }
+                }
+                break;
+
+            case BF_IR_INPUT:
+                for (size_t lane = 0; lane < group->live; lane++) {
+                    if (is_active(mask, lane)) {
+                        ((uint8_t *) cell)[lane] = input_byte(group, lane);
+                    }
+                }
+                break;
+
+            case BF_IR_LOOP:
+                if (!group->balanced[i]) {
+                    /* Only balanced loops nest in balanced loops. */
+                    assert(depth == 0);
+                    if (!diverge(group, i, &p)) {
+                        free(saved_masks);
+                        return;
+                    }
+                    i = op->match;
+                    break;
+                }
+
+                memcpy(saved_masks[depth++], mask, sizeof(mask));
+                mask_nonzero(mask, here, vectors);
+                if (!any_active(mask, vectors)) {
+                    memcpy(mask, saved_masks[--depth], sizeof(mask));
+                    i = op->match;
+                }
+                break;
+
+            case BF_IR_END:
+                /* Lanes that leave the loop wait for the rest here. */
+                mask_nonzero(mask, here, vectors);
+                if (any_active(mask, vectors)) {
+                    i = op->match;
+                } else {
+                    memcpy(mask, saved_masks[--depth], sizeof(mask));
+                }
+                break;
+        }
+    }
+
+    free(saved_masks);
+}
+
+bool bf_lanes_run(const bf_ir *ir, size_t lanes, size_t universe_size,
+        const struct bf_lane_record *records, size_t count, FILE *stream,
+        bf_lanes_out_of_bounds out_of_bounds) {
+    assert(lanes > 0 && lanes <= BF_MAX_LANES);
+    assert(lanes % BF_LANES_PER_VECTOR == 0);
+
+    /*
+     * The points where bounds checks would go are where each group notes
+     * the cells it may touch, so that only those are cleared for the next.
+     */
+    bf_ir marked = *ir;
+    marked.ops = malloc(ir->length * sizeof(struct bf_ir_op));
+    if (marked.ops == NULL && ir->length > 0) {
+        abort();
+    }
+    memcpy(marked.ops, ir->ops, ir->length * sizeof(struct bf_ir_op));
+    bf_ir_place_bounds_checks(&marked);
+
+    struct lane_group group = {
+        .ir = &marked,
+        .balanced = bf_ir_balanced_loops(ir),
+        .lanes = lanes,
+        .vectors = lanes / BF_LANES_PER_VECTOR,
+        /* p starts in the middle, as it does in the universe. */
+        .cells = universe_size > 2 ? universe_size : 2,
+        .dirty_low = PTRDIFF_MAX,
+        .dirty_high = PTRDIFF_MIN,
+        .out_of_bounds = out_of_bounds,
+    };
+
+    group.origin = group.cells / 2;
+    group.tape = allocate_tape(group.cells, group.vectors);
+    if (group.tape == NULL) {
+        abort();
+    }
+
+    for (size_t first = 0; first < count; first += lanes) {
+        group.records = &records[first];
+        group.live = count - first < lanes ? count - first : lanes;
+        clear_dirty(&group);
+
+        for (size_t lane = 0; lane < group.live; lane++) {
+            group.input_position[lane] = 0;
+            group.output[lane].length = 0;
+        }
+
+        run_group(&group);
+
+        for (size_t lane = 0; lane < group.live; lane++) {
+            fwrite(group.output[lane].data, 1, group.output[lane].length,
+                    stream);
+        }
+    }
+
+    for (size_t lane = 0; lane < lanes; lane++) {
+        free(group.output[lane].data);
+    }
+    free(group.tape);
+    free((bool *) group.balanced);
+    bf_ir_free(&marked);
+
+    return !ferror(stream);
+}
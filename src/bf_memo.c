@@ -0,0 +1,172 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <bf_memo.h>
+
+/**
+ * Number of cached results per loop (a power of two). Each result lives in
+ * the slot chosen by the hash of its window; collisions evict.
+ */
+#define MEMO_SLOTS          1024
+/**
+ * After this many lookups, a loop whose hit rate is below 1 in
+ * MEMO_MIN_HIT_RATE is no longer memoized: hashing only slows it down.
+ */
+#define MEMO_TRIAL          1024
+#define MEMO_MIN_HIT_RATE   8
+
+/* The cache of one loop. */
+struct memo_loop {
+    int32_t window_low;
+    size_t window_size;
+    bool disabled;
+    uint64_t lookups;
+    uint64_t hits;
+
+    /* The window on entry to the run in progress, and its hash. */
+    bool pending;
+    uint32_t pending_hash;
+    uint8_t *pending_key;
+
+    /* MEMO_SLOTS slots of: valid byte, key window, result window. */
+    uint8_t *slots;
+};
+
+struct bf_memo {
+    uint8_t *universe;
+    size_t universe_size;
+    size_t length;
+    struct memo_loop loops[];
+};
+
+/* 32-bit FNV-1a. */
+static uint32_t hash_window(const uint8_t *window, size_t size) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ window[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+static size_t slot_size(const struct memo_loop *loop) {
+    return 1 + 2 * loop->window_size;
+}
+
+static uint8_t *slot_for(const struct memo_loop *loop, uint32_t hash) {
+    return loop->slots + (hash & (MEMO_SLOTS - 1)) * slot_size(loop);
+}
+
+/* Returns the window of the loop at p, or NULL if it is off the tape. */
+static uint8_t *window_at(struct bf_memo *memo, const struct memo_loop *loop,
+        uint8_t *p) {
+    ptrdiff_t start = (p - memo->universe) + loop->window_low;
+
+    if (start < 0 || (size_t) start + loop->window_size > memo->universe_size) {
+        return NULL;
+    }
+
+    return memo->universe + start;
+}
+
+struct bf_memo *bf_memo_create(const bf_ir *ir, uint8_t *universe,
+        size_t universe_size) {
+    size_t length = 0;
+
+    for (size_t i = 0; i < ir->length; i++) {
+        length += ir->ops[i].kind == BF_IR_LOOP && ir->ops[i].memoize;
+    }
+
+    if (length == 0) {
+        return NULL;
+    }
+
+    struct bf_memo *memo = calloc(1,
+            sizeof(struct bf_memo) + length * sizeof(struct memo_loop));
+    if (memo == NULL) {
+        abort();
+    }
+
+    memo->universe = universe;
+    memo->universe_size = universe_size;
+    memo->length = length;
+
+    size_t n = 0;
+    for (size_t i = 0; i < ir->length; i++) {
+        const struct bf_ir_op *op = &ir->ops[i];
+        if (op->kind != BF_IR_LOOP || !op->memoize) {
+            continue;
+        }
+
+        struct memo_loop *loop = &memo->loops[n++];
+        loop->window_low = op->window_low;
+        loop->window_size = op->window_high - op->window_low + 1;
+        loop->pending_key = malloc(loop->window_size);
+        loop->slots = calloc(MEMO_SLOTS, slot_size(loop));
+        if (loop->pending_key == NULL || loop->slots == NULL) {
+            abort();
+        }
+    }
+
+    return memo;
+}
+
+uint8_t bf_memo_enter(struct bf_memo *memo, uint32_t n, uint8_t *p) {
+    struct memo_loop *loop = &memo->loops[n];
+    uint8_t *window = window_at(memo, loop, p);
+
+    loop->pending = false;
+    if (loop->disabled || window == NULL) {
+        return 0;
+    }
+
+    uint32_t hash = hash_window(window, loop->window_size);
+    uint8_t *slot = slot_for(loop, hash);
+
+    loop->lookups++;
+    if (slot[0] && memcmp(slot + 1, window, loop->window_size) == 0) {
+        loop->hits++;
+        memcpy(window, slot + 1 + loop->window_size, loop->window_size);
+        return 1;
+    }
+
+    if (loop->lookups == MEMO_TRIAL
+            && loop->hits * MEMO_MIN_HIT_RATE < loop->lookups) {
+        loop->disabled = true;
+        return 0;
+    }
+
+    memcpy(loop->pending_key, window, loop->window_size);
+    loop->pending_hash = hash;
+    loop->pending = true;
+    return 0;
+}
+
+void bf_memo_leave(struct bf_memo *memo, uint32_t n, uint8_t *p) {
+    struct memo_loop *loop = &memo->loops[n];
+
+    if (!loop->pending) {
+        return;
+    }
+
+    uint8_t *slot = slot_for(loop, loop->pending_hash);
+    slot[0] = 1;
+    memcpy(slot + 1, loop->pending_key, loop->window_size);
+    memcpy(slot + 1 + loop->window_size, window_at(memo, loop, p),
+            loop->window_size);
+    loop->pending = false;
+}
+
+void bf_memo_free(struct bf_memo *memo) {
+    if (memo == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < memo->length; i++) {
+        free(memo->loops[i].pending_key);
+        free(memo->loops[i].slots);
+    }
+    free(memo);
+}
@@ -0,0 +1,371 @@
+/* For vmsplice() and F_SETPIPE_SZ. */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <bf_output.h>
+
+static struct {
+    enum { CLOSED, SPLICED, MAPPED, ASYNC } mode;
+    int fd;
+    bf_output_buffer buffer;
+
+    /* Spliced and async: where the output not yet handed over begins. */
+    uint8_t *pending;
+
+    /* Mapped: the offset of the window in the file, and the length of the
+     * output as of the last flush. */
+    off_t window;
+    off_t length;
+
+    /* Async: how much output has been handed to the writer thread, and how
+     * much it has written, all told; each is only ever stored by one side.
+     * The lock and the condition are just for sleeping on the other side,
+     * when the flag says so. */
+    atomic_size_t produced;
+    atomic_size_t consumed;
+    atomic_bool program_waiting;
+    atomic_bool writer_waiting;
+    atomic_bool closing;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t writer;
+
+    /* Async: whether the writer has to catch up before input, and the limit
+     * last handed to the program. */
+    bool interactive;
+    uint8_t *limit;
+
+    bool failed;
+} output = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * Maps memory aligned to its size, a huge page, so that it can be backed by
+ * one: the pages handed to a pipe are replaced with a single fault.
+ */
+static uint8_t *map_aligned(size_t size) {
+    uint8_t *reservation = mmap(NULL, 2 * size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reservation == MAP_FAILED) {
+        return NULL;
+    }
+
+    uint8_t *memory = (uint8_t *)
+        (((uintptr_t) reservation + size - 1) & ~(uintptr_t) (size - 1));
+    if (memory > reservation) {
+        munmap(reservation, memory - reservation);
+    }
+    munmap(memory + size, reservation + size - memory);
+
+#ifdef MADV_HUGEPAGE
+    madvise(memory, size, MADV_HUGEPAGE);
+#endif
+    return memory;
+}
+
+bool bf_output_splice(int fd, bf_output_buffer *buffer) {
+    struct stat status;
+
+    if (output.mode != CLOSED || fstat(fd, &status) != 0
+            || !S_ISFIFO(status.st_mode)) {
+        return false;
+    }
+
+    uint8_t *memory = map_aligned(BF_OUTPUT_SPLICE_SIZE);
+    if (memory == NULL) {
+        return false;
+    }
+
+    /* A pipe that holds the whole buffer takes it in one go, if allowed. */
+    fcntl(fd, F_SETPIPE_SZ, (int) BF_OUTPUT_SPLICE_SIZE);
+
+    output.mode = SPLICED;
+    output.fd = fd;
+    output.buffer = (bf_output_buffer) {
+        memory, memory + BF_OUTPUT_SPLICE_SIZE, memory + BF_OUTPUT_SPLICE_SIZE
+    };
+    output.pending = memory;
+    output.failed = false;
+
+    *buffer = output.buffer;
+    return true;
+}
+
+bool bf_output_map(int fd, bf_output_buffer *buffer) {
+    if (output.mode != CLOSED
+            || ftruncate(fd, BF_OUTPUT_WINDOW_SIZE) != 0) {
+        return false;
+    }
+
+    uint8_t *memory = mmap(NULL, BF_OUTPUT_WINDOW_SIZE, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+
+    output.mode = MAPPED;
+    output.fd = fd;
+    output.buffer = (bf_output_buffer) {
+        memory, memory + BF_OUTPUT_WINDOW_SIZE, memory + BF_OUTPUT_WINDOW_SIZE
+    };
+    output.window = 0;
+    output.length = 0;
+    output.failed = false;
+
+    *buffer = output.buffer;
+    return true;
+}
+
+/* Writes what could not be spliced; like putchar(), give up quietly. */
+static void write_rest(const uint8_t *next, const uint8_t *end) {
+    while (next < end) {
+        ssize_t written = write(output.fd, next, end - next);
+        if (written < 0 && errno != EINTR) {
+            output.failed = true;
+            return;
+        }
+        next += written > 0 ? written : 0;
+    }
+}
+
+/* How far the writer thread is behind the program. */
+static size_t backlog(void) {
+    return atomic_load(&output.produced) - atomic_load(&output.consumed);
+}
+
+/* Wakes the other side, if it is waiting on this one (or about to). */
+static void wake(atomic_bool *waiting) {
+    if (atomic_load(waiting)) {
+        pthread_mutex_lock(&output.lock);
+        pthread_cond_broadcast(&output.wake);
+        pthread_mutex_unlock(&output.lock);
+    }
+}
+
+/* Waits until the writer thread is no more than most behind. */
+static void catch_up(size_t most) {
+    if (backlog() <= most) {
+        return;
+    }
+
+    pthread_mutex_lock(&output.lock);
+    atomic_store(&output.program_waiting, true);
+    while (backlog() > most) {
+        pthread_cond_wait(&output.wake, &output.lock);
+    }
+    atomic_store(&output.program_waiting, false);
+    pthread_mutex_unlock(&output.lock);
+}
+
+/* The writer thread: writes the ring out as it fills, until it is closed. */
+static void *write_behind(void *unused) {
+    size_t size = output.buffer.end - output.buffer.start;
+    size_t consumed = 0;
+
+    (void) unused;
+    for (;;) {
+        /* Whatever was handed over before closing is written all the same. */
+        bool closing = atomic_load(&output.closing);
+        size_t produced = atomic_load(&output.produced);
+
+        if (produced == consumed) {
+            if (closing) {
+                return NULL;
+            }
+
+            pthread_mutex_lock(&output.lock);
+            atomic_store(&output.writer_waiting, true);
+            while (atomic_load(&output.produced) == consumed
+                    && !atomic_load(&output.closing)) {
+                pthread_cond_wait(&output.wake, &output.lock);
+            }
+            atomic_store(&output.writer_waiting, false);
+            pthread_mutex_unlock(&output.lock);
+            continue;
+        }
+
+        /* A chunk at a time, making room for the program as it goes. */
+        size_t at = consumed % size;
+        size_t length = produced - consumed;
+        if (length > size - at) {
+            length = size - at;
+        }
+        if (length > BF_OUTPUT_CHUNK_SIZE) {
+            length = BF_OUTPUT_CHUNK_SIZE;
+        }
+
+        write_rest(output.buffer.start + at, output.buffer.start + at + length);
+        consumed += length;
+        atomic_store(&output.consumed, consumed);
+        wake(&output.program_waiting);
+    }
+}
+
+bool bf_output_async(int fd, bf_output_buffer *buffer) {
+    struct stat status, input;
+
+    if (output.mode != CLOSED) {
+        return false;
+    }
+
+    uint8_t *memory = mmap(NULL, BF_OUTPUT_RING_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+
+    output.mode = ASYNC;
+    output.fd = fd;
+    output.buffer = (bf_output_buffer) {
+        memory, memory + BF_OUTPUT_RING_SIZE, memory + BF_OUTPUT_CHUNK_SIZE
+    };
+    output.pending = memory;
+    output.limit = output.buffer.limit;
+    output.failed = false;
+    atomic_store(&output.produced, 0);
+    atomic_store(&output.consumed, 0);
+    atomic_store(&output.closing, false);
+
+    /* A prompt has to be on screen before the answer is typed in. */
+    output.interactive = isatty(fd) && fstat(fd, &status) == 0
+        && fstat(STDIN_FILENO, &input) == 0 && isatty(STDIN_FILENO)
+        && status.st_rdev == input.st_rdev;
+
+    if (pthread_create(&output.writer, NULL, write_behind, NULL) != 0) {
+        munmap(memory, BF_OUTPUT_RING_SIZE);
+        output.mode = CLOSED;
+        return false;
+    }
+
+    *buffer = output.buffer;
+    return true;
+}
+
+static struct bf_output_space flush_spliced(uint8_t *start, uint8_t *cursor) {
+    struct iovec piece = { output.pending, cursor - output.pending };
+
+    while (piece.iov_len > 0) {
+        ssize_t spliced = vmsplice(output.fd, &piece, 1, SPLICE_F_GIFT);
+        if (spliced < 0) {
+            if (errno != EINTR) {
+                write_rest(piece.iov_base, cursor);
+                break;
+            }
+            continue;
+        }
+        piece.iov_base = (uint8_t *) piece.iov_base + spliced;
+        piece.iov_len -= spliced;
+    }
+
+    /* What follows in the same pages was never handed over. */
+    if (cursor < output.buffer.end) {
+        output.pending = cursor;
+        return (struct bf_output_space) { cursor, output.buffer.end };
+    }
+
+    /* The pipe has the pages now: write to fresh ones from here on. */
+    madvise(start, cursor - start, MADV_DONTNEED);
+    output.pending = start;
+    return (struct bf_output_space) { start, output.buffer.end };
+}
+
+static struct bf_output_space flush_mapped(uint8_t *start, uint8_t *cursor) {
+    /* The output is in the file already. */
+    output.length = output.window + (cursor - start);
+    if (cursor < output.buffer.end) {
+        return (struct bf_output_space) { cursor, output.buffer.end };
+    }
+
+    output.window += BF_OUTPUT_WINDOW_SIZE;
+    if (!output.failed
+            && ftruncate(output.fd, output.window + BF_OUTPUT_WINDOW_SIZE) == 0
+            && mmap(start, BF_OUTPUT_WINDOW_SIZE, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, output.fd, output.window)
+            != MAP_FAILED) {
+        return (struct bf_output_space) { start, output.buffer.end };
+    }
+
+    /* Let the program carry on, but its output is lost from here on. */
+    output.failed = true;
+    mmap(start, BF_OUTPUT_WINDOW_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    return (struct bf_output_space) { start, output.buffer.end };
+}
+
+static struct bf_output_space flush_async(uint8_t *start, uint8_t *cursor) {
+    size_t size = output.buffer.end - start;
+
+    atomic_store(&output.produced,
+            atomic_load(&output.produced) + (cursor - output.pending));
+    wake(&output.writer_waiting);
+
+    /* Flushed short of the limit: the program is about to read input. */
+    if (output.interactive && cursor < output.limit) {
+        catch_up(0);
+    }
+
+    if (cursor == output.buffer.end) {
+        cursor = start;
+    }
+
+    /* Only wait for room for the next chunk. */
+    size_t wanted = output.buffer.end - cursor;
+    if (wanted > BF_OUTPUT_CHUNK_SIZE) {
+        wanted = BF_OUTPUT_CHUNK_SIZE;
+    }
+    catch_up(size - wanted);
+
+    output.pending = cursor;
+    output.limit = cursor + wanted;
+    return (struct bf_output_space) { cursor, output.limit };
+}
+
+struct bf_output_space bf_output_flush(uint8_t *start, uint8_t *cursor) {
+    /* Nothing that stdio has buffered may come after this. */
+    fflush(stdout);
+
+    switch (output.mode) {
+        case SPLICED:
+            return flush_spliced(start, cursor);
+        case ASYNC:
+            return flush_async(start, cursor);
+        default:
+            return flush_mapped(start, cursor);
+    }
+}
+
+bool bf_output_close(void) {
+    size_t size = output.buffer.end - output.buffer.start;
+
+    if (output.mode == CLOSED) {
+        return true;
+    }
+
+    if (output.mode == ASYNC) {
+        pthread_mutex_lock(&output.lock);
+        atomic_store(&output.closing, true);
+        pthread_cond_broadcast(&output.wake);
+        pthread_mutex_unlock(&output.lock);
+        pthread_join(output.writer, NULL);
+    }
+
+    bool written = !output.failed;
+    munmap(output.buffer.start, size);
+    if (output.mode == MAPPED) {
+        written = ftruncate(output.fd, output.length) == 0 && written;
+    }
+
+    output.mode = CLOSED;
+    return written;
+}
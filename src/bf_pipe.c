@@ -0,0 +1,325 @@
+/* For pthread_attr_setaffinity_np() and CPU_SET(). */
+#define _GNU_SOURCE
+
+#include <immintrin.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <bf_pipe.h>
+
+/**
+ * How many times a stage that has a core to itself checks a ring before it
+ * goes to sleep on it.
+ */
+#define SPIN_LIMIT      (1 << 16)
+
+/* The output of one stage, on its way to the input of the next. */
+struct ring {
+    uint8_t *start;
+    uint8_t *end;
+
+    /* How much has been written to the ring and read from it, all told, and
+     * whether either side is done with it; each is only ever stored by one
+     * side. The lock and the condition are just for sleeping on the other
+     * side, when the flag says so. */
+    atomic_size_t produced;
+    atomic_size_t consumed;
+    atomic_bool writer_done;
+    atomic_bool reader_done;
+    atomic_bool writer_waiting;
+    atomic_bool reader_waiting;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+struct stage {
+    size_t index;
+    bf_pipe_stage run;
+    void *data;
+    pthread_t thread;
+    bool started;
+
+    /* The rings it reads and writes; NULL for the first and last stage. */
+    struct ring *input;
+    struct ring *output;
+    /* Input is copied out of the ring to here, where the program reads it. */
+    uint8_t *buffer;
+    /* Where the output not yet handed to the next stage begins. */
+    uint8_t *pending;
+
+    /* Whether it spins before it sleeps. */
+    bool spin;
+    /* Where it goes once its output is no longer read. */
+    jmp_buf stopped;
+};
+
+/* The stage the calling thread runs, if any. */
+static _Thread_local struct stage *current = NULL;
+
+/* How far the reader of the ring is behind its writer. */
+static size_t backlog(const struct ring *ring) {
+    return atomic_load(&ring->produced) - atomic_load(&ring->consumed);
+}
+
+/* Whether the writer may write when the reader is no more than most
+ * behind. */
+static bool has_room(const struct ring *ring, size_t most) {
+    return backlog(ring) <= most || atomic_load(&ring->reader_done);
+}
+
+static bool has_input(const struct ring *ring, size_t unused) {
+    (void) unused;
+    return backlog(ring) > 0 || atomic_load(&ring->writer_done);
+}
+
+/* Wakes the other side, if it is waiting on this one (or about to). */
+static void wake(struct ring *ring, atomic_bool *waiting) {
+    if (atomic_load(waiting)) {
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_broadcast(&ring->wake);
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
+
+/* Waits until ready(ring, most) holds, spinning first if it may. */
+static void wait_until(struct ring *ring,
+        bool (*ready)(const struct ring *, size_t), size_t most,
+        atomic_bool *waiting) {
+    for (int i = 0; current->spin && i < SPIN_LIMIT; i++) {
+        if (ready(ring, most)) {
+            return;
+        }
+        _mm_pause();
+    }
+
+    if (ready(ring, most)) {
+        return;
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    atomic_store(waiting, true);
+    while (!ready(ring, most)) {
+        pthread_cond_wait(&ring->wake, &ring->lock);
+    }
+    atomic_store(waiting, false);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/* Says that one side is done with the ring. */
+static void finish(struct ring *ring, atomic_bool *done, atomic_bool *waiting) {
+    atomic_store(done, true);
+    wake(ring, waiting);
+}
+
+static struct bf_output_space flush_ring(uint8_t *start, uint8_t *cursor) {
+    struct stage *stage = current;
+    struct ring *ring = stage->output;
+    size_t size = ring->end - ring->start;
+
+    atomic_store(&ring->produced,
+            atomic_load(&ring->produced) + (cursor - stage->pending));
+    wake(ring, &ring->reader_waiting);
+
+    if (cursor == ring->end) {
+        cursor = start;
+    }
+
+    /* Only wait for room for the next chunk. */
+    size_t wanted = ring->end - cursor;
+    if (wanted > BF_PIPE_CHUNK_SIZE) {
+        wanted = BF_PIPE_CHUNK_SIZE;
+    }
+    wait_until(ring, has_room, size - wanted, &ring->writer_waiting);
+
+    /* Nothing will ever read it: stop, as if killed by SIGPIPE. */
+    if (atomic_load(&ring->reader_done)) {
+        longjmp(stage->stopped, 1);
+    }
+
+    stage->pending = cursor;
+    return (struct bf_output_space) { cursor, cursor + wanted };
+}
+
+static uint8_t *fill_ring(uint8_t *start, uint8_t *end) {
+    struct ring *ring = current->input;
+    size_t size = ring->end - ring->start;
+
+    wait_until(ring, has_input, 0, &ring->reader_waiting);
+
+    /* Up to the end of the ring; the rest is for the next fill. */
+    size_t consumed = atomic_load(&ring->consumed);
+    size_t at = consumed % size;
+    size_t length = atomic_load(&ring->produced) - consumed;
+    if (length > (size_t) (end - start)) {
+        length = end - start;
+    }
+    if (length > size - at) {
+        length = size - at;
+    }
+
+    memcpy(start, ring->start + at, length);
+    atomic_store(&ring->consumed, consumed + length);
+    wake(ring, &ring->writer_waiting);
+
+    /* Nothing left once the writer is done: end-of-file. */
+    return start + length;
+}
+
+static void *run_stage(void *argument) {
+    struct stage *stage = argument;
+
+    current = stage;
+    if (setjmp(stage->stopped) == 0) {
+        stage->run(stage->index, stage->data);
+    }
+
+    /* Whatever it wrote is all there is; whatever it did not read, never
+     * will be. */
+    if (stage->output != NULL) {
+        finish(stage->output, &stage->output->writer_done,
+                &stage->output->reader_waiting);
+    }
+    if (stage->input != NULL) {
+        finish(stage->input, &stage->input->reader_done,
+                &stage->input->writer_waiting);
+    }
+    return NULL;
+}
+
+/* Pins the thread to the next of the allowed cores after *cpu. */
+static void pin(pthread_attr_t *attributes, const cpu_set_t *allowed,
+        int *cpu) {
+    cpu_set_t one;
+
+    do {
+        (*cpu)++;
+    } while (!CPU_ISSET(*cpu, allowed));
+
+    CPU_ZERO(&one);
+    CPU_SET(*cpu, &one);
+    pthread_attr_setaffinity_np(attributes, sizeof(one), &one);
+}
+
+bool bf_pipe_run(size_t count, bf_pipe_stage run, void *data) {
+    struct stage *stages = calloc(count, sizeof(*stages));
+    struct ring *rings = calloc(count, sizeof(*rings));
+    bool started = stages != NULL && rings != NULL;
+    cpu_set_t allowed;
+    int cpu = -1;
+
+    /* Spinning only pays off when the other side is running meanwhile. */
+    bool pinned = sched_getaffinity(0, sizeof(allowed), &allowed) == 0
+        && (size_t) CPU_COUNT(&allowed) >= count;
+
+    /* Ring i is between stage i and stage i + 1. */
+    for (size_t i = 0; started && i + 1 < count; i++) {
+        struct ring *ring = &rings[i];
+
+        ring->start = mmap(NULL, BF_PIPE_RING_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring->start == MAP_FAILED) {
+            ring->start = NULL;
+            started = false;
+            break;
+        }
+        ring->end = ring->start + BF_PIPE_RING_SIZE;
+        atomic_init(&ring->produced, 0);
+        atomic_init(&ring->consumed, 0);
+        atomic_init(&ring->writer_done, false);
+        atomic_init(&ring->reader_done, false);
+        atomic_init(&ring->writer_waiting, false);
+        atomic_init(&ring->reader_waiting, false);
+        pthread_mutex_init(&ring->lock, NULL);
+        pthread_cond_init(&ring->wake, NULL);
+    }
+
+    for (size_t i = 0; started && i < count; i++) {
+        struct stage *stage = &stages[i];
+
+        stage->index = i;
+        stage->run = run;
+        stage->data = data;
+        stage->input = i > 0 ? &rings[i - 1] : NULL;
+        stage->output = i + 1 < count ? &rings[i] : NULL;
+        stage->spin = pinned;
+        if (stage->input != NULL) {
+            stage->buffer = malloc(BF_PIPE_CHUNK_SIZE);
+            started = stage->buffer != NULL;
+        }
+    }
+
+    for (size_t i = 0; started && i < count; i++) {
+        pthread_attr_t attributes;
+
+        pthread_attr_init(&attributes);
+        if (pinned) {
+            pin(&attributes, &allowed, &cpu);
+        }
+        stages[i].started = pthread_create(&stages[i].thread, &attributes,
+                run_stage, &stages[i]) == 0;
+        pthread_attr_destroy(&attributes);
+
+        /* The stages already running see it as one that has finished. */
+        if (!stages[i].started) {
+            started = false;
+            if (stages[i].output != NULL) {
+                finish(stages[i].output, &stages[i].output->writer_done,
+                        &stages[i].output->reader_waiting);
+            }
+            if (stages[i].input != NULL) {
+                finish(stages[i].input, &stages[i].input->reader_done,
+                        &stages[i].input->writer_waiting);
+            }
+        }
+    }
+
+    for (size_t i = 0; stages != NULL && i < count; i++) {
+        if (stages[i].started) {
+            pthread_join(stages[i].thread, NULL);
+        }
+        free(stages[i].buffer);
+    }
+
+    for (size_t i = 0; rings != NULL && i + 1 < count; i++) {
+        if (rings[i].start != NULL) {
+            munmap(rings[i].start, BF_PIPE_RING_SIZE);
+            pthread_mutex_destroy(&rings[i].lock);
+            pthread_cond_destroy(&rings[i].wake);
+        }
+    }
+
+    free(stages);
+    free(rings);
+    return started;
+}
+
+enum bf_pipe_ends bf_pipe_connect(struct bf_runtime_context *context) {
+    struct stage *stage = current;
+    enum bf_pipe_ends ends = 0;
+
+    if (stage == NULL) {
+        return 0;
+    }
+
+    if (stage->input != NULL) {
+        context->input_start = stage->buffer;
+        context->input_end = stage->buffer + BF_PIPE_CHUNK_SIZE;
+        context->fill_input = fill_ring;
+        ends |= BF_PIPE_INPUT;
+    }
+
+    if (stage->output != NULL) {
+        stage->pending = stage->output->start;
+        context->output_start = stage->output->start;
+        context->output_end = stage->output->start + BF_PIPE_CHUNK_SIZE;
+        context->flush_output = flush_ring;
+        ends |= BF_PIPE_OUTPUT;
+    }
+
+    return ends;
+}
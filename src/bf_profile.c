@@ -0,0 +1,123 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <bf_profile.h>
+
+static const char profile_header[] =
+    "# brainmuk loop profile: source-offset entries iterations\n";
+
+size_t bf_profile_counter_count(const bf_ir *ir) {
+    size_t loops = 0;
+
+    for (size_t i = 0; i < ir->length; i++) {
+        if (ir->ops[i].kind == BF_IR_LOOP) {
+            loops++;
+        }
+    }
+
+    return 2 * loops;
+}
+
+bool bf_profile_write(const char *filename, const bf_ir *ir,
+        const uint64_t *counters) {
+    FILE *stream = fopen(filename, "w");
+    size_t loop_number = 0;
+
+    if (stream == NULL) {
+        return false;
+    }
+
+    fputs(profile_header, stream);
+
+    for (size_t i = 0; i < ir->length; i++) {
+        if (ir->ops[i].kind != BF_IR_LOOP) {
+            continue;
+        }
+
+        fprintf(stream, "%zu %" PRIu64 " %" PRIu64 "\n",
+                ir->ops[i].source_offset,
+                counters[2 * loop_number], counters[2 * loop_number + 1]);
+        loop_number++;
+    }
+
+    bool failed = ferror(stream);
+    return (fclose(stream) == 0) && !failed;
+}
+
+/* Sorts loop profiles by their source offset. */
+static int compare_loops(const void *a, const void *b) {
+    const struct bf_loop_profile *x = a, *y = b;
+    return (x->source_offset > y->source_offset)
+        - (x->source_offset < y->source_offset);
+}
+
+bool bf_profile_read(const char *filename, bf_profile *profile) {
+    FILE *stream = fopen(filename, "r");
+    size_t capacity = 0;
+    char line[256];
+
+    *profile = (bf_profile) { 0 };
+
+    if (stream == NULL) {
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), stream) != NULL) {
+        struct bf_loop_profile loop;
+
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+
+        if (sscanf(line, "%zu %" SCNu64 " %" SCNu64,
+                    &loop.source_offset, &loop.entries,
+                    &loop.iterations) != 3) {
+            bf_profile_free(profile);
+            fclose(stream);
+            return false;
+        }
+
+        if (profile->length >= capacity) {
+            capacity = capacity > 0 ? 2 * capacity : 64;
+            struct bf_loop_profile *loops =
+                realloc(profile->loops, capacity * sizeof(*loops));
+            if (loops == NULL) {
+                abort();
+            }
+            profile->loops = loops;
+        }
+
+        profile->loops[profile->length++] = loop;
+    }
+
+    fclose(stream);
+
+    qsort(profile->loops, profile->length, sizeof(*profile->loops),
+            compare_loops);
+    return true;
+}
+
+void bf_profile_apply(const bf_profile *profile, bf_ir *ir) {
+    for (size_t i = 0; i < ir->length; i++) {
+        struct bf_ir_op *op = &ir->ops[i];
+        struct bf_loop_profile key = { .source_offset = op->source_offset };
+
+        if (op->kind != BF_IR_LOOP) {
+            continue;
+        }
+
+        const struct bf_loop_profile *loop = bsearch(&key, profile->loops,
+                profile->length, sizeof(key), compare_loops);
+        if (loop != NULL) {
+            op->entries = loop->entries;
+            op->iterations = loop->iterations;
+        }
+    }
+}
+
+void bf_profile_free(bf_profile *profile) {
+    free(profile->loops);
+    *profile = (bf_profile) { 0 };
+}
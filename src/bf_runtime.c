@@ -1,4 +1,13 @@
+/* For splice() and copy_file_range(). */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <immintrin.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <bf_runtime.h>
 
@@ -21,3 +30,249 @@ uint8_t bf_runtime_input_byte() {
     }
     return c;
 }
+
+uint8_t bf_runtime_output_buffer[BF_RUNTIME_OUTPUT_BUFFER_SIZE];
+
+struct bf_output_space bf_runtime_flush_output(uint8_t *start, uint8_t *cursor) {
+    const uint8_t *next = start;
+
+    fflush(stdout);
+
+    /* Like putchar(), give up quietly if the output is gone. */
+    while (next < cursor) {
+        ssize_t written = write(STDOUT_FILENO, next, cursor - next);
+        if (written < 0 && errno != EINTR) {
+            break;
+        }
+        next += written > 0 ? written : 0;
+    }
+
+    return (struct bf_output_space) {
+        start, start + BF_RUNTIME_OUTPUT_BUFFER_SIZE
+    };
+}
+
+uint8_t bf_runtime_input_buffer[BF_RUNTIME_INPUT_BUFFER_SIZE];
+
+uint8_t *bf_runtime_fill_input(uint8_t *start, uint8_t *end) {
+    ssize_t bytes_read;
+
+    do {
+        bytes_read = read(STDIN_FILENO, start, end - start);
+    } while (bytes_read < 0 && errno == EINTR);
+
+    /* Like getchar(), an error is as good as end-of-file. */
+    return bytes_read > 0 ? start + bytes_read : start;
+}
+
+/*
+ * Copies shorter than this are not worth a system call of their own: they go
+ * through the output buffer with everything else.
+ */
+#define KERNEL_COPY_MINIMUM ((size_t) 16 * 1024)
+
+/* Set by bf_runtime_copy_in_kernel(); input is NULL until then. */
+static struct {
+    const uint8_t *input;
+    int in_fd;
+    off_t offset;
+    int out_fd;
+    bool splice;
+} kernel;
+
+void bf_runtime_copy_in_kernel(const uint8_t *input, int in_fd, off_t offset,
+        int out_fd) {
+    struct stat out;
+
+    kernel.input = NULL;
+    if (input == NULL || fstat(out_fd, &out) < 0
+            || !(S_ISFIFO(out.st_mode) || S_ISREG(out.st_mode))) {
+        return;
+    }
+
+    kernel.input = input;
+    kernel.in_fd = in_fd;
+    kernel.offset = offset;
+    kernel.out_fd = out_fd;
+    kernel.splice = S_ISFIFO(out.st_mode);
+}
+
+/* Empties the output buffer of a program, wherever it stands. */
+static void flush(struct bf_buffered_io *io,
+        const struct bf_runtime_context *context) {
+    struct bf_output_space space = context->flush_output(
+            context->output_start, io->output_cursor);
+
+    io->output_cursor = space.cursor;
+    io->output_limit = space.limit;
+}
+
+/*
+ * Has the kernel copy the input from the cursor up to stop straight to the
+ * output, after what is in the output buffer. Copies until it cannot; from
+ * then on, the kernel is left out.
+ *
+ * @return whether the input is copied up to stop.
+ */
+static bool copy_in_kernel(struct bf_buffered_io *io, const uint8_t *stop,
+        const struct bf_runtime_context *context) {
+    if (kernel.input == NULL || context->input_start != kernel.input
+            || (size_t) (stop - io->input_cursor) < KERNEL_COPY_MINIMUM) {
+        return false;
+    }
+
+    flush(io, context);
+    while (io->input_cursor < stop) {
+        off_t offset = kernel.offset + (io->input_cursor - kernel.input);
+        size_t length = stop - io->input_cursor;
+        ssize_t copied = kernel.splice
+            ? splice(kernel.in_fd, &offset, kernel.out_fd, NULL, length, 0)
+            : copy_file_range(kernel.in_fd, &offset, kernel.out_fd, NULL,
+                    length, 0);
+
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        /* Not between these two (say, across filesystems on an old kernel):
+         * the rest goes through the buffer. */
+        if (copied <= 0) {
+            kernel.input = NULL;
+            return false;
+        }
+        io->input_cursor += copied;
+    }
+    return true;
+}
+
+/* Writes table[byte] for every byte of [in, in + length) to out. */
+static void translate(uint8_t *out, const uint8_t *in, size_t length,
+        const uint8_t *table) {
+    for (size_t i = 0; i < length; i++) {
+        out[i] = table[in[i]];
+    }
+}
+
+/*
+ * Like translate(), but 16 bytes at a time: the table is 16 rows of 16, one
+ * for each high nibble, that pshufb looks the low nibbles up in. Only the
+ * rows that change anything are looked at.
+ */
+__attribute__((target("ssse3")))
+static void translate_ssse3(uint8_t *out, const uint8_t *in, size_t length,
+        const uint8_t *table) {
+    __m128i rows[16], highs[16];
+    size_t changed = 0, i = 0;
+
+    for (unsigned row = 0; row < 16; row++) {
+        for (unsigned byte = 16 * row; byte < 16 * row + 16; byte++) {
+            if (table[byte] != byte) {
+                rows[changed] = _mm_loadu_si128((const __m128i *) &table[16 * row]);
+                highs[changed++] = _mm_set1_epi8(row);
+                break;
+            }
+        }
+    }
+
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) &in[i]);
+        __m128i low = _mm_and_si128(bytes, nibble);
+        __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble);
+        __m128i result = bytes;
+
+        for (size_t row = 0; row < changed; row++) {
+            __m128i in_row = _mm_cmpeq_epi8(high, highs[row]);
+            __m128i looked_up = _mm_shuffle_epi8(rows[row], low);
+            result = _mm_or_si128(_mm_andnot_si128(in_row, result),
+                    _mm_and_si128(in_row, looked_up));
+        }
+
+        _mm_storeu_si128((__m128i *) &out[i], result);
+    }
+
+    translate(out + i, in + i, length - i, table);
+}
+
+void bf_runtime_copy_input(struct bf_buffered_io *io, uint8_t until,
+        const uint8_t *table, const struct bf_runtime_context *context) {
+    static int ssse3 = -1;
+
+    if (ssse3 < 0) {
+        ssse3 = __builtin_cpu_supports("ssse3");
+    }
+
+    for (;;) {
+        /* Whatever is asked for may depend on what was printed. */
+        if (io->input_cursor == io->input_limit) {
+            flush(io, context);
+            io->input_cursor = context->input_start;
+            io->input_limit = context->fill_input(context->input_start,
+                    context->input_end);
+            if (io->input_cursor == io->input_limit) {
+                return;
+            }
+        }
+
+        const uint8_t *found = memchr(io->input_cursor, until,
+                io->input_limit - io->input_cursor);
+        const uint8_t *stop = found != NULL ? found : io->input_limit;
+
+        /* Bytes copied as they are need not pass through here at all. */
+        if (table == NULL) {
+            copy_in_kernel(io, stop, context);
+        }
+
+        while (io->input_cursor < stop) {
+            size_t length = stop - io->input_cursor;
+            if (length > (size_t) (io->output_limit - io->output_cursor)) {
+                length = io->output_limit - io->output_cursor;
+            }
+
+            if (table == NULL) {
+                memcpy(io->output_cursor, io->input_cursor, length);
+            } else if (ssse3) {
+                translate_ssse3(io->output_cursor, io->input_cursor, length,
+                        table);
+            } else {
+                translate(io->output_cursor, io->input_cursor, length, table);
+            }
+            io->input_cursor += length;
+            io->output_cursor += length;
+
+            /* Never left at the limit, as by the program itself. */
+            if (io->output_cursor == io->output_limit) {
+                flush(io, context);
+            }
+        }
+
+        if (found != NULL) {
+            return;
+        }
+    }
+}
+
+void bf_runtime_write_output(struct bf_output_space *space,
+        const uint8_t *bytes, uint32_t length, bool repeat,
+        const struct bf_runtime_context *context) {
+    while (length > 0) {
+        size_t chunk = space->limit - space->cursor;
+        if (chunk > length) {
+            chunk = length;
+        }
+
+        if (repeat) {
+            memset(space->cursor, bytes[0], chunk);
+        } else {
+            memcpy(space->cursor, bytes, chunk);
+            bytes += chunk;
+        }
+        space->cursor += chunk;
+        length -= chunk;
+
+        /* Never left at the limit, as by the program itself. */
+        if (space->cursor == space->limit) {
+            *space = context->flush_output(context->output_start,
+                    space->cursor);
+        }
+    }
+}
@@ -1,4 +1,9 @@
+/* For posix_madvise(). */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
 #include <stddef.h>
+#include <string.h>
 
 #include <fcntl.h>
 #include <sys/mman.h>
@@ -7,6 +12,11 @@
 
 #include <bf_slurp.h>
 
+/**
+ * How much of a file slurp_chunks() reads at a time.
+ */
+#define SLURP_CHUNK_SIZE    ((size_t) 64 * 1024)
+
 char *slurp(const char* filename) {
     struct stat statbuf;
     int fd = -1;
@@ -68,3 +78,81 @@ bool unslurp(char *memory) {
 
     return false;
 }
+
+const uint8_t *slurp_input(int fd, size_t *length) {
+    struct stat statbuf;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    if (fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode)) {
+        return NULL;
+    }
+
+    /* Whatever was read already is not input any more. */
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset < 0 || offset >= statbuf.st_size) {
+        return NULL;
+    }
+
+    /* Mappings start on a page. */
+    off_t start = offset - offset % page;
+    uint8_t *memory = mmap(NULL, statbuf.st_size - start, PROT_READ,
+            MAP_PRIVATE, fd, start);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+
+    /* Programs read their input from start to end. */
+    posix_madvise(memory, statbuf.st_size - start, POSIX_MADV_SEQUENTIAL);
+
+    *length = statbuf.st_size - offset;
+    return memory + (offset - start);
+}
+
+bool unslurp_input(const uint8_t *input, size_t length) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t skipped = (uintptr_t) input % page;
+
+    return munmap((void *) (input - skipped), length + skipped) == 0;
+}
+
+bool slurpable(const char *filename) {
+    struct stat statbuf;
+
+    if (strcmp(filename, "-") == 0 || stat(filename, &statbuf) < 0) {
+        return false;
+    }
+
+    return S_ISREG(statbuf.st_mode) && statbuf.st_size > 0;
+}
+
+bool slurp_chunks(const char *filename,
+        bool (*consume)(const char *chunk, size_t length, void *data),
+        void *data) {
+    static char chunk[SLURP_CHUNK_SIZE];
+    bool from_stdin = strcmp(filename, "-") == 0;
+    int fd = from_stdin ? STDIN_FILENO : open(filename, O_RDONLY);
+    ssize_t length;
+
+    if (fd < 0) {
+        return false;
+    }
+
+    while ((length = read(fd, chunk, sizeof(chunk))) != 0) {
+        if (length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (!consume(chunk, length, data)) {
+            length = 0;
+            break;
+        }
+    }
+
+    if (!from_stdin) {
+        close(fd);
+    }
+
+    return length == 0;
+}
@@ -0,0 +1,266 @@
+/* For MAP_NORESERVE and REG_RIP. */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <bf_universe.h>
+
+/**
+ * Cells are committed this many bytes (a multiple of the page size) at a
+ * time, to avoid a fault for every page of a sequential scan.
+ */
+#define GROWTH_CHUNK    ((size_t) 1 << 20)
+/**
+ * Compiled code accesses cells at up to a 32-bit offset from p, so a guard
+ * region this large catches every access that strays from the universe.
+ */
+#define GUARD_SIZE      ((size_t) 1 << 32)
+/**
+ * bf_universe_reset() gives back to the system, rather than zeroing, the
+ * whole pages of ranges at least this large.
+ */
+#define RELEASE_SIZE    ((size_t) 256 * 1024)
+
+/*
+ * Faults are handled on the thread that caused them, so each thread watches
+ * a universe of its own; the handler stays installed for as long as any of
+ * them does.
+ */
+static _Thread_local bf_universe *watched = NULL;
+static bf_out_of_bounds_handler out_of_bounds = NULL;
+static struct sigaction previous_action;
+static size_t watchers = 0;
+static pthread_mutex_t watchers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uintptr_t round_down(uintptr_t value, size_t alignment) {
+    return value & ~(uintptr_t) (alignment - 1);
+}
+
+static uintptr_t round_up(uintptr_t value, size_t alignment) {
+    return round_down(value + alignment - 1, alignment);
+}
+
+bool bf_universe_create(bf_universe *universe, size_t initial_size,
+        size_t maximum_size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t half = round_up(maximum_size, GROWTH_CHUNK);
+    size_t initial = round_up((initial_size + 1) / 2, page);
+
+    if (initial > half) {
+        initial = half;
+    }
+
+    universe->guard = GUARD_SIZE;
+    universe->file_backed = false;
+    universe->reserved = 2 * universe->guard + 2 * half;
+    universe->reservation = mmap(NULL, universe->reserved, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (universe->reservation == MAP_FAILED) {
+        return false;
+    }
+
+    universe->origin = universe->reservation + universe->guard + half;
+    universe->low = universe->origin - initial;
+    universe->high = universe->origin + initial;
+
+    if (mprotect(universe->low, universe->high - universe->low,
+                PROT_READ | PROT_WRITE) != 0) {
+        munmap(universe->reservation, universe->reserved);
+        return false;
+    }
+
+    return true;
+}
+
+/* Finds how many cells a universe file has, extending it if it is empty. */
+static bool file_size(int fd, size_t *size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    struct stat status;
+
+    if (fstat(fd, &status) != 0) {
+        return false;
+    }
+
+    if (status.st_size == 0) {
+        *size = 2 * round_up((*size + 1) / 2, page);
+        return ftruncate(fd, *size) == 0;
+    }
+
+    /* p starts in the middle, on a page boundary. */
+    if (status.st_size % (2 * page) != 0) {
+        errno = EINVAL;
+        return false;
+    }
+
+    *size = status.st_size;
+    return true;
+}
+
+bool bf_universe_create_from_file(bf_universe *universe, const char *filename,
+        size_t size) {
+    int fd = open(filename, O_RDWR | O_CREAT, 0666);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    if (!file_size(fd, &size)) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return false;
+    }
+
+    universe->guard = GUARD_SIZE;
+    universe->file_backed = true;
+    universe->reserved = 2 * universe->guard + size;
+    universe->reservation = mmap(NULL, universe->reserved, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (universe->reservation == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    /* The file replaces everything between the guards; the mapping keeps
+     * it open. */
+    universe->low = bf_universe_start(universe);
+    universe->high = universe->low + size;
+    universe->origin = universe->low + size / 2;
+
+    if (mmap(universe->low, size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        int error = errno;
+        close(fd);
+        munmap(universe->reservation, universe->reserved);
+        errno = error;
+        return false;
+    }
+
+    close(fd);
+    return true;
+}
+
+uint8_t *bf_universe_start(const bf_universe *universe) {
+    return universe->reservation + universe->guard;
+}
+
+size_t bf_universe_size(const bf_universe *universe) {
+    return universe->reserved - 2 * universe->guard;
+}
+
+/* Makes the cell accessible, along with everything between it and the
+ * accessible cells. */
+static bool grow(bf_universe *universe, uint8_t *cell) {
+    uint8_t *start = bf_universe_start(universe);
+    uint8_t *end = start + bf_universe_size(universe);
+
+    if (cell < universe->low) {
+        uint8_t *low = (uint8_t *) round_down((uintptr_t) cell, GROWTH_CHUNK);
+        low = low < start ? start : low;
+        if (mprotect(low, universe->low - low, PROT_READ | PROT_WRITE) != 0) {
+            return false;
+        }
+        universe->low = low;
+    } else {
+        uint8_t *high = (uint8_t *) round_up((uintptr_t) cell + 1, GROWTH_CHUNK);
+        high = high > end ? end : high;
+        if (mprotect(universe->high, high - universe->high,
+                    PROT_READ | PROT_WRITE) != 0) {
+            return false;
+        }
+        universe->high = high;
+    }
+
+    return true;
+}
+
+static void handle_fault(int signal, siginfo_t *info, void *context) {
+    uint8_t *address = info->si_addr;
+    bf_universe *universe = watched;
+    (void) signal;
+
+    if (universe != NULL && address >= universe->reservation
+            && address < universe->reservation + universe->reserved) {
+        uint8_t *start = bf_universe_start(universe);
+
+        if (address >= start && address < start + bf_universe_size(universe)
+                && grow(universe, address)) {
+            /* Retry the access. */
+            return;
+        }
+
+        if (out_of_bounds != NULL) {
+            const ucontext_t *registers = context;
+            out_of_bounds((const void *) registers->uc_mcontext.gregs[REG_RIP],
+                    address - universe->origin, registers);
+        }
+    }
+
+    /* Not ours: crash as if we were never here. */
+    sigaction(SIGSEGV, &previous_action, NULL);
+}
+
+void bf_universe_watch(bf_universe *universe, bf_out_of_bounds_handler handler) {
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = handle_fault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+
+    /* Keep the action we replaced the first time. */
+    pthread_mutex_lock(&watchers_lock);
+    if (watched == NULL && watchers++ == 0) {
+        sigaction(SIGSEGV, &action, &previous_action);
+    }
+    watched = universe;
+    out_of_bounds = handler;
+    pthread_mutex_unlock(&watchers_lock);
+}
+
+void bf_universe_reset(bf_universe *universe, uint8_t *low, uint8_t *high) {
+    low = low > universe->low ? low : universe->low;
+    high = high < universe->high ? high : universe->high;
+
+    if (low >= high) {
+        return;
+    }
+
+    /* Released pages of a file read back what was last written. */
+    if ((size_t) (high - low) >= RELEASE_SIZE && !universe->file_backed) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        uint8_t *first = (uint8_t *) round_up((uintptr_t) low, page);
+        uint8_t *last = (uint8_t *) round_down((uintptr_t) high, page);
+
+        /* Private anonymous pages read as zero once they are released. */
+        if (madvise(first, last - first, MADV_DONTNEED) == 0) {
+            memset(low, 0, first - low);
+            memset(last, 0, high - last);
+            return;
+        }
+    }
+
+    memset(low, 0, high - low);
+}
+
+void bf_universe_destroy(bf_universe *universe) {
+    pthread_mutex_lock(&watchers_lock);
+    if (watched == universe) {
+        watched = NULL;
+        if (--watchers == 0) {
+            sigaction(SIGSEGV, &previous_action, NULL);
+            out_of_bounds = NULL;
+        }
+    }
+    pthread_mutex_unlock(&watchers_lock);
+
+    munmap(universe->reservation, universe->reserved);
+}
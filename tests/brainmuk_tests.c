@@ -1,4 +1,7 @@
 #include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <setjmp.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -6,8 +9,18 @@
 
 #include <bf_alloc.h>
 #include <bf_arguments.h>
+#include <bf_cache.h>
 #include <bf_compile.h>
+#include <bf_emit.h>
+#include <bf_ir.h>
+#include <bf_lanes.h>
+#include <bf_memo.h>
+#include <bf_output.h>
+#include <bf_pipe.h>
+#include <bf_profile.h>
+#include <bf_runtime.h>
 #include <bf_slurp.h>
+#include <bf_universe.h>
 
 /*********************** tests for parse_arguments() ***********************/
 
@@ -108,11 +121,170 @@ TEST parses_absence_of_filename() {
 }
 
 
+TEST parses_emit_target() {
+    bf_options options = parse_arguments(2, (char *[]) {
+            "brainmuk", "hi.bf", NULL
+    });
+    ASSERT_EQm("JIT should be the default", BF_EMIT_JIT, options.emit);
+    ASSERT(options.output_filename == NULL);
+
+    options = parse_arguments(5, (char *[]) {
+            "brainmuk", "--emit=exe", "-o", "hi", "hi.bf", NULL
+    });
+    ASSERT_EQm("--emit=exe", BF_EMIT_EXE, options.emit);
+    ASSERT_STR_EQm("Unexpected output filename", "hi", options.output_filename);
+    ASSERT_STR_EQm("Unexpected filename", "hi.bf", options.filename);
+
+    options = parse_arguments(3, (char *[]) {
+            "brainmuk", "--emit", "c", NULL
+    });
+    ASSERT_EQm("--emit c", BF_EMIT_C, options.emit);
+
+    options = parse_arguments(4, (char *[]) {
+            "brainmuk", "--emit=obj", "--symbol=rot13", "rot13.bf", NULL
+    });
+    ASSERT_EQm("--emit=obj", BF_EMIT_OBJ, options.emit);
+    ASSERT_STR_EQm("Unexpected symbol", "rot13", options.symbol);
+
+    PASS();
+}
+
+TEST parses_optimization_options() {
+    bf_options options = parse_arguments(1, (char *[]) {
+            "brainmuk", NULL
+    });
+    ASSERT_EQ_FMT(BF_DEFAULT_OPTIMIZATION, options.optimization_level, "%d");
+    ASSERT_EQ(bf_ir_passes_for_level(BF_DEFAULT_OPTIMIZATION), options.passes);
+    ASSERT_FALSE(options.report_passes);
+
+    options = parse_arguments(2, (char *[]) {
+            "brainmuk", "-O0", NULL
+    });
+    ASSERT_EQ_FMT(0, options.optimization_level, "%d");
+    ASSERT_EQm("-O0 runs no passes", (bf_pass_set) 0, options.passes);
+
+    /* --passes adjusts the level, regardless of where it is. */
+    options = parse_arguments(4, (char *[]) {
+            "brainmuk", "--passes=-fold,+multiply", "-O1", "--report-passes",
+            NULL
+    });
+    ASSERT_EQ_FMT(1, options.optimization_level, "%d");
+    ASSERT(options.passes & BF_PASS_MULTIPLY);
+    ASSERT(options.passes & BF_PASS_CLEAR);
+    ASSERT_FALSE(options.passes & BF_PASS_FOLD);
+    ASSERT_FALSE(options.passes & BF_PASS_OFFSET);
+    ASSERT(options.report_passes);
+
+    options = parse_arguments(2, (char *[]) {
+            "brainmuk", "--passes=none,dead", NULL
+    });
+    ASSERT_EQ(BF_PASS_DEAD, options.passes);
+
+    PASS();
+}
+
+TEST parses_lanes() {
+    bf_options options = parse_arguments(2, (char *[]) {
+            "brainmuk", "records.bf", NULL
+    });
+    ASSERT_EQ_FMT((size_t) 0, options.lanes, "%zu");
+
+    options = parse_arguments(3, (char *[]) {
+            "brainmuk", "--lanes=32", "records.bf", NULL
+    });
+    ASSERT_EQ_FMT((size_t) 32, options.lanes, "%zu");
+    ASSERT_STR_EQ("records.bf", options.filename);
+
+    PASS();
+}
+
+TEST parses_tape_mode() {
+    bf_options options = parse_arguments(1, (char *[]) {
+            "brainmuk", NULL
+    });
+    ASSERT_EQ(BF_TAPE_GROW, options.tape);
+
+    options = parse_arguments(4, (char *[]) {
+            "brainmuk", "--tape=wrap", "-m", "3k", NULL
+    });
+    ASSERT_EQ(BF_TAPE_WRAP, options.tape);
+    ASSERT_EQ_FMTm("Size is not rounded to a power of two",
+            (size_t) 4096, options.minimum_universe_size, "%zu");
+    ASSERT_FALSEm("Offsets could alias on a circular tape",
+            options.passes & BF_PASS_OFFSET);
+    ASSERT_FALSE(options.bounds_check);
+
+    options = parse_arguments(2, (char *[]) {
+            "brainmuk", "--bounds-check", NULL
+    });
+    ASSERT(options.bounds_check);
+
+    PASS();
+}
+
+TEST parses_fork_inputs() {
+    bf_options options = parse_arguments(5, (char *[]) {
+            "brainmuk", "--fork", "foo.bf", "a.txt", "b.txt", NULL
+    });
+
+    ASSERT(options.fork);
+    ASSERT_STR_EQ("foo.bf", options.filename);
+    ASSERT_EQ_FMT((size_t) 2, options.input_count, "%zu");
+    ASSERT_STR_EQ("a.txt", options.inputs[0]);
+    ASSERT_STR_EQ("b.txt", options.inputs[1]);
+    ASSERT(options.cache);
+
+    options = parse_arguments(3, (char *[]) {
+            "brainmuk", "--no-cache", "foo.bf", NULL
+    });
+    ASSERT_FALSE(options.cache);
+    ASSERT_FALSE(options.dual_map);
+    ASSERT_EQ(NULL, options.input_filename);
+
+    options = parse_arguments(3, (char *[]) {
+            "brainmuk", "--dual-map", "foo.bf", NULL
+    });
+    ASSERT(options.dual_map);
+
+    options = parse_arguments(3, (char *[]) {
+            "brainmuk", "--input=a.txt", "foo.bf", NULL
+    });
+    ASSERT_STR_EQ("a.txt", options.input_filename);
+
+    PASS();
+}
+
+TEST parses_pipe_stages() {
+    bf_options options = parse_arguments(5, (char *[]) {
+            "brainmuk", "--pipe", "a.bf", "b.bf", "c.bf", NULL
+    });
+
+    ASSERT(options.pipe);
+    ASSERT_STR_EQ("a.bf", options.filename);
+    ASSERT_EQ_FMT((size_t) 3, options.stage_count, "%zu");
+    ASSERT_STR_EQ("a.bf", options.stages[0]);
+    ASSERT_STR_EQ("c.bf", options.stages[2]);
+
+    options = parse_arguments(2, (char *[]) {
+            "brainmuk", "a.bf", NULL
+    });
+    ASSERT_FALSE(options.pipe);
+    ASSERT_EQ_FMT((size_t) 0, options.stage_count, "%zu");
+
+    PASS();
+}
+
 SUITE(argument_parsing_suite) {
     RUN_TEST(parses_unsuffixed_minimum_size);
     RUN_TEST(parses_suffixed_minimum_size);
     RUN_TEST(parses_filename);
     RUN_TEST(parses_absence_of_filename);
+    RUN_TEST(parses_emit_target);
+    RUN_TEST(parses_optimization_options);
+    RUN_TEST(parses_lanes);
+    RUN_TEST(parses_tape_mode);
+    RUN_TEST(parses_fork_inputs);
+    RUN_TEST(parses_pipe_stages);
 }
 
 /********************* tests for slurp() and unslurp() *********************/
@@ -132,8 +304,426 @@ TEST normal_file_can_be_slurped_and_unslurped() {
 #undef test_filename
 }
 
+TEST rest_of_input_can_be_mapped() {
+#define test_filename __FILE__ ".fixtures/normal"
+    char skipped[4];
+    size_t length = 0;
+    int fd = open(test_filename, O_RDONLY);
+
+    ASSERTm("Could not open " test_filename, fd >= 0);
+    ASSERT_EQ(4, read(fd, skipped, sizeof(skipped)));
+
+    const uint8_t *input = slurp_input(fd, &length);
+    close(fd);
+
+    ASSERTm("Could not map " test_filename, input != NULL);
+    ASSERT_EQ_FMT((size_t) 19, length, "%zu");
+    ASSERT_EQ(0, memcmp("I'm a normal file.\n", input, length));
+    ASSERT(unslurp_input(input, length));
+
+    PASS();
+#undef test_filename
+}
+
 SUITE(slurp_suite) {
     RUN_TEST(normal_file_can_be_slurped_and_unslurped);
+    RUN_TEST(rest_of_input_can_be_mapped);
+}
+
+/*********************** tests for the IR and emitters ***********************/
+
+TEST parsing_folds_runs() {
+    bf_ir ir;
+    ASSERT(bf_ir_parse("+++ comment >>-<.", &ir));
+
+    ASSERT_EQ_FMTm("Unexpected number of ops", (size_t) 5, ir.length, "%zu");
+    ASSERT_EQ(BF_IR_ADD, ir.ops[0].kind);
+    ASSERT_EQ_FMT(3, ir.ops[0].value, "%d");
+    ASSERT_EQ(BF_IR_MOVE, ir.ops[1].kind);
+    ASSERT_EQ_FMT(2, ir.ops[1].value, "%d");
+    ASSERT_EQ(BF_IR_ADD, ir.ops[2].kind);
+    ASSERT_EQ_FMTm("Subtraction should wrap", 0xFF, ir.ops[2].value, "%d");
+    ASSERT_EQ(BF_IR_OUTPUT, ir.ops[4].kind);
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
+TEST parsing_locates_unmatched_brackets() {
+    bf_ir ir;
+    ASSERT_FALSE(bf_ir_parse("+[\n-]]", &ir));
+    ASSERT_EQ_FMT(2lu, ir.err_line, "%lu");
+    ASSERT_EQ_FMT(3lu, ir.err_col, "%lu");
+    bf_ir_free(&ir);
+
+    ASSERT_FALSE(bf_ir_parse("[[]", &ir));
+    ASSERT_EQ_FMT(1lu, ir.err_line, "%lu");
+    ASSERT_EQ_FMT(1lu, ir.err_col, "%lu");
+    bf_ir_free(&ir);
+
+    PASS();
+}
+
+TEST optimizer_lowers_simple_loops() {
+    bf_ir ir;
+    ASSERT(bf_ir_parse("[dead]+[-]++>+++[->++>+<<]", &ir));
+    bf_ir_optimize(&ir);
+
+    /* *p = 2; p++; *p += 3; *(p+1) += *p * 2; *(p+2) += *p; *p = 0 */
+    ASSERT_EQ_FMTm("Unexpected number of ops", (size_t) 6, ir.length, "%zu");
+    ASSERT_EQ(BF_IR_SET, ir.ops[0].kind);
+    ASSERT_EQ_FMT(2, ir.ops[0].value, "%d");
+    ASSERT_EQ(BF_IR_ADD, ir.ops[1].kind);
+    ASSERT_EQ_FMT(1, ir.ops[1].offset, "%d");
+    ASSERT_EQ(BF_IR_MOVE, ir.ops[2].kind);
+    ASSERT_EQ(BF_IR_MUL, ir.ops[3].kind);
+    ASSERT_EQ_FMT(1, ir.ops[3].offset, "%d");
+    ASSERT_EQ_FMT(2, ir.ops[3].value, "%d");
+    ASSERT_EQ(BF_IR_MUL, ir.ops[4].kind);
+    ASSERT_EQ(BF_IR_SET, ir.ops[5].kind);
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
+TEST emits_c_source() {
+    bf_ir ir;
+    char buffer[1024] = { 0 };
+    FILE *stream = tmpfile();
+    ASSERT(stream != NULL);
+
+    ASSERT(bf_ir_parse(",[.,]", &ir));
+    ASSERT(bf_emit_c(&ir, 30000, stream));
+    bf_ir_free(&ir);
+
+    rewind(stream);
+    fread(buffer, 1, sizeof(buffer) - 1, stream);
+    fclose(stream);
+
+    ASSERT(strstr(buffer, "calloc(60000, sizeof(uint8_t))") != NULL);
+    ASSERT(strstr(buffer, "uint8_t *p = universe + 30000;") != NULL);
+    ASSERT(strstr(buffer, "    while (p[0]) {\n"
+                          "        putchar(p[0]);\n"
+                          "        p[0] = input();\n"
+                          "    }\n") != NULL);
+
+    PASS();
+}
+
+TEST emits_elf_object() {
+    static const uint8_t code[] = { 0xc3 };
+    char buffer[1024] = { 0 };
+    FILE *stream = tmpfile();
+    ASSERT(stream != NULL);
+
+    ASSERT(bf_emit_object(code, sizeof(code), "transform", stream));
+
+    rewind(stream);
+    size_t size = fread(buffer, 1, sizeof(buffer), stream);
+    fclose(stream);
+
+    ASSERT(size > 64);
+    ASSERT_EQm("Missing ELF magic", 0, memcmp(buffer, "\x7f" "ELF", 4));
+    ASSERT_EQm("Not a relocatable object", 1, buffer[16]);
+
+    bool found_symbol = false;
+    for (size_t i = 0; i + 11 <= size; i++) {
+        found_symbol |= memcmp(buffer + i, "\0transform\0", 11) == 0;
+    }
+    ASSERTm("Missing symbol name", found_symbol);
+
+    PASS();
+}
+
+TEST emits_header_with_the_runtime_context() {
+    char buffer[4096] = { 0 };
+    FILE *stream = tmpfile();
+    ASSERT(stream != NULL);
+
+    ASSERT(bf_emit_header("transform", stream));
+
+    rewind(stream);
+    fread(buffer, 1, sizeof(buffer) - 1, stream);
+    fclose(stream);
+
+    ASSERT(strstr(buffer, "#ifndef TRANSFORM_H\n") != NULL);
+    ASSERT(strstr(buffer, "struct bf_runtime_context {\n"
+                          "    uint8_t *universe;\n"
+                          "    void (*output_byte)(uint8_t);\n") != NULL);
+    ASSERT(strstr(buffer, "    struct bf_dirty_range *dirty;\n") != NULL);
+    ASSERT(strstr(buffer, "void transform(struct bf_runtime_context "
+                          "context);\n") != NULL);
+
+    PASS();
+}
+
+TEST profile_is_applied_by_source_offset() {
+#define test_filename __FILE__ ".fixtures/profile"
+    bf_profile profile;
+    bf_ir ir;
+
+    ASSERTm("Could not read " test_filename,
+            bf_profile_read(test_filename, &profile));
+    ASSERT_EQ_FMT((size_t) 2, profile.length, "%zu");
+
+    /* Loops are at source offsets 1, 4, and 10. */
+    ASSERT(bf_ir_parse("+[>,[-.]<-[<]]", &ir));
+    bf_profile_apply(&profile, &ir);
+    bf_profile_free(&profile);
+
+    ASSERT_EQ(BF_IR_LOOP, ir.ops[1].kind);
+    ASSERT_EQ_FMT((uint64_t) 1, ir.ops[1].entries, "%" PRIu64);
+    ASSERT_EQ_FMT((uint64_t) 5000, ir.ops[1].iterations, "%" PRIu64);
+    ASSERT_EQ(BF_IR_LOOP, ir.ops[4].kind);
+    ASSERT_EQ_FMT((uint64_t) 7, ir.ops[4].entries, "%" PRIu64);
+    ASSERT_EQ(BF_IR_LOOP, ir.ops[10].kind);
+    ASSERT_EQ_FMTm("Loop without profile changed",
+            (uint64_t) 0, ir.ops[10].entries, "%" PRIu64);
+
+    bf_ir_free(&ir);
+    PASS();
+#undef test_filename
+}
+
+TEST runs_only_selected_passes() {
+    bf_ir ir;
+    bf_pass_set passes = 0;
+    ASSERT(bf_ir_parse("+>[-]<[->+<]", &ir));
+
+    ASSERT(bf_ir_parse_passes("clear", &passes));
+    ASSERT_FALSE(bf_ir_parse_passes("clear,bogus", &passes));
+    bf_ir_run_passes(&ir, BF_PASS_CLEAR, NULL);
+
+    /* The clear loop is lowered; the multiply loop is not. */
+    ASSERT_EQ_FMT((size_t) 10, ir.length, "%zu");
+    ASSERT_EQ(BF_IR_SET, ir.ops[2].kind);
+    ASSERT_EQ(BF_IR_LOOP, ir.ops[4].kind);
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
+TEST marks_expensive_pure_loops_for_memoization() {
+    bf_ir ir;
+    ASSERT(bf_ir_parse(",[>[>++++[>++++[>++++[>+<-]<-]<-]<-]>>>>.<<<<<,]",
+                &ir));
+    bf_ir_run_passes(&ir, BF_PASS_ALL, NULL);
+
+    /* The outer loop does I/O; the one in the middle is pure. */
+    ASSERT_EQ(BF_IR_LOOP, ir.ops[1].kind);
+    ASSERT_FALSE(ir.ops[1].memoize);
+    ASSERT_EQ(BF_IR_LOOP, ir.ops[3].kind);
+    ASSERT(ir.ops[3].memoize);
+    ASSERT_EQ_FMT(0, ir.ops[3].window_low, "%d");
+    ASSERT_EQ_FMT(4, ir.ops[3].window_high, "%d");
+
+    bf_ir_free(&ir);
+
+    /* Cheap loops are not worth the lookup. */
+    ASSERT(bf_ir_parse("+[>+++[>+<-]<-]", &ir));
+    bf_ir_run_passes(&ir, BF_PASS_ALL, NULL);
+    ASSERT_FALSE(ir.ops[1].memoize);
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
+TEST finds_pointer_range_and_places_bounds_checks() {
+    int64_t low, high;
+    bf_ir ir;
+    size_t checks = 0;
+
+    /* Balanced loops are checked along with everything around them. */
+    ASSERT(bf_ir_parse("+[>+<-]>>.", &ir));
+    ASSERT(bf_ir_pointer_range(&ir, &low, &high));
+    ASSERT_EQ_FMT((int64_t) 0, low, "%" PRId64);
+    ASSERT_EQ_FMT((int64_t) 2, high, "%" PRId64);
+
+    bf_ir_place_bounds_checks(&ir);
+    ASSERT(ir.ops[0].check);
+    ASSERT_EQ_FMT(0, ir.ops[0].check_low, "%d");
+    ASSERT_EQ_FMT(2, ir.ops[0].check_high, "%d");
+    for (size_t i = 1; i < ir.length; i++) {
+        ASSERT_FALSE(ir.ops[i].check);
+    }
+    bf_ir_free(&ir);
+
+    /* The body of an unbalanced loop, and what follows, are on their own. */
+    ASSERT(bf_ir_parse("+[>+]<.", &ir));
+    ASSERT_FALSE(bf_ir_pointer_range(&ir, &low, &high));
+
+    bf_ir_place_bounds_checks(&ir);
+    ASSERT(ir.ops[0].check);
+    ASSERT_EQ_FMT(0, ir.ops[0].check_high, "%d");
+    ASSERT_EQ(BF_IR_MOVE, ir.ops[2].kind);
+    ASSERT(ir.ops[2].check);
+    ASSERT_EQ_FMT(1, ir.ops[2].check_low, "%d");
+    ASSERT_EQ_FMT(1, ir.ops[2].check_high, "%d");
+    ASSERT(ir.ops[5].check);
+    ASSERT_EQ_FMT(-1, ir.ops[5].check_low, "%d");
+
+    for (size_t i = 0; i < ir.length; i++) {
+        checks += ir.ops[i].check;
+    }
+    ASSERT_EQ_FMT((size_t) 3, checks, "%zu");
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
+TEST parsing_in_chunks_matches_parsing_whole() {
+    const char *source = "++ [>+++\n<-]>.";
+    bf_ir whole, chunked;
+    bf_ir_parser parser;
+
+    ASSERT(bf_ir_parse(source, &whole));
+
+    /* Split runs and brackets across chunks of a character at a time. */
+    bf_ir_parser_init(&parser);
+    for (size_t i = 0; source[i] != '\0'; i++) {
+        ASSERT(bf_ir_parse_chunk(&parser, &source[i], 1));
+    }
+    ASSERT(bf_ir_parse_finish(&parser, &chunked));
+
+    ASSERT_EQ_FMT(whole.length, chunked.length, "%zu");
+    for (size_t i = 0; i < whole.length; i++) {
+        ASSERT_EQ(whole.ops[i].kind, chunked.ops[i].kind);
+        ASSERT_EQ_FMT(whole.ops[i].value, chunked.ops[i].value, "%d");
+        ASSERT_EQ_FMT(whole.ops[i].match, chunked.ops[i].match, "%zu");
+        ASSERT_EQ_FMT(whole.ops[i].source_offset,
+                chunked.ops[i].source_offset, "%zu");
+    }
+    bf_ir_free(&whole);
+    bf_ir_free(&chunked);
+
+    /* There is no need to read past a stray bracket. */
+    bf_ir_parser_init(&parser);
+    ASSERT(bf_ir_parse_chunk(&parser, "+\n", 2));
+    ASSERT_FALSE(bf_ir_parse_chunk(&parser, "-]+", 3));
+    ASSERT_FALSE(bf_ir_parse_finish(&parser, &chunked));
+    ASSERT_EQ_FMT(2lu, chunked.err_line, "%lu");
+    ASSERT_EQ_FMT(2lu, chunked.err_col, "%lu");
+    bf_ir_free(&chunked);
+
+    PASS();
+}
+
+SUITE(ir_suite) {
+    RUN_TEST(parsing_folds_runs);
+    RUN_TEST(parsing_locates_unmatched_brackets);
+    RUN_TEST(parsing_in_chunks_matches_parsing_whole);
+    RUN_TEST(optimizer_lowers_simple_loops);
+    RUN_TEST(emits_c_source);
+    RUN_TEST(emits_elf_object);
+    RUN_TEST(emits_header_with_the_runtime_context);
+    RUN_TEST(profile_is_applied_by_source_offset);
+    RUN_TEST(runs_only_selected_passes);
+    RUN_TEST(marks_expensive_pure_loops_for_memoization);
+    RUN_TEST(finds_pointer_range_and_places_bounds_checks);
+}
+
+/************************** tests for bf_lanes_run **************************/
+
+static void lane_out_of_bounds(size_t source_offset, ptrdiff_t cell) {
+    fprintf(stderr, "lane strayed to cell %td (source offset %zu)\n",
+            cell, source_offset);
+    abort();
+}
+
+/*
+ * Runs the source over the records, 16 at a time, on tapes that start with
+ * the given number of cells, and collects the output.
+ */
+static size_t run_in_lanes(const char *source, const char **lines,
+        size_t count, size_t cells, char *output, size_t size) {
+    struct bf_lane_record records[40];
+    bf_ir ir;
+    FILE *stream = tmpfile();
+
+    assert(count <= sizeof(records) / sizeof(records[0]));
+    assert(stream != NULL && bf_ir_parse(source, &ir));
+    bf_ir_optimize(&ir);
+
+    for (size_t i = 0; i < count; i++) {
+        records[i] = (struct bf_lane_record) {
+            .data = (const uint8_t *) lines[i],
+            .length = strlen(lines[i]),
+        };
+    }
+
+    bool written = bf_lanes_run(&ir, 16, cells, records, count, stream,
+            lane_out_of_bounds);
+    bf_ir_free(&ir);
+    assert(written);
+
+    rewind(stream);
+    size_t length = fread(output, 1, size - 1, stream);
+    output[length] = '\0';
+    fclose(stream);
+
+    return length;
+}
+
+TEST runs_records_in_lock_step() {
+    const char *lines[20];
+    char output[64];
+
+    for (size_t i = 0; i < 20; i++) {
+        lines[i] = (i % 3 == 0) ? "ab" : (i % 3 == 1) ? "" : "z";
+    }
+
+    /* Increment every byte of every record; records differ in length. */
+    run_in_lanes(",+[.,+]", lines, 20, 1024, output, sizeof(output));
+    ASSERT_STR_EQ("bc{bc{bc{bc{bc{bc{bc", output);
+
+    PASS();
+}
+
+TEST lanes_that_diverge_run_by_themselves() {
+    const char *lines[] = { "abc", "de", "", "fghij" };
+    char output[64];
+
+    /* Reverse each record: where p ends up depends on the record. */
+    run_in_lanes(">,+[->,+]<[.<]", lines, 4, 1024, output, sizeof(output));
+    ASSERT_STR_EQ("cbaedjihgf", output);
+
+    PASS();
+}
+
+TEST lanes_start_each_group_on_a_clear_tape() {
+    const char *lines[17];
+    char output[64];
+
+    lines[0] = "abcdef";
+    for (size_t i = 1; i < 17; i++) {
+        lines[i] = i == 16 ? "x" : "";
+    }
+
+    /* Print whatever is past the record: nothing, on a clear tape. */
+    run_in_lanes(",+[->,+]>[.>]", lines, 17, 1024, output, sizeof(output));
+    ASSERT_STR_EQ("", output);
+
+    PASS();
+}
+
+TEST lanes_tapes_grow_both_ways() {
+    const char *lines[] = { "abc", "de", "", "fghij" };
+    char output[64];
+
+    /* Starting with four cells, go left of them, then reverse each record
+     * on cells to the right of them. */
+    run_in_lanes("<<<<<<<<+.>>>>>>>>>,+[->,+]<[.<]", lines, 4, 4,
+            output, sizeof(output));
+    ASSERT_STR_EQ("\1cba\1ed\1\1jihgf", output);
+
+    PASS();
+}
+
+SUITE(lanes_suite) {
+    RUN_TEST(runs_records_in_lock_step);
+    RUN_TEST(lanes_that_diverge_run_by_themselves);
+    RUN_TEST(lanes_start_each_group_on_a_clear_tape);
+    RUN_TEST(lanes_tapes_grow_both_ways);
 }
 
 /******************* tests for allocate_executable_space *******************/
@@ -185,14 +775,230 @@ TEST space_returned_is_given_size(void) {
     PASS();
 }
 
+TEST freed_space_is_recycled(void) {
+    size_t size = sysconf(_SC_PAGESIZE) * 16;
+    bf_code_arena_stats before = bf_code_arena_statistics();
+
+    uint8_t *space = allocate_executable_space(size);
+    ASSERT_OR_LONGJMPm("Allocation failed", space != NULL);
+    ASSERT_EQ_FMTm("Chunk is not aligned to its size",
+            (uintptr_t) 0, (uintptr_t) space % size, "%" PRIuPTR);
+    ASSERT(free_executable_space(space, size));
+
+    uint8_t *again = allocate_executable_space(size);
+    ASSERT_EQm("Freed chunk was not handed out again", space, again);
+    ASSERT(free_executable_space(again, size));
+
+    bf_code_arena_stats after = bf_code_arena_statistics();
+    ASSERT_EQ_FMT(before.allocations + 2, after.allocations, "%zu");
+    ASSERT(after.recycled >= before.recycled + 1);
+    ASSERT_EQ_FMT(before.in_use, after.in_use, "%zu");
+    ASSERT(after.peak >= size);
+
+    PASS();
+}
+
+TEST dual_mapped_views_share_memory(void) {
+    size_t size = sysconf(_SC_PAGESIZE);
+    uint8_t *writable, *executable;
+
+    ASSERT_OR_LONGJMPm("Could not map twice",
+            bf_dual_map(size, &writable, &executable));
+    ASSERT(writable != executable);
+
+    /* Code written through one view runs from the other. */
+    writable[0] = X86_NOP;
+    writable[1] = X86_RET;
+    ASSERT_EQ_FMT(X86_RET, executable[1], "%hhu");
+    ((void (*)(void)) executable)();
+
+    ASSERTm("Could not unmap", bf_dual_unmap(writable, executable, size));
+    PASS();
+}
+
 SUITE(allocate_executable_suite) {
     RUN_TEST(space_returned_can_be_executed_and_freed);
     RUN_TEST(space_returned_is_given_size);
+    RUN_TEST(freed_space_is_recycled);
+    RUN_TEST(dual_mapped_views_share_memory);
+}
+
+/************************** tests for bf_universe ***************************/
+
+TEST universe_grows_when_touched() {
+    bf_universe universe;
+    ASSERT(bf_universe_create(&universe, 4096, 64 * 1024 * 1024));
+    bf_universe_watch(&universe, NULL);
+
+    ASSERT(universe.high - universe.low <= 2 * 1024 * 1024);
+    ASSERT(bf_universe_start(&universe) <= universe.origin - 64 * 1024 * 1024);
+
+    /* Touching cells far off either way makes them accessible. */
+    universe.origin[-5 * 1024 * 1024] = 42;
+    universe.origin[10 * 1024 * 1024] = 7;
+    ASSERT_EQ_FMT(42, universe.origin[-5 * 1024 * 1024], "%hhu");
+    ASSERT_EQ_FMT(7, universe.origin[10 * 1024 * 1024], "%hhu");
+    ASSERT_EQ_FMT(0, universe.origin[-1], "%hhu");
+    ASSERT(universe.low <= universe.origin - 5 * 1024 * 1024);
+    ASSERT(universe.high > universe.origin + 10 * 1024 * 1024);
+
+    bf_universe_destroy(&universe);
+    PASS();
+}
+
+TEST universe_resets_only_the_given_range() {
+    bf_universe universe;
+    size_t size = 4 * 1024 * 1024;
+    ASSERT(bf_universe_create(&universe, 2 * size, 2 * size));
+
+    memset(universe.origin - size, 0xAA, 2 * size);
+    universe.origin[-size] = 1;
+
+    /* Large enough that most of it is given back rather than zeroed. */
+    bf_universe_reset(&universe, universe.origin - size + 1,
+            universe.origin + 12345);
+    ASSERT_EQ_FMTm("Reset a cell outside of the range",
+            1, universe.origin[-size], "%hhu");
+    ASSERT_EQ_FMT(0, universe.origin[-size + 1], "%hhu");
+    ASSERT_EQ_FMT(0, universe.origin[0], "%hhu");
+    ASSERT_EQ_FMT(0, universe.origin[12344], "%hhu");
+    ASSERT_EQ_FMTm("Reset a cell outside of the range",
+            0xAA, universe.origin[12345], "%hhu");
+
+    bf_universe_destroy(&universe);
+    PASS();
+}
+
+TEST universe_file_keeps_the_tape() {
+#define test_filename __FILE__ ".universe"
+    bf_universe universe;
+    size_t page = sysconf(_SC_PAGESIZE);
+    unlink(test_filename);
+
+    ASSERT(bf_universe_create_from_file(&universe, test_filename, 1000));
+    ASSERT_EQ_FMTm("A new file is not extended to whole pages",
+            2 * page, bf_universe_size(&universe), "%zu");
+    universe.origin[0] = 42;
+    universe.origin[-(ptrdiff_t) page] = 7;
+    bf_universe_destroy(&universe);
+
+    /* The size of the file, not the one asked for, is what counts. */
+    ASSERT(bf_universe_create_from_file(&universe, test_filename, 1));
+    ASSERT_EQ_FMT(2 * page, bf_universe_size(&universe), "%zu");
+    ASSERT_EQ_FMT(42, universe.origin[0], "%hhu");
+    ASSERT_EQ_FMT(7, universe.origin[-(ptrdiff_t) page], "%hhu");
+    bf_universe_destroy(&universe);
+
+    unlink(test_filename);
+    PASS();
+#undef test_filename
+}
+
+SUITE(universe_suite) {
+    RUN_TEST(universe_grows_when_touched);
+    RUN_TEST(universe_resets_only_the_given_range);
+    RUN_TEST(universe_file_keeps_the_tape);
+}
+
+/************************ tests for zero-copy output ************************/
+
+TEST output_file_is_written_in_place() {
+#define test_filename __FILE__ ".output"
+    bf_output_buffer buffer;
+    char contents[8] = { 0 };
+    int fd = open(test_filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+    ASSERTm("Could not open " test_filename, fd >= 0);
+    ASSERT(bf_output_map(fd, &buffer));
+    ASSERT_EQ_FMT(BF_OUTPUT_WINDOW_SIZE, (size_t) (buffer.end - buffer.start),
+            "%zu");
+
+    memcpy(buffer.start, "hello", 5);
+    uint8_t *cursor = bf_output_flush(buffer.start, buffer.start + 5).cursor;
+    ASSERT_EQm("Moved on before the window was full", buffer.start + 5, cursor);
+    memcpy(cursor, "!", 1);
+    bf_output_flush(buffer.start, cursor + 1);
+    ASSERT(bf_output_close());
+
+    /* The file is cut down to just the output. */
+    lseek(fd, 0, SEEK_SET);
+    ASSERT_EQ(6, read(fd, contents, sizeof(contents)));
+    ASSERT_STR_EQ("hello!", contents);
+
+    close(fd);
+    unlink(test_filename);
+    PASS();
+#undef test_filename
+}
+
+TEST output_pages_are_spliced_into_pipes() {
+    bf_output_buffer buffer;
+    char contents[8] = { 0 };
+    int ends[2];
+
+    ASSERT_EQ(0, pipe(ends));
+    ASSERT(bf_output_splice(ends[1], &buffer));
+
+    memcpy(buffer.start, "abc", 3);
+    uint8_t *cursor = bf_output_flush(buffer.start, buffer.start + 3).cursor;
+    memcpy(cursor, "de", 2);
+    bf_output_flush(buffer.start, cursor + 2);
+    ASSERT(bf_output_close());
+    close(ends[1]);
+
+    ASSERT_EQ(5, read(ends[0], contents, sizeof(contents)));
+    ASSERT_STR_EQ("abcde", contents);
+
+    close(ends[0]);
+    PASS();
+}
+
+TEST output_is_written_behind_the_program() {
+#define test_filename __FILE__ ".output"
+    bf_output_buffer buffer;
+    uint8_t contents[256];
+    int fd = open(test_filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+    ASSERTm("Could not open " test_filename, fd >= 0);
+    ASSERT(bf_output_async(fd, &buffer));
+
+    /* Go around the ring a few times, writing up to each limit. */
+    struct bf_output_space space = { buffer.start, buffer.limit };
+    size_t total = 0;
+    while (total < 3 * BF_OUTPUT_RING_SIZE) {
+        ASSERT(space.cursor < space.limit);
+        ASSERT(space.limit <= buffer.end);
+        for (; space.cursor < space.limit; space.cursor++) {
+            *space.cursor = total++;
+        }
+        space = bf_output_flush(buffer.start, space.cursor);
+    }
+    ASSERT(bf_output_close());
+
+    ASSERT_EQ((off_t) total, lseek(fd, 0, SEEK_END));
+    lseek(fd, 2 * BF_OUTPUT_RING_SIZE - 128, SEEK_SET);
+    ASSERT_EQ(256, read(fd, contents, sizeof(contents)));
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        ASSERT_EQ((uint8_t) (i - 128), contents[i]);
+    }
+
+    close(fd);
+    unlink(test_filename);
+    PASS();
+#undef test_filename
+}
+
+SUITE(output_suite) {
+    RUN_TEST(output_file_is_written_in_place);
+    RUN_TEST(output_pages_are_spliced_into_pipes);
+    RUN_TEST(output_is_written_behind_the_program);
 }
 
 /*************************** tests for compile() ***************************/
 
 #define EXEC_MEMORY_SIZE (sysconf(_SC_PAGESIZE) - 1)
+/* Compile into memory without ever resizing it. */
+#define INDETERMINATE_SPACE_FOR_TESTS 0
 static uint8_t universe[256] = { 0 };
 static uint8_t *memory = NULL;
 static size_t page_size = 0;
@@ -470,6 +1276,947 @@ TEST compiles_programs() {
     PASS();   
 }
 
+/*
+ * Compiles the program as the REPL does a line, for a tape that another
+ * program left behind, and runs it there.
+ */
+static void run_on_kept_tape(const char *source, uint8_t *tape) {
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_ir ir;
+
+    assert(bf_ir_parse(source, &ir));
+    ir.blank_tape = false;
+    bf_ir_optimize(&ir);
+
+    bf_compile_result result = bf_compile_ir(&ir, &text, NULL);
+    assert(result.status == BF_COMPILE_SUCCESS);
+    bf_ir_free(&ir);
+
+    result.program((struct bf_runtime_context) {
+        .universe = tape,
+        .output_byte = dummy_output,
+    });
+}
+
+TEST repl_lines_carry_on_from_the_last_tape() {
+    run_on_kept_tape("++++++++[>++++++++<-]>+<+", universe);
+    ASSERTm("Output called too early", output == OUTPUT_NOT_CALLED);
+
+    /* This loop is not dead: the last line left *p non-zero. */
+    run_on_kept_tape("[>.<-]", universe);
+    ASSERT_FALSEm("Output never called", output == OUTPUT_NOT_CALLED);
+    ASSERT_EQ_FMTm("Unexected value written", 'A', output, "%d");
+
+    PASS();
+}
+
+TEST runs_carry_on_from_the_universe_file() {
+#define test_filename __FILE__ ".universe"
+    bf_universe kept;
+    unlink(test_filename);
+
+    ASSERT(bf_universe_create_from_file(&kept, test_filename, 1000));
+    run_on_kept_tape("++++++++[>++++++++<-]>+<+", kept.origin);
+    bf_universe_destroy(&kept);
+    ASSERTm("Output called too early", output == OUTPUT_NOT_CALLED);
+
+    /* The second run starts with a loop over the tape the first left. */
+    ASSERT(bf_universe_create_from_file(&kept, test_filename, 1));
+    run_on_kept_tape("[>.<-]", kept.origin);
+    bf_universe_destroy(&kept);
+    ASSERT_FALSEm("Output never called", output == OUTPUT_NOT_CALLED);
+    ASSERT_EQ_FMTm("Unexected value written", 'A', output, "%d");
+
+    unlink(test_filename);
+    PASS();
+#undef test_filename
+}
+
+TEST counts_loop_entries_and_iterations() {
+    uint64_t counters[4] = { 0 };
+    bf_ir ir;
+    ASSERT(bf_ir_parse("+++[>++[>+<-]<-]", &ir));
+
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_codegen_options options = { .count_loops = true };
+    bf_compile_result result = bf_compile_ir(&ir, &text, &options);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+    ASSERT_EQ_FMT((size_t) 4, bf_profile_counter_count(&ir), "%zu");
+
+    result.program((struct bf_runtime_context) {
+        .universe = universe,
+        .loop_counters = counters,
+    });
+
+    ASSERT_EQ_FMTm("Outer loop entries", (uint64_t) 1, counters[0], "%" PRIu64);
+    ASSERT_EQ_FMTm("Outer loop iterations", (uint64_t) 3, counters[1], "%" PRIu64);
+    ASSERT_EQ_FMTm("Inner loop entries", (uint64_t) 3, counters[2], "%" PRIu64);
+    ASSERT_EQ_FMTm("Inner loop iterations", (uint64_t) 6, counters[3], "%" PRIu64);
+    ASSERT_EQ_FMT(6, universe[2], "%hhu");
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
+TEST hot_loops_are_aligned() {
+    bf_ir ir;
+    ASSERT(bf_ir_parse("++[>+++[>,<-]<-]", &ir));
+    ASSERT_EQ(BF_IR_LOOP, ir.ops[1].kind);
+    ir.ops[1].iterations = 1000000;
+
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_compile_result result = bf_compile_ir(&ir, &text, NULL);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+
+    result.program((struct bf_runtime_context) {
+        .universe = universe,
+        .input_byte = dummy_input,
+    });
+    ASSERT_EQ_FMT(DETERMINISTIC_INPUT, universe[2], "%hhu");
+    ASSERT_EQ_FMT(0, universe[0], "%hhu");
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
+TEST hot_loops_are_unrolled() {
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_ir ir;
+    ASSERT(bf_ir_parse("+++++++[>+++<-]>", &ir));
+    ASSERT_EQ(BF_IR_LOOP, ir.ops[1].kind);
+
+    bf_compile_result plain = bf_compile_ir(&ir, &text, NULL);
+    ASSERT_EQm("Failed to compile", plain.status, BF_COMPILE_SUCCESS);
+
+    /* Many iterations per entry: the body is written out more than once. */
+    ir.ops[1].entries = 1000;
+    ir.ops[1].iterations = 1000000;
+    text.space = memory + plain.code_length;
+    bf_compile_result result = bf_compile_ir(&ir, &text, NULL);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+    ASSERT(result.code_length > plain.code_length + 3 * 8);
+
+    /* Seven iterations leave the loop from between copies. */
+    result.program((struct bf_runtime_context) {
+        .universe = universe,
+    });
+    ASSERT_EQ_FMT(0, universe[0], "%hhu");
+    ASSERT_EQ_FMT(21, universe[1], "%hhu");
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
+TEST memoized_loops_are_skipped_on_a_hit() {
+    uint64_t counters[6] = { 0 };
+    bf_ir ir;
+    ASSERT(bf_ir_parse("++[>+++[>++++[>+<-]<-]>>[-]<<<-]", &ir));
+
+    /* Memoize the middle loop, which touches cells 1 to 3. */
+    ASSERT_EQ(BF_IR_LOOP, ir.ops[4].kind);
+    ir.ops[4].memoize = true;
+    ir.ops[4].window_low = 0;
+    ir.ops[4].window_high = 2;
+
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_codegen_options options = { .count_loops = true, .memoize = true };
+    bf_compile_result result = bf_compile_ir(&ir, &text, &options);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+
+    struct bf_memo *memo = bf_memo_create(&ir, universe, sizeof(universe));
+    ASSERT(memo != NULL);
+
+    result.program((struct bf_runtime_context) {
+        .universe = universe,
+        .loop_counters = counters,
+        .memo = memo,
+        .memo_enter = bf_memo_enter,
+        .memo_leave = bf_memo_leave,
+    });
+
+    /* The second time around, the middle loop's body never ran. */
+    ASSERT_EQ_FMTm("Middle loop entries", (uint64_t) 2, counters[2], "%" PRIu64);
+    ASSERT_EQ_FMTm("Middle loop iterations", (uint64_t) 3, counters[3], "%" PRIu64);
+    ASSERT_EQ_FMT(0, universe[0], "%hhu");
+    ASSERT_EQ_FMT(0, universe[1], "%hhu");
+    ASSERT_EQ_FMT(0, universe[2], "%hhu");
+    ASSERT_EQ_FMT(0, universe[3], "%hhu");
+
+    bf_memo_free(memo);
+    bf_ir_free(&ir);
+    PASS();
+}
+
+TEST maps_code_back_to_source() {
+    bf_source_map map = { 0 };
+    bf_ir ir;
+    size_t offset = 0;
+    ASSERT(bf_ir_parse("+\n>>.", &ir));
+
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_codegen_options options = { .source_map = &map };
+    bf_compile_result result = bf_compile_ir(&ir, &text, &options);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+    ASSERT_EQ_FMT((size_t) 3, map.length, "%zu");
+
+    /* The prologue comes from nowhere; the last instruction from the ".". */
+    ASSERT_FALSE(bf_source_map_lookup(&map, 0, &offset));
+    ASSERT(bf_source_map_lookup(&map, map.code_offsets[1], &offset));
+    ASSERT_EQ_FMT((size_t) 2, offset, "%zu");
+    ASSERT(bf_source_map_lookup(&map, result.code_length - 1, &offset));
+    ASSERT_EQ_FMT((size_t) 4, offset, "%zu");
+
+    bf_source_map_free(&map);
+    bf_ir_free(&ir);
+    PASS();
+}
+
+TEST circular_tape_wraps_around() {
+    bf_ir ir;
+    ASSERT(bf_ir_parse("+<+>>++[<<+>>-]", &ir));
+    bf_ir_run_passes(&ir, BF_PASS_ALL & ~BF_PASS_OFFSET, NULL);
+
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_codegen_options options = { .wrap_mask = sizeof(universe) - 1 };
+    bf_compile_result result = bf_compile_ir(&ir, &text, &options);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+
+    result.program((struct bf_runtime_context) {
+        .universe = universe,
+    });
+
+    ASSERT_EQ_FMT(1, universe[0], "%hhu");
+    ASSERT_EQ_FMT(0, universe[1], "%hhu");
+    ASSERT_EQ_FMTm("Did not wrap around", 3, universe[255], "%hhu");
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
+static jmp_buf out_of_bounds_exit;
+static uint32_t out_of_bounds_source;
+static uint8_t *out_of_bounds_cell;
+
+static void leave_out_of_bounds(uint32_t source_offset, uint8_t *cell,
+        uint8_t *output_cursor) {
+    (void) output_cursor;
+    out_of_bounds_source = source_offset;
+    out_of_bounds_cell = cell;
+    longjmp(out_of_bounds_exit, 1);
+}
+
+TEST bounds_checks_stop_stray_pointers() {
+    bf_ir ir;
+    ASSERT(bf_ir_parse("+[>+]", &ir));
+    bf_ir_place_bounds_checks(&ir);
+
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_codegen_options options = { .bounds_check = true };
+    bf_compile_result result = bf_compile_ir(&ir, &text, &options);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+
+    if (setjmp(out_of_bounds_exit) == 0) {
+        result.program((struct bf_runtime_context) {
+            .universe = universe,
+            .tape_start = universe,
+            .tape_end = universe + 16,
+            .out_of_bounds = leave_out_of_bounds,
+        });
+        FAILm("Ran off the end of the tape");
+    }
+
+    ASSERT_EQ_FMT(2u, out_of_bounds_source, "%u");
+    ASSERT_EQ(universe + 16, out_of_bounds_cell);
+    ASSERT_EQ_FMT(1, universe[15], "%hhu");
+    ASSERT_EQ_FMTm("Touched a cell past the end", 0, universe[16], "%hhu");
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
+TEST tracks_the_cells_it_touches() {
+    bf_ir ir;
+    ASSERT(bf_ir_parse("-<<+>>>+[>]", &ir));
+    bf_ir_place_bounds_checks(&ir);
+
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_codegen_options options = { .track_dirty = true };
+    bf_compile_result result = bf_compile_ir(&ir, &text, &options);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+
+    struct bf_dirty_range dirty = { (uint8_t *) UINTPTR_MAX, NULL };
+    result.program((struct bf_runtime_context) {
+        .universe = universe + 128,
+        .dirty = &dirty,
+    });
+
+    ASSERT_EQ(universe + 126, dirty.low);
+    ASSERT_EQ(universe + 131, dirty.high);
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
+TEST cached_code_runs_from_the_cache_file() {
+#define test_filename __FILE__ ".code"
+    bf_ir ir;
+    ASSERT(bf_ir_parse("+++[>++<-]>.", &ir));
+
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_source_map map = { 0 };
+    bf_codegen_options options = { .source_map = &map };
+    bf_compile_result result = bf_compile_ir(&ir, &text, &options);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+    ASSERT(bf_cache_store(test_filename, &ir, memory, result.code_length,
+                &map));
+
+    bf_cached_program cached;
+    ASSERTm("Could not load " test_filename,
+            bf_cache_load(test_filename, &cached));
+    unlink(test_filename);
+
+    ASSERT(cached.bounded);
+    ASSERT_EQ_FMT((int64_t) 0, cached.low, "%" PRId64);
+    ASSERT_EQ_FMT((int64_t) 1, cached.high, "%" PRId64);
+    ASSERT_EQ_FMT(map.length, cached.map.length, "%zu");
+    ASSERT_EQ_FMT(map.source_offsets[map.length - 1],
+            cached.map.source_offsets[map.length - 1], "%zu");
+
+    cached.program((struct bf_runtime_context) {
+        .universe = universe,
+        .output_byte = dummy_output,
+    });
+    ASSERT_EQ_FMT(6, output, "%d");
+    bf_cache_release(&cached);
+
+    /* Code compiled for another ABI is never loaded (it follows the
+     * magic). */
+    uint64_t stale = BF_CODE_ABI_VERSION + 1;
+    ASSERT(bf_cache_store(test_filename, &ir, memory, result.code_length,
+                &map));
+    FILE *stream = fopen(test_filename, "r+b");
+    ASSERT(stream != NULL);
+    fseek(stream, 16, SEEK_SET);
+    fwrite(&stale, sizeof(stale), 1, stream);
+    fclose(stream);
+    ASSERT_FALSE(bf_cache_load(test_filename, &cached));
+    unlink(test_filename);
+
+    bf_source_map_free(&map);
+    bf_ir_free(&ir);
+    PASS();
+#undef test_filename
+}
+
+/* Everything flushed from a buffered program, and when. */
+static uint8_t flushed[16];
+static size_t flushed_length;
+static size_t flushes;
+/* How much room each flush makes. */
+static size_t flush_room;
+
+static struct bf_output_space record_flush(uint8_t *start, uint8_t *cursor) {
+    memcpy(flushed + flushed_length, start, cursor - start);
+    flushed_length += cursor - start;
+    flushes++;
+    return (struct bf_output_space) { start, start + flush_room };
+}
+
+static uint8_t flushed_before_input(void) {
+    return flushed_length;
+}
+
+TEST buffered_output_is_flushed_when_needed() {
+    bf_ir ir;
+    ASSERT(bf_ir_parse("+.+.+.+.+.,.", &ir));
+
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_codegen_options options = { .buffer_output = true };
+    bf_compile_result result = bf_compile_ir(&ir, &text, &options);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+
+    uint8_t buffer[2];
+    flushed_length = 0;
+    flushes = 0;
+    flush_room = sizeof(buffer);
+    result.program((struct bf_runtime_context) {
+        .universe = universe,
+        .input_byte = flushed_before_input,
+        .output_start = buffer,
+        .output_end = buffer + sizeof(buffer),
+        .flush_output = record_flush,
+    });
+
+    /* Full twice, then before the input, then before returning. */
+    ASSERT_EQ_FMT((size_t) 6, flushed_length, "%zu");
+    ASSERT_EQ_FMT((size_t) 4, flushes, "%zu");
+    ASSERT_EQ(0, memcmp("\1\2\3\4\5\5", flushed, 6));
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
+TEST buffered_output_stops_at_the_limit() {
+    bf_ir ir;
+    ASSERT(bf_ir_parse("+.+.+.", &ir));
+
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_codegen_options options = { .buffer_output = true };
+    bf_compile_result result = bf_compile_ir(&ir, &text, &options);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+
+    uint8_t buffer[2];
+    flushed_length = 0;
+    flushes = 0;
+    flush_room = 1;
+    result.program((struct bf_runtime_context) {
+        .universe = universe,
+        .output_start = buffer,
+        .output_end = buffer + sizeof(buffer),
+        .flush_output = record_flush,
+    });
+
+    /* Full at the end, then at the limit given by the flush, then done. */
+    ASSERT_EQ_FMT((size_t) 3, flushed_length, "%zu");
+    ASSERT_EQ_FMT((size_t) 3, flushes, "%zu");
+    ASSERT_EQ(0, memcmp("\1\2\3", flushed, 3));
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
+/* Input for a buffered program, handed out a little at a time. */
+static const char *unread_input;
+static size_t fills;
+
+static uint8_t *fill_from_unread_input(uint8_t *start, uint8_t *end) {
+    size_t length = strlen(unread_input);
+    if (length > (size_t) (end - start)) {
+        length = end - start;
+    }
+
+    memcpy(start, unread_input, length);
+    unread_input += length;
+    fills++;
+    return start + length;
+}
+
+TEST buffered_input_is_filled_when_needed() {
+    bf_ir ir;
+    ASSERT(bf_ir_parse(",>,>,>,>,", &ir));
+
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_codegen_options options = { .buffer_input = true };
+    bf_compile_result result = bf_compile_ir(&ir, &text, &options);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+
+    uint8_t buffer[2];
+    unread_input = "abc";
+    fills = 0;
+    result.program((struct bf_runtime_context) {
+        .universe = universe,
+        .input_start = buffer,
+        .input_end = buffer + sizeof(buffer),
+        .fill_input = fill_from_unread_input,
+    });
+
+    /* Two bytes, one byte, then end-of-file twice. */
+    ASSERT_EQ(0, memcmp("abc\xff\xff", universe, 5));
+    ASSERT_EQ_FMT((size_t) 4, fills, "%zu");
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
+static size_t copies;
+
+static void count_copy(struct bf_buffered_io *io, uint8_t until,
+        const uint8_t *table, const struct bf_runtime_context *context) {
+    copies++;
+    bf_runtime_copy_input(io, until, table, context);
+}
+
+TEST copy_loops_copy_all_at_once() {
+    bf_ir ir;
+    ASSERT(bf_ir_parse(",+[-.,+],.", &ir));
+    bf_ir_optimize(&ir);
+
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_codegen_options options = {
+        .buffer_output = true,
+        .buffer_input = true,
+        .copy_loops = true,
+    };
+    bf_compile_result result = bf_compile_ir(&ir, &text, &options);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+
+    uint8_t input[4], output[3];
+    unread_input = "abcdefgh\xffz";
+    flushed_length = 0;
+    flush_room = sizeof(output);
+    copies = 0;
+    result.program((struct bf_runtime_context) {
+        .universe = universe,
+        .output_start = output,
+        .output_end = output + sizeof(output),
+        .flush_output = record_flush,
+        .input_start = input,
+        .input_end = input + sizeof(input),
+        .fill_input = fill_from_unread_input,
+        .copy_input = count_copy,
+    });
+
+    /* The loop ends on the 0xFF, which is left for it to read. */
+    ASSERT_EQ_FMT((size_t) 1, copies, "%zu");
+    ASSERT_EQ_FMT((size_t) 9, flushed_length, "%zu");
+    ASSERT_EQ(0, memcmp("abcdefghz", flushed, 9));
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
+TEST filter_loops_look_bytes_up() {
+    bf_ir ir;
+    /* Outputs every byte plus one, by way of a scratch cell. */
+    ASSERT(bf_ir_parse(",+[->+<[->+<]>.[-]<,+],.", &ir));
+    bf_ir_optimize(&ir);
+
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_codegen_options options = {
+        .buffer_output = true,
+        .buffer_input = true,
+        .copy_loops = true,
+    };
+    bf_compile_result result = bf_compile_ir(&ir, &text, &options);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+
+    uint8_t input[4], output[64];
+    unread_input = "HAL 9000\xffz";
+    flushed_length = 0;
+    flush_room = sizeof(output);
+    copies = 0;
+    result.program((struct bf_runtime_context) {
+        .universe = universe,
+        .output_start = output,
+        .output_end = output + sizeof(output),
+        .flush_output = record_flush,
+        .input_start = input,
+        .input_end = input + sizeof(input),
+        .fill_input = fill_from_unread_input,
+        .copy_input = count_copy,
+    });
+
+    ASSERT_EQ_FMT((size_t) 1, copies, "%zu");
+    ASSERT_EQ_FMT((size_t) 9, flushed_length, "%zu");
+    ASSERT_EQ(0, memcmp("IBM!:111z", flushed, 9));
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
+static int copied_to;
+
+static struct bf_output_space write_to_copied_to(uint8_t *start,
+        uint8_t *cursor) {
+    /* Checked by what is read from the other end. */
+    ssize_t written = write(copied_to, start, cursor - start);
+    (void) written;
+    return (struct bf_output_space) { start, start + 16 };
+}
+
+TEST mapped_input_is_copied_by_the_kernel() {
+#define test_filename __FILE__ ".output"
+    static char contents[32 * 1024];
+    char skipped[4];
+    size_t length = 0;
+    int ends[2];
+    int fd = open(test_filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+    /* Long enough to be worth a splice(), and stopped short by a 0. */
+    ASSERTm("Could not open " test_filename, fd >= 0);
+    memset(contents, 'x', 20000);
+    memcpy(contents, "skip<", 5);
+    memcpy(contents + 20000, "\0>", 2);
+    ASSERT_EQ(20002, write(fd, contents, 20002));
+    ASSERT_EQ(0, lseek(fd, 0, SEEK_SET));
+    ASSERT_EQ(4, read(fd, skipped, sizeof(skipped)));
+
+    const uint8_t *input = slurp_input(fd, &length);
+    ASSERTm("Could not map " test_filename, input != NULL);
+    ASSERT_EQ(0, pipe(ends));
+    copied_to = ends[1];
+    bf_runtime_copy_in_kernel(input, fd, 4, ends[1]);
+
+    /* What was output before the copy goes out before it. */
+    uint8_t output[16] = "[";
+    struct bf_runtime_context context = {
+        .output_start = output,
+        .output_end = output + sizeof(output),
+        .flush_output = write_to_copied_to,
+        .input_start = (uint8_t *) input,
+        .input_end = (uint8_t *) input + length,
+    };
+    struct bf_buffered_io io = {
+        .output_cursor = output + 1,
+        .output_limit = output + sizeof(output),
+        .input_cursor = (uint8_t *) input,
+        .input_limit = (uint8_t *) input + length,
+    };
+    bf_runtime_copy_input(&io, 0, NULL, &context);
+    bf_runtime_copy_in_kernel(NULL, -1, 0, -1);
+
+    ASSERT_EQ(input + 19996, io.input_cursor);
+    *io.output_cursor++ = ']';
+    write_to_copied_to(output, io.output_cursor);
+    close(ends[1]);
+
+    ASSERT_EQ(19998, read(ends[0], contents, sizeof(contents)));
+    ASSERT_EQ(0, memcmp("[<xxx", contents, 5));
+    ASSERT_EQ(0, memcmp("xxx]", contents + 19994, 4));
+
+    close(ends[0]);
+    ASSERT(unslurp_input(input, length));
+    close(fd);
+    unlink(test_filename);
+    PASS();
+#undef test_filename
+}
+
+static size_t writes;
+
+static void count_write(struct bf_output_space *space, const uint8_t *bytes,
+        uint32_t length, bool repeat, const struct bf_runtime_context *context) {
+    writes++;
+    bf_runtime_write_output(space, bytes, length, repeat, context);
+}
+
+static uint8_t input_x(void) {
+    return 'x';
+}
+
+TEST coalesced_output_is_written_at_once() {
+    bf_ir ir;
+    ASSERT(bf_ir_parse(",....[-]+++.+.+.", &ir));
+    bf_ir_optimize(&ir);
+
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_codegen_options options = {
+        .buffer_output = true,
+        .coalesce_output = true,
+    };
+    bf_compile_result result = bf_compile_ir(&ir, &text, &options);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+
+    /* Neither run fits, so both are written a little at a time. */
+    uint8_t buffer[3];
+    flushed_length = 0;
+    flush_room = sizeof(buffer);
+    writes = 0;
+    result.program((struct bf_runtime_context) {
+        .universe = universe,
+        .input_byte = input_x,
+        .output_start = buffer,
+        .output_end = buffer + sizeof(buffer),
+        .flush_output = record_flush,
+        .write_output = count_write,
+    });
+
+    ASSERT_EQ_FMT((size_t) 2, writes, "%zu");
+    ASSERT_EQ_FMT((size_t) 7, flushed_length, "%zu");
+    ASSERT_EQ(0, memcmp("xxxx\3\4\5", flushed, 7));
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
+TEST opening_is_run_ahead_of_time() {
+    bf_ir ir;
+    ASSERT(bf_ir_parse("++++++++[>++++++++<-]>+.+.+.", &ir));
+    bf_ir_optimize(&ir);
+
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_codegen_options options = {
+        .buffer_output = true,
+        .coalesce_output = true,
+        .blank_tape = true,
+    };
+    bf_compile_result result = bf_compile_ir(&ir, &text, &options);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+
+    uint8_t buffer[16];
+    flushed_length = 0;
+    flush_room = sizeof(buffer);
+    writes = 0;
+    result.program((struct bf_runtime_context) {
+        .universe = universe,
+        .output_start = buffer,
+        .output_end = buffer + sizeof(buffer),
+        .flush_output = record_flush,
+        .write_output = count_write,
+    });
+
+    /* The loop never runs; only its result is left on the tape. */
+    ASSERT_EQ_FMT((size_t) 1, writes, "%zu");
+    ASSERT_EQ_FMT((size_t) 3, flushed_length, "%zu");
+    ASSERT_EQ(0, memcmp("ABC", flushed, 3));
+    ASSERT_EQ_FMT(0, universe[0], "%hhu");
+    ASSERT_EQ_FMT('C', universe[1], "%hhu");
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
+TEST opening_resumes_in_an_unrolled_loop() {
+    bf_ir ir;
+    /* The opening runs out of time in the innermost loop, then prints '1'. */
+    ASSERT(bf_ir_parse("-[>-[>-[---]<-]<-]"
+                "+++++++++++++++++++++++++++++++++++++++++++++++++.", &ir));
+    bf_ir_optimize(&ir);
+
+    /* As a profile would have it: every loop is hot, and goes around many
+     * times each time, which unrolls the innermost. */
+    for (size_t op = 0; op < ir.length; op++) {
+        if (ir.ops[op].kind == BF_IR_LOOP) {
+            ir.ops[op].entries = 1000;
+            ir.ops[op].iterations = 1000000;
+        }
+    }
+
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_codegen_options options = {
+        .buffer_output = true,
+        .coalesce_output = true,
+        .blank_tape = true,
+    };
+    bf_compile_result result = bf_compile_ir(&ir, &text, &options);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+
+    uint8_t buffer[16];
+    memset(universe, 0, sizeof(universe));
+    flushed_length = 0;
+    flush_room = sizeof(buffer);
+    result.program((struct bf_runtime_context) {
+        .universe = universe,
+        .output_start = buffer,
+        .output_end = buffer + sizeof(buffer),
+        .flush_output = record_flush,
+        .write_output = count_write,
+    });
+
+    ASSERT_EQ_FMT((size_t) 1, flushed_length, "%zu");
+    ASSERT_EQ_FMT('1', flushed[0], "%hhu");
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
+TEST opening_is_run_with_a_profile() {
+#define test_filename __FILE__ ".profile"
+    const char *source = "++++++++[>++++++++<-]>+.+.+.";
+    uint64_t counters[2] = { 0 };
+    uint8_t buffer[16];
+    bf_profile profile;
+    bf_ir ir;
+
+    /* Profile a run first, which counts the loop instead. */
+    ASSERT(bf_ir_parse(source, &ir));
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_codegen_options options = {
+        .count_loops = true,
+        .buffer_output = true,
+        .coalesce_output = true,
+        .blank_tape = true,
+    };
+    bf_compile_result result = bf_compile_ir(&ir, &text, &options);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+
+    memset(universe, 0, sizeof(universe));
+    flushed_length = 0;
+    flush_room = sizeof(buffer);
+    result.program((struct bf_runtime_context) {
+        .universe = universe,
+        .output_start = buffer,
+        .output_end = buffer + sizeof(buffer),
+        .flush_output = record_flush,
+        .write_output = count_write,
+        .loop_counters = counters,
+    });
+    ASSERT_EQ_FMT((size_t) 3, flushed_length, "%zu");
+    ASSERT(bf_profile_write(test_filename, &ir, counters));
+    bf_ir_free(&ir);
+
+    /* Then run the opening with the profile applied. */
+    ASSERT(bf_ir_parse(source, &ir));
+    ASSERTm("Could not read " test_filename,
+            bf_profile_read(test_filename, &profile));
+    bf_profile_apply(&profile, &ir);
+    bf_profile_free(&profile);
+    unlink(test_filename);
+    ASSERT_EQ(BF_IR_LOOP, ir.ops[1].kind);
+    ASSERT_EQ_FMT((uint64_t) 8, ir.ops[1].iterations, "%" PRIu64);
+
+    options.count_loops = false;
+    text.space = memory + result.code_length;
+    result = bf_compile_ir(&ir, &text, &options);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+
+    memset(universe, 0, sizeof(universe));
+    flushed_length = 0;
+    writes = 0;
+    result.program((struct bf_runtime_context) {
+        .universe = universe,
+        .output_start = buffer,
+        .output_end = buffer + sizeof(buffer),
+        .flush_output = record_flush,
+        .write_output = count_write,
+    });
+
+    /* All of it was known in advance, and written at once. */
+    ASSERT_EQ_FMT((size_t) 1, writes, "%zu");
+    ASSERT_EQ_FMT((size_t) 3, flushed_length, "%zu");
+    ASSERT_EQ(0, memcmp("ABC", flushed, 3));
+    ASSERT_EQ_FMT('C', universe[1], "%hhu");
+
+    bf_ir_free(&ir);
+    PASS();
+#undef test_filename
+}
+
+/* Each stage of a test pipeline runs the same program, on a tape of its own. */
+static uint8_t stage_tapes[2][16];
+static enum bf_pipe_ends stage_ends[2];
+
+static void run_test_stage(size_t i, void *data) {
+    program_t *program = data;
+    uint8_t input[4], output[8];
+    struct bf_runtime_context context = {
+        .universe = stage_tapes[i],
+        .output_start = output,
+        .output_end = output + sizeof(output),
+        .flush_output = record_flush,
+        .input_start = input,
+        .input_end = input + sizeof(input),
+        .fill_input = fill_from_unread_input,
+    };
+
+    stage_ends[i] = bf_pipe_connect(&context);
+    (*program)(context);
+}
+
+TEST pipelines_connect_stages() {
+    bf_ir ir;
+    /* Outputs every byte plus one. */
+    ASSERT(bf_ir_parse(",+[.,+]", &ir));
+    bf_ir_optimize(&ir);
+
+    bf_program_text text = (bf_program_text) {
+        .space = memory,
+        .allocated_space = INDETERMINATE_SPACE_FOR_TESTS,
+        .should_resize = false,
+    };
+    bf_codegen_options options = {
+        .buffer_output = true,
+        .buffer_input = true,
+    };
+    bf_compile_result result = bf_compile_ir(&ir, &text, &options);
+    ASSERT_EQm("Failed to compile", result.status, BF_COMPILE_SUCCESS);
+
+    memset(stage_tapes, 0, sizeof(stage_tapes));
+    unread_input = "HAL 9000\xff";
+    flushed_length = 0;
+    flush_room = 8;
+    ASSERT(bf_pipe_run(2, run_test_stage, &result.program));
+
+    /* Only the first reads the input, and only the last writes output. */
+    ASSERT_EQ(BF_PIPE_OUTPUT, stage_ends[0]);
+    ASSERT_EQ(BF_PIPE_INPUT, stage_ends[1]);
+    ASSERT_EQ_FMT((size_t) 8, flushed_length, "%zu");
+    ASSERT_EQ(0, memcmp("JCN\";222", flushed, 8));
+
+    /* Not a stage: nothing is connected. */
+    struct bf_runtime_context context = { .universe = universe };
+    ASSERT_EQ(0, bf_pipe_connect(&context));
+
+    bf_ir_free(&ir);
+    PASS();
+}
+
 SUITE(compile_suite) {
     GREATEST_SET_SETUP_CB(setup_compile, NULL);
     GREATEST_SET_TEARDOWN_CB(teardown_compile, NULL);
@@ -487,6 +2234,28 @@ SUITE(compile_suite) {
     RUN_TEST(errors_on_open_bracket);
     RUN_TEST(compiles_programs_larger_than_one_page);
     RUN_TEST(compiles_programs);
+    RUN_TEST(repl_lines_carry_on_from_the_last_tape);
+    RUN_TEST(runs_carry_on_from_the_universe_file);
+    RUN_TEST(counts_loop_entries_and_iterations);
+    RUN_TEST(hot_loops_are_aligned);
+    RUN_TEST(hot_loops_are_unrolled);
+    RUN_TEST(memoized_loops_are_skipped_on_a_hit);
+    RUN_TEST(maps_code_back_to_source);
+    RUN_TEST(circular_tape_wraps_around);
+    RUN_TEST(bounds_checks_stop_stray_pointers);
+    RUN_TEST(tracks_the_cells_it_touches);
+    RUN_TEST(buffered_output_is_flushed_when_needed);
+    RUN_TEST(buffered_output_stops_at_the_limit);
+    RUN_TEST(buffered_input_is_filled_when_needed);
+    RUN_TEST(copy_loops_copy_all_at_once);
+    RUN_TEST(filter_loops_look_bytes_up);
+    RUN_TEST(mapped_input_is_copied_by_the_kernel);
+    RUN_TEST(coalesced_output_is_written_at_once);
+    RUN_TEST(opening_is_run_ahead_of_time);
+    RUN_TEST(opening_resumes_in_an_unrolled_loop);
+    RUN_TEST(opening_is_run_with_a_profile);
+    RUN_TEST(pipelines_connect_stages);
+    RUN_TEST(cached_code_runs_from_the_cache_file);
 }
 
 
@@ -500,7 +2269,11 @@ int main(int argc, char **argv) {
 
     RUN_SUITE(argument_parsing_suite);
     RUN_SUITE(slurp_suite);
+    RUN_SUITE(ir_suite);
+    RUN_SUITE(lanes_suite);
     RUN_SUITE(allocate_executable_suite);
+    RUN_SUITE(universe_suite);
+    RUN_SUITE(output_suite);
     RUN_SUITE(compile_suite);
 
     GREATEST_MAIN_END();        /* display results */